@@ -0,0 +1,199 @@
+#pragma once
+
+// Keyframed joint rotation clips.
+//
+// A clip has one track per joint, and every track its own number of keys
+// (a joint that doesn't move needs one). Key rotations are stored with the
+// "smallest three" encoding: the largest of the four components is dropped
+// (it follows from the unit length) and the other three, which lie in
+// [-1/sqrt(2), 1/sqrt(2)], are quantized to 15 bits each. The two spare
+// bits say which component was dropped. That is 6 bytes per key instead of
+// 16, with an error of about 1e-4 radians.
+//
+// Sampling goes through a ClipCursor, which remembers per track the segment
+// of the previous sample with both of its keys decoded. Sequential playback
+// stays in that segment or moves to the next one, so it is O(1) per joint;
+// jumps fall back to a binary search over the key times. Segments that
+// turn less than 15 degrees are interpolated with a normalized lerp, which
+// stays within 1e-4 radians of slerp there (below the quantization error)
+// and costs no trigonometry.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <eigen>
+
+struct PackedQuat
+{
+	uint16_t c[3];	// 15-bit components; the top bits of c[0] and c[1] index the dropped one
+};
+
+inline PackedQuat packQuat(const Eigen::Quaternionf &p_q)
+{
+	const float v[4] = { p_q.x(), p_q.y(), p_q.z(), p_q.w() };
+	int largest = 0;
+	for (int i = 1; i < 4; ++i)
+	{
+		if (std::fabs(v[i]) > std::fabs(v[largest])) largest = i;
+	}
+	// q and -q are the same rotation; make the dropped component positive
+	const float sign = v[largest] < 0.0f ? -1.0f : 1.0f;
+	const float scale = 1.0f / std::sqrt(std::max(v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3], 1e-30f));
+
+	PackedQuat p;
+	for (int i = 0, k = 0; i < 4; ++i)
+	{
+		if (i == largest) continue;
+		// [-1/sqrt(2), 1/sqrt(2)] -> [0, 32767]
+		const float u = (sign * scale * v[i] * 0.70710678f + 0.5f) * 32767.0f + 0.5f;
+		p.c[k++] = (uint16_t)std::min(std::max(u, 0.0f), 32767.0f);
+	}
+	p.c[0] |= uint16_t((largest & 1) << 15);
+	p.c[1] |= uint16_t((largest >> 1) << 15);
+	return p;
+}
+
+inline Eigen::Quaternionf unpackQuat(const PackedQuat &p_p)
+{
+	const int largest = (p_p.c[0] >> 15) | ((p_p.c[1] >> 15) << 1);
+	float v[4];
+	float sum = 0.0f;
+	for (int i = 0, k = 0; i < 4; ++i)
+	{
+		if (i == largest) continue;
+		v[i] = (float(p_p.c[k++] & 0x7fff) / 32767.0f - 0.5f) * 1.41421356f;
+		sum += v[i] * v[i];
+	}
+	v[largest] = std::sqrt(std::max(1.0f - sum, 0.0f));
+	Eigen::Quaternionf q(v[3], v[0], v[1], v[2]);
+	q.normalize();
+	return q;
+}
+
+class AnimationClip
+{
+public:
+	float duration = 0.0f;
+	std::vector<unsigned> trackStart;	// track j is keys [trackStart[j], trackStart[j + 1])
+	std::vector<float> keyTimes;		// ascending within a track
+	std::vector<PackedQuat> keyRotations;
+
+	unsigned numTracks() const { return trackStart.empty() ? 0 : (unsigned)trackStart.size() - 1; }
+	unsigned numKeys(unsigned p_track) const { return trackStart[p_track + 1] - trackStart[p_track]; }
+	size_t memoryBytes() const { return trackStart.size() * sizeof(unsigned) + keyTimes.size() * sizeof(float) + keyRotations.size() * sizeof(PackedQuat); }
+
+	void clear(float p_duration)
+	{
+		duration = p_duration;
+		trackStart.assign(1, 0);
+		keyTimes.clear();
+		keyRotations.clear();
+	}
+
+	// tracks are added in joint order; p_times must be ascending and
+	// nonempty
+	void addTrack(const std::vector<float> &p_times, const std::vector<Eigen::Quaternionf> &p_rotations)
+	{
+		for (size_t k = 0; k < p_times.size(); ++k)
+		{
+			keyTimes.push_back(p_times[k]);
+			keyRotations.push_back(packQuat(p_rotations[k]));
+		}
+		trackStart.push_back((unsigned)keyTimes.size());
+	}
+};
+
+class ClipCursor
+{
+public:
+	// p_time is wrapped into [0, duration) when p_loop is set and clamped
+	// to the keys otherwise; p_rotations gets one rotation per track
+	void sample(const AnimationClip &p_clip, float p_time, bool p_loop, std::vector<Eigen::Quaternionf> &p_rotations)
+	{
+		p_rotations.resize(p_clip.numTracks());
+		sample(p_clip, p_time, p_loop, p_rotations.data());
+	}
+
+	void sample(const AnimationClip &p_clip, float p_time, bool p_loop, Eigen::Quaternionf *p_rotations)
+	{
+		const unsigned numTracks = p_clip.numTracks();
+		if (tracks.size() != numTracks || clip != &p_clip)
+		{
+			clip = &p_clip;
+			tracks.assign(numTracks, TrackState());
+		}
+		if (p_loop && p_clip.duration > 0.0f)
+		{
+			p_time = std::fmod(p_time, p_clip.duration);
+			if (p_time < 0.0f) p_time += p_clip.duration;
+		}
+
+		for (unsigned j = 0; j < numTracks; ++j)
+		{
+			TrackState &s = tracks[j];
+			if (!(p_time >= s.t0 && p_time < s.t1)) seek(p_clip, j, p_time, s);
+			const float u = s.invSpan > 0.0f ? std::min(std::max((p_time - s.time0) * s.invSpan, 0.0f), 1.0f) : 0.0f;
+			if (u == 0.0f) p_rotations[j] = s.q0;
+			else if (s.nlerp) p_rotations[j].coeffs() = ((1.0f - u) * s.q0.coeffs() + u * s.q1.coeffs()).normalized();
+			else p_rotations[j] = s.q0.slerp(u, s.q1);
+		}
+	}
+
+private:
+	// the segment [key, key + 1] of a track, valid for times in [t0, t1)
+	struct TrackState
+	{
+		unsigned key = 0;
+		float t0 = 1.0f, t1 = 0.0f;	// empty: the first sample seeks
+		float time0 = 0.0f, invSpan = 0.0f;
+		bool nlerp = false;
+		Eigen::Quaternionf q0, q1;		// q1 on q0's side of the hypersphere
+	};
+
+	void seek(const AnimationClip &p_clip, unsigned p_track, float p_time, TrackState &s)
+	{
+		const unsigned first = p_clip.trackStart[p_track];
+		const unsigned n = p_clip.numKeys(p_track);
+		const float *times = &p_clip.keyTimes[first];
+		const float infinity = std::numeric_limits<float>::infinity();
+		if (n == 1)
+		{
+			s.key = 0;
+			s.t0 = -infinity;
+			s.t1 = infinity;
+			s.invSpan = 0.0f;
+			s.q0 = s.q1 = unpackQuat(p_clip.keyRotations[first]);
+			return;
+		}
+
+		unsigned key;
+		const bool next = p_time >= s.t1 && s.t1 > s.t0 && s.key + 2 < n && p_time < times[s.key + 2];
+		if (next)
+		{
+			// playback went on to the following segment
+			key = s.key + 1;
+			s.q0 = s.q1;
+		}
+		else
+		{
+			key = (unsigned)(std::upper_bound(times, times + n, p_time) - times);
+			key = std::min(std::max(key, 1u), n - 1) - 1;
+			s.q0 = unpackQuat(p_clip.keyRotations[first + key]);
+		}
+		s.q1 = unpackQuat(p_clip.keyRotations[first + key + 1]);
+		const float cosHalfAngle = s.q0.coeffs().dot(s.q1.coeffs());
+		if (cosHalfAngle < 0.0f) s.q1.coeffs() = -s.q1.coeffs();
+		s.nlerp = std::fabs(cosHalfAngle) >= 0.99144486f;	// cos(7.5 degrees)
+		s.key = key;
+		s.time0 = times[key];
+		s.invSpan = times[key + 1] > times[key] ? 1.0f / (times[key + 1] - times[key]) : 0.0f;
+		// before the first and after the last key the end keys hold
+		s.t0 = key == 0 ? -infinity : times[key];
+		s.t1 = key + 2 == n ? infinity : times[key + 1];
+	}
+
+	const AnimationClip *clip = nullptr;
+	std::vector<TrackState> tracks;
+};
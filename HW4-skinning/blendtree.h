@@ -0,0 +1,213 @@
+#pragma once
+
+// Animation blend graph: clips mixed in joint-local space.
+//
+// A BlendGraph is a DAG of nodes, each producing one local rotation per
+// joint (a pose):
+//
+//   clip      samples an AnimationClip at time * speed + offset
+//   lerp      normalized lerp from input a to input b by the node weight
+//   slerp     the same with slerp, exact but slower on large angles
+//   additive  a * slerp(identity, b, weight): b is a delta on top of a
+//
+// Blend and additive nodes can take a mask, a weight per joint that scales
+// the node weight, so a layer can drive only part of the skeleton.
+//
+// The graph is shared; what changes per character (clip cursors, node
+// weights) lives in a BlendState. compile() flattens the graph into a
+// postfix program, so evaluation is a loop over a stack of poses: clips
+// push, blends pop two and push one. The stack is allocated once at the
+// depth the program needs and evaluate() allocates nothing.
+
+#include <algorithm>
+#include <vector>
+#include <eigen>
+#include "animation.h"
+
+enum class BlendOp
+{
+	Clip,
+	Lerp,
+	Slerp,
+	Additive
+};
+
+class BlendGraph
+{
+public:
+	struct Node
+	{
+		BlendOp op;
+		unsigned a, b;					// inputs of blend and additive nodes
+		const AnimationClip *clip;		// clip nodes
+		float speed, offset;
+		float weight;					// the default; a BlendState can override it
+		int mask;						// into masks, -1 for all joints
+		unsigned clipSlot;				// clip nodes: the cursor in a BlendState
+	};
+
+	unsigned numJoints = 0;
+	unsigned numClips = 0;
+	unsigned stackDepth = 0;
+	std::vector<Node> nodes;
+	std::vector<std::vector<float> > masks;	// [mask][joint ID]
+	std::vector<unsigned> program;			// node IDs in postfix order
+
+	void reset(unsigned p_numJoints)
+	{
+		numJoints = p_numJoints;
+		numClips = 0;
+		stackDepth = 0;
+		nodes.clear();
+		masks.clear();
+		program.clear();
+	}
+
+	// the clip must have a track per joint and outlive the graph
+	unsigned addClip(const AnimationClip &p_clip, float p_speed = 1.0f, float p_offset = 0.0f)
+	{
+		Node n = { BlendOp::Clip, 0, 0, &p_clip, p_speed, p_offset, 1.0f, -1, numClips++ };
+		return addNode(n);
+	}
+
+	// p_weight 0 gives a, 1 gives b
+	unsigned addBlend(unsigned p_a, unsigned p_b, float p_weight, bool p_slerp = false, int p_mask = -1)
+	{
+		Node n = { p_slerp ? BlendOp::Slerp : BlendOp::Lerp, p_a, p_b, nullptr, 1.0f, 0.0f, p_weight, p_mask, 0 };
+		return addNode(n);
+	}
+
+	unsigned addAdditive(unsigned p_base, unsigned p_delta, float p_weight, int p_mask = -1)
+	{
+		Node n = { BlendOp::Additive, p_base, p_delta, nullptr, 1.0f, 0.0f, p_weight, p_mask, 0 };
+		return addNode(n);
+	}
+
+	// p_weights by joint ID, in [0, 1]
+	int addMask(const std::vector<float> &p_weights)
+	{
+		masks.push_back(p_weights);
+		masks.back().resize(numJoints, 0.0f);
+		return (int)masks.size() - 1;
+	}
+
+	// flattens the graph below p_root; false if a node reads a later node
+	// or a clip doesn't match the skeleton
+	bool compile(unsigned p_root)
+	{
+		program.clear();
+		stackDepth = 0;
+		if (p_root >= nodes.size()) return false;
+		for (unsigned i = 0; i < nodes.size(); ++i)
+		{
+			const Node &n = nodes[i];
+			if (n.op == BlendOp::Clip ? n.clip->numTracks() != numJoints : (n.a >= i || n.b >= i)) return false;
+			if (n.mask >= (int)masks.size()) return false;
+		}
+		append(p_root);
+
+		unsigned depth = 0;
+		for (unsigned i : program)
+		{
+			depth = nodes[i].op == BlendOp::Clip ? depth + 1 : depth - 1;
+			stackDepth = std::max(stackDepth, depth);
+		}
+		return true;
+	}
+
+private:
+	unsigned addNode(const Node &p_node)
+	{
+		nodes.push_back(p_node);
+		return (unsigned)nodes.size() - 1;
+	}
+
+	// inputs first; a node read twice is evaluated twice
+	void append(unsigned p_node)
+	{
+		const Node &n = nodes[p_node];
+		if (n.op != BlendOp::Clip)
+		{
+			append(n.a);
+			append(n.b);
+		}
+		program.push_back(p_node);
+	}
+};
+
+class BlendState
+{
+public:
+	std::vector<float> weights;		// [node ID], from the graph at init()
+
+	void init(const BlendGraph &p_graph)
+	{
+		weights.resize(p_graph.nodes.size());
+		for (size_t i = 0; i < weights.size(); ++i) weights[i] = p_graph.nodes[i].weight;
+		cursors.assign(p_graph.numClips, ClipCursor());
+		stack.resize(size_t(std::max(p_graph.stackDepth, 1u)) * p_graph.numJoints);
+	}
+
+	// local rotations by joint ID, valid until the next call; clips loop
+	const Eigen::Quaternionf *evaluate(const BlendGraph &p_graph, float p_time)
+	{
+		const unsigned numJoints = p_graph.numJoints;
+		unsigned top = 0;
+		for (unsigned i : p_graph.program)
+		{
+			const BlendGraph::Node &n = p_graph.nodes[i];
+			if (n.op == BlendOp::Clip)
+			{
+				cursors[n.clipSlot].sample(*n.clip, p_time * n.speed + n.offset, true, &stack[size_t(top++) * numJoints]);
+				continue;
+			}
+			--top;
+			Eigen::Quaternionf *a = &stack[size_t(top - 1) * numJoints];
+			const Eigen::Quaternionf *b = &stack[size_t(top) * numJoints];
+			const float *mask = n.mask < 0 ? nullptr : p_graph.masks[n.mask].data();
+			blend(n.op, weights[i], mask, numJoints, a, b);
+		}
+		return stack.data();
+	}
+
+private:
+	// a = op(a, b) joint by joint; one loop per op so that nlerp stays
+	// free of branches
+	static void blend(BlendOp p_op, float p_weight, const float *p_mask, unsigned p_numJoints, Eigen::Quaternionf *a, const Eigen::Quaternionf *b)
+	{
+		if (p_weight <= 0.0f) return;
+		switch (p_op)
+		{
+			case BlendOp::Lerp:
+				for (unsigned j = 0; j < p_numJoints; ++j)
+				{
+					const float w = p_mask ? p_weight * p_mask[j] : p_weight;
+					// along the shorter arc
+					const float wb = a[j].coeffs().dot(b[j].coeffs()) < 0.0f ? -w : w;
+					a[j].coeffs() = ((1.0f - w) * a[j].coeffs() + wb * b[j].coeffs()).normalized();
+				}
+				break;
+			case BlendOp::Slerp:
+				for (unsigned j = 0; j < p_numJoints; ++j)
+				{
+					const float w = p_mask ? p_weight * p_mask[j] : p_weight;
+					if (w <= 0.0f) continue;
+					a[j] = w >= 1.0f ? b[j] : a[j].slerp(w, b[j]);
+				}
+				break;
+			case BlendOp::Additive:
+				for (unsigned j = 0; j < p_numJoints; ++j)
+				{
+					const float w = p_mask ? p_weight * p_mask[j] : p_weight;
+					if (w <= 0.0f) continue;
+					a[j] = a[j] * (w >= 1.0f ? b[j] : Eigen::Quaternionf::Identity().slerp(w, b[j]));
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	std::vector<ClipCursor> cursors;		// [clip slot]
+	std::vector<Eigen::Quaternionf> stack;	// [stack level][joint ID]
+};
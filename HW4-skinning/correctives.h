@@ -0,0 +1,195 @@
+#pragma once
+
+// Pose-space corrective shapes on top of linear blend skinning.
+//
+// A shape is a sparse set of rest-position deltas, driven by the rotation
+// angle of one joint: weight 0 up to angle0, rising linearly to 1 at angle1.
+// Only nonzero deltas are stored, as a vertex index and xyz (SoA), so memory
+// grows with what the shapes move, not with the mesh.
+//
+// Shapes are applied before skinning, to the rest positions the kernel
+// reads (SkinningRest::px, py, pz), so the corrected vertices go through the
+// palette like every other vertex. bind() keeps the original rest position
+// of every vertex a shape moves; apply() puts the vertices of the shapes
+// applied last time back and adds the shapes with nonzero weight, 8 deltas
+// at a time (AVX2 gathers the positions; the SSE path scales the deltas 4 at
+// a time). Shapes at weight 0 cost nothing, and when no weight changed
+// apply() does nothing at all. Rest normals are left alone; recomputed
+// normals follow the corrected surface.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <xmmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <eigen>
+#include "skinning.h"
+
+class CorrectiveShapes
+{
+public:
+	struct Shape
+	{
+		unsigned joint;				// driver, by joint ID
+		float angle0, angle1;		// radians; weight 0 at angle0, 1 at angle1
+		unsigned begin, end;		// deltas [begin, end)
+	};
+
+	std::vector<Shape> shapes;
+	std::vector<uint32_t> vertices;	// [delta] vertex ID, ascending within a shape
+	AlignedFloats dx, dy, dz;		// [delta]
+	std::vector<float> weights;		// [shape], set by drive()
+
+	void clear()
+	{
+		shapes.clear();
+		vertices.clear();
+		dx.clear();
+		dy.clear();
+		dz.clear();
+		weights.clear();
+		applied.clear();
+		bx.clear();
+		by.clear();
+		bz.clear();
+	}
+
+	// deltas shorter than p_minDelta are dropped; false (and no shape) if
+	// none is left
+	bool addShape(unsigned p_joint, float p_angle0, float p_angle1, const std::vector<unsigned> &p_vertices, const std::vector<Eigen::Vector3f> &p_deltas, float p_minDelta)
+	{
+		std::vector<unsigned> order(p_vertices.size());
+		for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return p_vertices[a] < p_vertices[b]; });
+
+		const unsigned begin = (unsigned)vertices.size();
+		for (unsigned i : order)
+		{
+			if (p_deltas[i].norm() < p_minDelta) continue;
+			if (vertices.size() > begin && vertices.back() == p_vertices[i]) continue;	// first of a repeat wins
+			vertices.push_back(p_vertices[i]);
+			dx.push_back(p_deltas[i](0));
+			dy.push_back(p_deltas[i](1));
+			dz.push_back(p_deltas[i](2));
+		}
+		if (vertices.size() == begin) return false;
+		shapes.push_back(Shape{ p_joint, p_angle0, p_angle1, begin, (unsigned)vertices.size() });
+		weights.push_back(0.0f);
+		return true;
+	}
+
+	size_t memoryBytes() const { return vertices.size() * (sizeof(uint32_t) + 6 * sizeof(float)) + shapes.size() * (sizeof(Shape) + 2 * sizeof(float)); }
+
+	// after the last addShape(), with the rest positions as built
+	void bind(const SkinningRest &p_rest)
+	{
+		bx.resize(vertices.size());
+		by.resize(vertices.size());
+		bz.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); ++i)
+		{
+			bx[i] = p_rest.px[vertices[i]];
+			by[i] = p_rest.py[vertices[i]];
+			bz[i] = p_rest.pz[vertices[i]];
+		}
+		applied.assign(shapes.size(), 0.0f);
+	}
+
+	// weights from the local joint rotations (by joint ID), times p_scale
+	void drive(const std::vector<Eigen::Matrix4f> &p_local, float p_scale)
+	{
+		for (size_t s = 0; s < shapes.size(); ++s)
+		{
+			const Shape &shape = shapes[s];
+			const Eigen::Matrix4f &r = p_local[shape.joint];
+			const float c = 0.5f * (r(0, 0) + r(1, 1) + r(2, 2) - 1.0f);
+			const float angle = std::acos(std::min(std::max(c, -1.0f), 1.0f));
+			const float t = (angle - shape.angle0) / (shape.angle1 - shape.angle0);
+			weights[s] = p_scale * std::min(std::max(t, 0.0f), 1.0f);
+		}
+	}
+
+	// Brings the rest positions of p_rest to the current weights; calls
+	// p_touched(vertexIDs, count) for every shape whose vertices it moved.
+	// Returns false if no weight changed since the last call.
+	template <typename Touched>
+	bool apply(SkinningRest &p_rest, Touched p_touched)
+	{
+		if (applied.size() != weights.size()) return false;	// not bound
+		if (std::equal(weights.begin(), weights.end(), applied.begin())) return false;
+		float *px = p_rest.px.data(), *py = p_rest.py.data(), *pz = p_rest.pz.data();
+		for (size_t s = 0; s < shapes.size(); ++s)
+		{
+			if (applied[s] == 0.0f) continue;
+			for (unsigned i = shapes[s].begin; i < shapes[s].end; ++i)
+			{
+				px[vertices[i]] = bx[i];
+				py[vertices[i]] = by[i];
+				pz[vertices[i]] = bz[i];
+			}
+		}
+		for (size_t s = 0; s < shapes.size(); ++s)
+		{
+			const Shape &shape = shapes[s];
+			if (weights[s] != 0.0f)
+			{
+				addScaledDeltas(weights[s], shape.begin, shape.end, px, py, pz);
+			}
+			if (weights[s] != 0.0f || applied[s] != 0.0f) p_touched(&vertices[shape.begin], size_t(shape.end - shape.begin));
+		}
+		applied = weights;
+		return true;
+	}
+
+private:
+	AlignedFloats bx, by, bz;		// [delta] rest position of its vertex
+	std::vector<float> applied;		// [shape] weight in p_rest now
+
+	// position[vertices[i]] += w * delta[i] for deltas [p_begin, p_end); the
+	// vertices of one shape are distinct, so the lanes never collide
+	void addScaledDeltas(float p_weight, unsigned p_begin, unsigned p_end, float *px, float *py, float *pz) const
+	{
+		unsigned i = p_begin;
+#if defined(__AVX2__)
+		const __m256 w = _mm256_set1_ps(p_weight);
+		alignas(32) float x[8], y[8], z[8];
+		for (; i + 8 <= p_end; i += 8)
+		{
+			const __m256i v = _mm256_loadu_si256((const __m256i *)&vertices[i]);
+			_mm256_store_ps(x, _mm256_add_ps(_mm256_i32gather_ps(px, v, 4), _mm256_mul_ps(w, _mm256_loadu_ps(&dx[i]))));
+			_mm256_store_ps(y, _mm256_add_ps(_mm256_i32gather_ps(py, v, 4), _mm256_mul_ps(w, _mm256_loadu_ps(&dy[i]))));
+			_mm256_store_ps(z, _mm256_add_ps(_mm256_i32gather_ps(pz, v, 4), _mm256_mul_ps(w, _mm256_loadu_ps(&dz[i]))));
+			for (unsigned k = 0; k < 8; ++k)
+			{
+				px[vertices[i + k]] = x[k];
+				py[vertices[i + k]] = y[k];
+				pz[vertices[i + k]] = z[k];
+			}
+		}
+#else
+		const __m128 w = _mm_set1_ps(p_weight);
+		alignas(16) float x[4], y[4], z[4];
+		for (; i + 4 <= p_end; i += 4)
+		{
+			_mm_store_ps(x, _mm_mul_ps(w, _mm_loadu_ps(&dx[i])));
+			_mm_store_ps(y, _mm_mul_ps(w, _mm_loadu_ps(&dy[i])));
+			_mm_store_ps(z, _mm_mul_ps(w, _mm_loadu_ps(&dz[i])));
+			for (unsigned k = 0; k < 4; ++k)
+			{
+				px[vertices[i + k]] += x[k];
+				py[vertices[i + k]] += y[k];
+				pz[vertices[i + k]] += z[k];
+			}
+		}
+#endif
+		for (; i < p_end; ++i)
+		{
+			px[vertices[i]] += p_weight * dx[i];
+			py[vertices[i]] += p_weight * dy[i];
+			pz[vertices[i]] += p_weight * dz[i];
+		}
+	}
+};
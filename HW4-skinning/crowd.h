@@ -0,0 +1,230 @@
+#pragma once
+
+// Instanced crowd: N copies of one character with independent poses.
+//
+// Every instance shares the rest mesh and weights (SkinningRest) and the
+// skeleton; what differs is a time offset into the animation clip (with its
+// own ClipCursor) and a place on a grid. A frame poses all instances in the Skeleton batch layout, turns
+// their globals into skinning palettes with the grid translation folded in,
+// and skins them into one buffer, instance i at positions[i * numVertices].
+// Instances are split into chunks of blocks so that a few instances of a
+// big mesh still keep every thread busy.
+//
+// An instance can be skinned at a coarser level of detail (see simplify.h).
+// selectLods() picks per instance the coarsest LOD whose simplification
+// error, projected at the instance's distance to the eye, stays under a
+// pixel budget; the instance's vertices then fill only the front of its
+// slice of positions, and a far instance costs a fraction of a near one in
+// skinning and in vertex submission alike.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <eigen>
+#include "skinning.h"
+#include "skeleton.h"
+#include "jobs.h"
+#include "animation.h"
+#include "profiler.h"
+
+class Crowd
+{
+public:
+	unsigned count = 0;
+	unsigned numVertices = 0;
+	std::vector<float> timeOffset;				// [instance], added to the animation time
+	std::vector<Eigen::Vector3f> placement;		// [instance], world translation
+	AlignedFloats palettes;						// [instance][joint ID] 3x4 affines, as SkinPalette::data
+	AlignedFloats positions;					// [instance][vertex] xyz
+	std::vector<uint8_t> lod;					// [instance], index into the LODs
+
+	// p_restInv is the inverse global rest pose, indexed by joint ID;
+	// instances go on a square grid p_spacing apart, centered on the origin,
+	// with time offsets spread over p_period
+	void build(const Skeleton &p_skeleton, const SkinningRest &p_rest, const std::vector<Eigen::Matrix4f> &p_restInv, unsigned p_count, float p_spacing, float p_period)
+	{
+		count = p_count;
+		numVertices = p_rest.numVertices;
+		lodRest.assign(1, &p_rest);
+		lodError.assign(1, 0.0f);
+		lod.assign(p_count, 0);
+		// bounding sphere of the rest mesh, around the center of its box
+		Eigen::Vector3f lo = Eigen::Vector3f::Constant(1e30f), hi = -lo;
+		for (unsigned v = 0; v < numVertices; ++v)
+		{
+			const Eigen::Vector3f x(p_rest.px[v], p_rest.py[v], p_rest.pz[v]);
+			lo = lo.cwiseMin(x);
+			hi = hi.cwiseMax(x);
+		}
+		boundsCenter = numVertices ? Eigen::Vector3f(0.5f * (lo + hi)) : Eigen::Vector3f::Zero();
+		boundsRadius = 0.0f;
+		for (unsigned v = 0; v < numVertices; ++v)
+		{
+			boundsRadius = std::max(boundsRadius, (Eigen::Vector3f(p_rest.px[v], p_rest.py[v], p_rest.pz[v]) - boundsCenter).norm());
+		}
+		const unsigned side = (unsigned)std::ceil(std::sqrt((float)p_count));
+		timeOffset.resize(p_count);
+		cursors.assign(p_count, ClipCursor());
+		placement.resize(p_count);
+		for (unsigned i = 0; i < p_count; ++i)
+		{
+			timeOffset[i] = p_period * float(i) / float(p_count);
+			placement[i] = p_spacing * Eigen::Vector3f(float(i % side) - 0.5f * (side - 1), 0.0f, float(i / side) - 0.5f * (side - 1));
+		}
+
+		restInv.resize(size_t(p_skeleton.numJoints) * SKIN_AFFINE);
+		for (unsigned j = 0; j < p_skeleton.numJoints; ++j)
+		{
+			for (int r = 0; r < 3; ++r)
+			{
+				for (int c = 0; c < 4; ++c) restInv[size_t(j) * SKIN_AFFINE + 4 * r + c] = p_restInv[j](r, c);
+			}
+		}
+
+		locals.assign(p_skeleton.batchFloats(p_count), 0.0f);
+		globals.assign(locals.size(), 0.0f);
+		palettes.assign(size_t(p_count) * p_skeleton.numJoints * SKIN_AFFINE, 0.0f);
+		positions.assign(size_t(p_count) * numVertices * 3, 0.0f);
+	}
+
+	// LOD 0 stays the mesh given to build(); p_rests[k] is LOD k + 1 with
+	// its simplification error p_errors[k], in rest mesh units. Coarser LODs
+	// come later and must not have more vertices than LOD 0.
+	void setLods(const std::vector<const SkinningRest *> &p_rests, const std::vector<float> &p_errors)
+	{
+		lodRest.resize(1);
+		lodError.resize(1);
+		for (size_t k = 0; k < p_rests.size(); ++k)
+		{
+			lodRest.push_back(p_rests[k]);
+			lodError.push_back(p_errors[k]);
+		}
+		std::fill(lod.begin(), lod.end(), uint8_t(0));
+	}
+
+	unsigned numLods() const { return (unsigned)lodRest.size(); }
+
+	// p_eye in the crowd's own units (those of the rest mesh and of
+	// placement); p_pixelsPerUnit is the projection scale, the size in
+	// pixels of one unit at distance one
+	void selectLods(const Eigen::Vector3f &p_eye, float p_pixelsPerUnit, float p_maxPixelError)
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			const float distance = std::max((placement[i] + boundsCenter - p_eye).norm() - boundsRadius, 1e-3f);
+			unsigned k = numLods() - 1;
+			while (k > 0 && lodError[k] * p_pixelsPerUnit / distance > p_maxPixelError) --k;
+			lod[i] = (uint8_t)k;
+		}
+	}
+
+	void forceLod(unsigned p_lod) { std::fill(lod.begin(), lod.end(), (uint8_t)std::min(p_lod, numLods() - 1)); }
+
+	// vertices skinned by the last update()
+	size_t skinnedVertices() const
+	{
+		size_t n = 0;
+		for (uint8_t k : lod) n += lodRest[k]->numVertices;
+		return n;
+	}
+
+	// Instance i plays p_clip (one track per joint ID) looped, at
+	// p_time + timeOffset[i], skinned at LOD lod[i]. Instances use linear
+	// blend skinning.
+	void update(JobSystem &p_jobs, const Skeleton &p_skeleton, const AnimationClip &p_clip, float p_time)
+	{
+		const unsigned numJoints = p_skeleton.numJoints;
+		{
+			ProfileScope scope(ProfileStage::Pose);
+			p_jobs.parallelFor(count, 16, [&](size_t i0, size_t i1)
+			{
+				Eigen::Matrix4f local = Eigen::Matrix4f::Identity();
+				std::vector<Eigen::Quaternionf> rotations;
+				for (size_t i = i0; i < i1; ++i)
+				{
+					cursors[i].sample(p_clip, p_time + timeOffset[i], true, rotations);
+					for (unsigned j = 0; j < numJoints; ++j)
+					{
+						local.block<3, 3>(0, 0) = rotations[j].toRotationMatrix();
+						p_skeleton.setBatchAffine(locals.data(), (unsigned)i, p_skeleton.sortedIndex[j], local);
+					}
+				}
+			});
+		}
+
+		{
+			ProfileScope scope(ProfileStage::Kinematics);
+			p_skeleton.computeGlobalsBatch(p_jobs, locals.data(), globals.data(), count);
+		}
+
+		{
+			ProfileScope scope(ProfileStage::Palette);
+			p_jobs.parallelFor(count, 16, [&](size_t i0, size_t i1)
+			{
+				for (size_t i = i0; i < i1; ++i) buildPalette(p_skeleton, (unsigned)i);
+			});
+		}
+
+		// one task per (instance, chunk of blocks of its LOD)
+		ProfileScope scope(ProfileStage::Skinning);
+		const unsigned blocksPerJob = 128;
+		tasks.clear();
+		for (unsigned i = 0; i < count; ++i)
+		{
+			for (unsigned b0 = 0; b0 < lodRest[lod[i]]->numBlocks; b0 += blocksPerJob) tasks.push_back(SkinTask{ i, b0 });
+		}
+		p_jobs.parallelFor(tasks.size(), 1, [&](size_t t0, size_t t1)
+		{
+			for (size_t t = t0; t < t1; ++t)
+			{
+				const size_t i = tasks[t].instance;
+				const SkinningRest &rest = *lodRest[lod[i]];
+				const unsigned b1 = std::min(tasks[t].block + blocksPerJob, rest.numBlocks);
+				const SkinTarget target = { &positions[i * numVertices * 3], nullptr, 3 };
+				skinBlocks(rest, &palettes[i * numJoints * SKIN_AFFINE], tasks[t].block, b1, target);
+			}
+		});
+	}
+
+	const float *instancePositions(unsigned p_instance) const { return &positions[size_t(p_instance) * numVertices * 3]; }
+
+private:
+	struct SkinTask
+	{
+		unsigned instance, block;
+	};
+
+	std::vector<const SkinningRest *> lodRest;	// [LOD], 0 the full mesh
+	std::vector<float> lodError;				// [LOD]
+	Eigen::Vector3f boundsCenter = Eigen::Vector3f::Zero();	// of the rest mesh
+	float boundsRadius = 0.0f;
+	std::vector<SkinTask> tasks;
+	std::vector<ClipCursor> cursors;	// [instance]
+	AlignedFloats restInv;	// [joint ID] 3x4 affines
+	AlignedFloats locals;	// Skeleton batch layout
+	AlignedFloats globals;
+
+	// palette_j = translate(placement) * global_j * restInv_j
+	void buildPalette(const Skeleton &p_skeleton, unsigned p_instance)
+	{
+		const unsigned numJoints = p_skeleton.numJoints;
+		const float *group = globals.data() + (p_instance / 4) * p_skeleton.batchGroupFloats() + p_instance % 4;
+		const Eigen::Vector3f &x = placement[p_instance];
+		for (unsigned j = 0; j < numJoints; ++j)
+		{
+			const size_t s = p_skeleton.sortedIndex[j];
+			const auto a = [&](int r, int c) { return group[(size_t(4 * r + c) * numJoints + s) * 4]; };
+			const float *b = &restInv[size_t(j) * SKIN_AFFINE];
+			float *m = &palettes[(size_t(p_instance) * numJoints + j) * SKIN_AFFINE];
+			for (int r = 0; r < 3; ++r)
+			{
+				for (int c = 0; c < 4; ++c)
+				{
+					m[4 * r + c] = a(r, 0) * b[c] + a(r, 1) * b[4 + c] + a(r, 2) * b[8 + c];
+				}
+				m[4 * r + 3] += a(r, 3) + x[r];
+			}
+		}
+	}
+};
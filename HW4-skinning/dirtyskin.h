@@ -0,0 +1,142 @@
+#pragma once
+
+// Incremental skinning: only the blocks of vertices whose joints moved are
+// skinned again.
+//
+// build() indexes, per joint, the ranges of SkinningRest blocks with a
+// vertex it influences (CSR: ranges [rangeStart[j], rangeStart[j + 1])).
+// Every frame markChanged() takes the joints whose global transform changed
+// and stamps their blocks with the frame number.
+//
+// A target is anything the kernel writes into (a vertex array, one half of
+// the mapped vertex buffer). It remembers the frame it was last brought up
+// to date, so pending() lists exactly the blocks stamped since then, split
+// into ranges short enough to spread over the job system. A target that
+// was never written, or whose contents were discarded, is stale as a
+// whole. When no joint moved the target on screen is already current and
+// the frame needs no skinning at all.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "skinning.h"
+
+struct BlockRange
+{
+	unsigned begin, end;	// blocks [begin, end)
+};
+
+class SkinDirtyTracker
+{
+public:
+	std::vector<unsigned> rangeStart;	// [joint ID], into ranges
+	std::vector<BlockRange> ranges;		// blocks influenced by a joint, ascending
+
+	void build(const SkinningRest &p_rest, unsigned p_numJoints, unsigned p_numTargets)
+	{
+		numBlocks = p_rest.numBlocks;
+		std::vector<std::vector<BlockRange> > perJoint(p_numJoints);
+		std::vector<uint8_t> uses(p_numJoints, 0);
+		std::vector<unsigned> used;
+		for (unsigned b = 0; b < numBlocks; ++b)
+		{
+			used.clear();
+			for (unsigned k = 0; k < p_rest.blockSlots[b]; ++k)
+			{
+				const size_t i = (size_t(b) * p_rest.slots + k) * SKIN_BLOCK;
+				for (unsigned lane = 0; lane < SKIN_BLOCK; ++lane)
+				{
+					const unsigned j = (unsigned)p_rest.joints[i + lane];
+					if (p_rest.weights[i + lane] == 0.0f || j >= p_numJoints || uses[j]) continue;
+					uses[j] = 1;
+					used.push_back(j);
+				}
+			}
+			for (unsigned j : used)
+			{
+				uses[j] = 0;
+				std::vector<BlockRange> &r = perJoint[j];
+				if (!r.empty() && r.back().end == b) r.back().end = b + 1;
+				else r.push_back(BlockRange{ b, b + 1 });
+			}
+		}
+
+		rangeStart.assign(1, 0);
+		ranges.clear();
+		for (const std::vector<BlockRange> &r : perJoint)
+		{
+			ranges.insert(ranges.end(), r.begin(), r.end());
+			rangeStart.push_back((unsigned)ranges.size());
+		}
+		blockStamp.assign(numBlocks, 0);
+		targetStamp.assign(p_numTargets, 0);
+		frame = 1;
+	}
+
+	// every target stale, e.g. after the skinning method changed
+	void invalidate() { std::fill(targetStamp.begin(), targetStamp.end(), 0u); }
+	void invalidate(unsigned p_target) { targetStamp[p_target] = 0; }
+
+	bool isCurrent(unsigned p_target) const { return targetStamp[p_target] == frame; }
+	void markCurrent(unsigned p_target) { targetStamp[p_target] = frame; }	// written in full
+
+	// p_changed[joint ID] is nonzero for joints that moved since the last
+	// call; returns false if none did
+	bool markChanged(const uint8_t *p_changed)
+	{
+		bool any = false;
+		for (unsigned j = 0; j + 1 < rangeStart.size(); ++j)
+		{
+			if (!p_changed[j]) continue;
+			if (!any) ++frame;
+			any = true;
+			for (unsigned r = rangeStart[j]; r < rangeStart[j + 1]; ++r)
+			{
+				std::fill(blockStamp.begin() + ranges[r].begin, blockStamp.begin() + ranges[r].end, frame);
+			}
+		}
+		return any;
+	}
+
+	// blocks of vertices that moved for another reason than their joints,
+	// e.g. corrective shapes changing the rest positions
+	void markVertices(const uint32_t *p_vertices, size_t p_count)
+	{
+		if (p_count == 0) return;
+		++frame;
+		for (size_t i = 0; i < p_count; ++i) blockStamp[p_vertices[i] / SKIN_BLOCK] = frame;
+	}
+
+	// the blocks p_target lacks, at most p_maxBlocks per range; the target
+	// counts as current afterwards
+	const std::vector<BlockRange> &pending(unsigned p_target, unsigned p_maxBlocks)
+	{
+		pendingRanges.clear();
+		numPending = 0;
+		const uint32_t since = targetStamp[p_target];
+		for (unsigned b = 0; b < numBlocks;)
+		{
+			if (since && blockStamp[b] <= since)
+			{
+				++b;
+				continue;
+			}
+			const unsigned begin = b;
+			while (b < numBlocks && b - begin < p_maxBlocks && (!since || blockStamp[b] > since)) ++b;
+			pendingRanges.push_back(BlockRange{ begin, b });
+			numPending += b - begin;
+		}
+		targetStamp[p_target] = frame;
+		return pendingRanges;
+	}
+
+	unsigned pendingBlocks() const { return numPending; }	// of the last pending()
+
+private:
+	unsigned numBlocks = 0;
+	uint32_t frame = 1;
+	std::vector<uint32_t> blockStamp;	// [block], frame its joints last moved
+	std::vector<uint32_t> targetStamp;	// [target], frame it was brought up to date; 0 stale
+	std::vector<BlockRange> pendingRanges;
+	unsigned numPending = 0;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+// Dense float matrices (.dmat) for weights and poses.
+//
+// Text: "cols rows" followed by cols * rows values, column by column (a
+// column is a joint in weights.dmat, a pose in pose.dmat).
+//
+// Binary (.bdmat): a 32-byte header and the same values as raw floats, so a
+// loaded matrix is a view into the mapped file and nothing is parsed or
+// copied. DMat::load() reads the binary sidecar next to a text file while
+// it is at least as new as the text, and otherwise parses the text and
+// writes the sidecar for next time.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mappedfile.h"
+#include "textparse.h"
+
+struct DMatHeader
+{
+	char magic[8];			// "BDMAT" and terminating 0s
+	uint32_t version;
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t reserved[3];	// pads the payload to 16 bytes
+};
+
+static const uint32_t BDMAT_VERSION = 1;
+
+class DMat
+{
+public:
+	unsigned cols = 0;
+	unsigned rows = 0;
+
+	DMat() {}
+	DMat(const DMat &) = delete;
+	DMat &operator=(const DMat &) = delete;
+
+	const float *data() const { return values; }
+	const float *column(unsigned p_col) const { return values + size_t(p_col) * rows; }
+	bool empty() const { return values == nullptr; }
+	bool isMapped() const { return values && storage.empty(); }
+
+	// the sidecar if it is current, otherwise the text
+	bool load(const std::string &p_path)
+	{
+		const std::string cachePath = sidecarPath(p_path);
+		const int64_t cacheTime = fileModifiedTime(cachePath);
+		if (cacheTime && cacheTime >= fileModifiedTime(p_path) && loadBinary(cachePath)) return true;
+		if (!loadText(p_path)) return false;
+		if (!saveBinary(cachePath, cols, rows, values))
+		{
+			std::cerr << "Could not write matrix cache " << cachePath << std::endl;
+		}
+		return true;
+	}
+
+	bool loadText(const std::string &p_path)
+	{
+		clear();
+		MappedFile text;
+		if (!text.open(p_path)) return false;
+		const char *p = text.data(), *end = p + text.size();
+		unsigned n[2];
+		for (int i = 0; i < 2; ++i)
+		{
+			p = skipWhitespace(p, end);
+			if (p == end || !isDigit(*p)) return false;
+			n[i] = (unsigned)parseFloat(p, end);
+		}
+
+		storage.resize(size_t(n[0]) * n[1]);
+		for (float &value : storage)
+		{
+			p = skipWhitespace(p, end);
+			const char *start = p;
+			value = parseFloat(p, end);
+			if (p == start)
+			{
+				storage.clear();
+				return false;
+			}
+		}
+		cols = n[0];
+		rows = n[1];
+		values = storage.data();
+		return true;
+	}
+
+	// maps the file; the matrix stays valid until the next load or clear
+	bool loadBinary(const std::string &p_path)
+	{
+		clear();
+		if (!file.open(p_path) || file.size() < sizeof(DMatHeader)) return false;
+		DMatHeader header;
+		std::memcpy(&header, file.data(), sizeof(header));
+		if (std::memcmp(header.magic, "BDMAT\0\0", 8) != 0 || header.version != BDMAT_VERSION
+			|| file.size() != sizeof(header) + size_t(header.cols) * header.rows * sizeof(float))
+		{
+			file.close();
+			return false;
+		}
+		cols = header.cols;
+		rows = header.rows;
+		values = (const float *)(file.data() + sizeof(header));
+		return true;
+	}
+
+	void clear()
+	{
+		file.close();
+		storage.clear();
+		values = nullptr;
+		cols = rows = 0;
+	}
+
+	static bool saveBinary(const std::string &p_path, unsigned p_cols, unsigned p_rows, const float *p_values)
+	{
+		DMatHeader header = {};
+		std::memcpy(header.magic, "BDMAT\0\0", 8);
+		header.version = BDMAT_VERSION;
+		header.cols = p_cols;
+		header.rows = p_rows;
+
+		std::ofstream out(p_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write((const char *)&header, sizeof(header));
+		out.write((const char *)p_values, size_t(p_cols) * p_rows * sizeof(float));
+		out.close();
+		if (!out)
+		{
+			std::remove(p_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// path.dmat -> path.bdmat
+	static std::string sidecarPath(const std::string &p_textPath)
+	{
+		return replaceExtension(p_textPath, ".bdmat");
+	}
+
+private:
+	MappedFile file;				// binary matrices point into it
+	std::vector<float> storage;		// text matrices are parsed into it
+	const float *values = nullptr;
+};
+
+// text -> binary, for shipping data without the text files
+inline bool convertDMat(const std::string &p_textPath, const std::string &p_binaryPath)
+{
+	DMat m;
+	return m.loadText(p_textPath) && DMat::saveBinary(p_binaryPath, m.cols, m.rows, m.data());
+}
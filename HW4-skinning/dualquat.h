@@ -0,0 +1,218 @@
+#pragma once
+
+// Dual quaternion skinning.
+//
+// Blending matrices (LBS) shrinks the mesh around twisting joints (the
+// "candy wrapper"). Here every skinning matrix is converted once per frame
+// to a unit dual quaternion (8 floats: rotation q and dual part d), the
+// influences of a vertex blend those 8 floats, and the normalized result is
+// applied as a rotation plus translation. Uses the same SoA rest blocks and
+// output targets as the LBS kernel in skinning.h.
+
+#include <cmath>
+#include <vector>
+#include <eigen>
+#include "skinning.h"
+
+enum class SkinningMode
+{
+	Linear,
+	DualQuaternion
+};
+
+inline const char *skinningModeName(SkinningMode p_mode)
+{
+	return p_mode == SkinningMode::Linear ? "linear blend" : "dual quaternion";
+}
+
+// p_dualQuats gets 8 floats per joint: qx qy qz qw dx dy dz dw.
+// The palette must be rigid (rotation + translation).
+inline void computeDualQuats(const SkinPalette &p_palette, AlignedFloats &p_dualQuats)
+{
+	const unsigned numJoints = p_palette.numJoints();
+	p_dualQuats.resize(size_t(numJoints) * 8);
+	for (unsigned j = 0; j < numJoints; ++j)
+	{
+		const float *m = p_palette.joint(j);
+		Eigen::Matrix3f R;
+		R << m[0], m[1], m[2], m[4], m[5], m[6], m[8], m[9], m[10];
+		const Eigen::Quaternionf q(R);
+		const Eigen::Vector3f t(m[3], m[7], m[11]);
+		const Eigen::Vector3f qv = q.vec();
+		// d = 0.5 * (0, t) * q
+		const Eigen::Vector3f dv = 0.5f * (q.w() * t + t.cross(qv));
+		const float dw = -0.5f * t.dot(qv);
+
+		float *dq = &p_dualQuats[8 * j];
+		dq[0] = qv[0]; dq[1] = qv[1]; dq[2] = qv[2]; dq[3] = q.w();
+		dq[4] = dv[0]; dq[5] = dv[1]; dq[6] = dv[2]; dq[7] = dw;
+	}
+}
+
+// Blended dual quaternions of a group of lanes, one register per component.
+template <typename L>
+struct DualQuatLanes
+{
+	typedef typename L::V V;
+	V q0, q1, q2, q3, d0, d1, d2, d3;
+	V r0, r1, r2, r3;	// rotation of the first influence
+	bool first;
+
+	void reset(V zero)
+	{
+		q0 = q1 = q2 = q3 = d0 = d1 = d2 = d3 = zero;
+		first = true;
+	}
+
+	void add(V w, V c0, V c1, V c2, V c3, V c4, V c5, V c6, V c7)
+	{
+		if (first)
+		{
+			r0 = c0; r1 = c1; r2 = c2; r3 = c3;
+			first = false;
+		}
+		else
+		{
+			// q and -q are the same rotation: flip w where dot(q, first) < 0
+			w = vflip(w, vadd(vadd(vmul(c0, r0), vmul(c1, r1)), vadd(vmul(c2, r2), vmul(c3, r3))));
+		}
+		q0 = vadd(q0, vmul(w, c0)); q1 = vadd(q1, vmul(w, c1)); q2 = vadd(q2, vmul(w, c2)); q3 = vadd(q3, vmul(w, c3));
+		d0 = vadd(d0, vmul(w, c4)); d1 = vadd(d1, vmul(w, c5)); d2 = vadd(d2, vmul(w, c6)); d3 = vadd(d3, vmul(w, c7));
+	}
+
+	// normalizes by |q| and precomputes the translation
+	void finish()
+	{
+		const V inv = vrsqrt(vadd(vadd(vmul(q0, q0), vmul(q1, q1)), vadd(vmul(q2, q2), vmul(q3, q3))));
+		q0 = vmul(q0, inv); q1 = vmul(q1, inv); q2 = vmul(q2, inv); q3 = vmul(q3, inv);
+		d0 = vmul(d0, inv); d1 = vmul(d1, inv); d2 = vmul(d2, inv); d3 = vmul(d3, inv);
+		// t = 2 * (qw * dv - dw * qv + qv x dv), kept in d0..d2
+		const V two = vsplat(q0, 2.0f);
+		const V tx = vmul(two, vadd(vsub(vmul(q1, d2), vmul(q2, d1)), vsub(vmul(q3, d0), vmul(d3, q0))));
+		const V ty = vmul(two, vadd(vsub(vmul(q2, d0), vmul(q0, d2)), vsub(vmul(q3, d1), vmul(d3, q1))));
+		const V tz = vmul(two, vadd(vsub(vmul(q0, d1), vmul(q1, d0)), vsub(vmul(q3, d2), vmul(d3, q2))));
+		d0 = tx; d1 = ty; d2 = tz;
+	}
+
+	// v' = v + 2 qv x (qv x v + qw v), plus the translation for points
+	void transform(V x, V y, V z, bool p_point, V &ox, V &oy, V &oz) const
+	{
+		const V ux = vadd(vsub(vmul(q1, z), vmul(q2, y)), vmul(q3, x));
+		const V uy = vadd(vsub(vmul(q2, x), vmul(q0, z)), vmul(q3, y));
+		const V uz = vadd(vsub(vmul(q0, y), vmul(q1, x)), vmul(q3, z));
+		const V two = vsplat(q0, 2.0f);
+		ox = vadd(x, vmul(two, vsub(vmul(q1, uz), vmul(q2, uy))));
+		oy = vadd(y, vmul(two, vsub(vmul(q2, ux), vmul(q0, uz))));
+		oz = vadd(z, vmul(two, vsub(vmul(q0, uy), vmul(q1, ux))));
+		if (p_point)
+		{
+			ox = vadd(ox, d0); oy = vadd(oy, d1); oz = vadd(oz, d2);
+		}
+	}
+};
+
+inline void skinBlocksDualQuat(const SkinningRest &p_rest, const float *p_dualQuats, unsigned p_blockBegin, unsigned p_blockEnd, const SkinTarget &p_target)
+{
+	const bool normals = p_target.normals && p_rest.hasNormals;
+	for (unsigned b = p_blockBegin; b < p_blockEnd; ++b)
+	{
+		const size_t base = size_t(b) * SKIN_BLOCK;
+		const unsigned lanes = std::min<unsigned>(SKIN_BLOCK, p_rest.numVertices - (unsigned)base);
+		alignas(32) float out[6][SKIN_BLOCK];
+
+#if defined(__AVX2__)
+		DualQuatLanes<Lanes8> dq;
+		dq.reset(_mm256_setzero_ps());
+		for (unsigned k = 0; k < p_rest.blockSlots[b]; ++k)
+		{
+			const size_t i = (size_t(b) * p_rest.slots + k) * SKIN_BLOCK;
+			const __m256 w = _mm256_loadu_ps(&p_rest.weights[i]);
+			if (p_rest.uniformSlots[b] & (1u << k))
+			{
+				const float *c = p_dualQuats + 8 * p_rest.joints[i];
+				dq.add(w, _mm256_broadcast_ss(c), _mm256_broadcast_ss(c + 1), _mm256_broadcast_ss(c + 2), _mm256_broadcast_ss(c + 3),
+					_mm256_broadcast_ss(c + 4), _mm256_broadcast_ss(c + 5), _mm256_broadcast_ss(c + 6), _mm256_broadcast_ss(c + 7));
+			}
+			else
+			{
+				const __m256i j = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)&p_rest.joints[i]), 3);
+				const float *c = p_dualQuats;
+				dq.add(w, _mm256_i32gather_ps(c, j, 4), _mm256_i32gather_ps(c + 1, j, 4), _mm256_i32gather_ps(c + 2, j, 4), _mm256_i32gather_ps(c + 3, j, 4),
+					_mm256_i32gather_ps(c + 4, j, 4), _mm256_i32gather_ps(c + 5, j, 4), _mm256_i32gather_ps(c + 6, j, 4), _mm256_i32gather_ps(c + 7, j, 4));
+			}
+		}
+		dq.finish();
+
+		__m256 ox, oy, oz;
+		dq.transform(_mm256_loadu_ps(&p_rest.px[base]), _mm256_loadu_ps(&p_rest.py[base]), _mm256_loadu_ps(&p_rest.pz[base]), true, ox, oy, oz);
+		_mm256_store_ps(out[0], ox);
+		_mm256_store_ps(out[1], oy);
+		_mm256_store_ps(out[2], oz);
+		if (normals)
+		{
+			dq.transform(_mm256_loadu_ps(&p_rest.nx[base]), _mm256_loadu_ps(&p_rest.ny[base]), _mm256_loadu_ps(&p_rest.nz[base]), false, ox, oy, oz);
+			_mm256_store_ps(out[3], ox);
+			_mm256_store_ps(out[4], oy);
+			_mm256_store_ps(out[5], oz);
+		}
+#else
+		// two groups of 4 lanes; each lane loads its dual quaternion as two
+		// registers and a transpose turns them into components
+		for (unsigned h = 0; h < SKIN_BLOCK; h += 4)
+		{
+			DualQuatLanes<Lanes4> dq;
+			dq.reset(_mm_setzero_ps());
+			for (unsigned k = 0; k < p_rest.blockSlots[b]; ++k)
+			{
+				const size_t i = (size_t(b) * p_rest.slots + k) * SKIN_BLOCK + h;
+				const int32_t *j = &p_rest.joints[i];
+				__m128 r0 = _mm_loadu_ps(p_dualQuats + 8 * j[0]), r1 = _mm_loadu_ps(p_dualQuats + 8 * j[1]);
+				__m128 r2 = _mm_loadu_ps(p_dualQuats + 8 * j[2]), r3 = _mm_loadu_ps(p_dualQuats + 8 * j[3]);
+				__m128 e0 = _mm_loadu_ps(p_dualQuats + 8 * j[0] + 4), e1 = _mm_loadu_ps(p_dualQuats + 8 * j[1] + 4);
+				__m128 e2 = _mm_loadu_ps(p_dualQuats + 8 * j[2] + 4), e3 = _mm_loadu_ps(p_dualQuats + 8 * j[3] + 4);
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				_MM_TRANSPOSE4_PS(e0, e1, e2, e3);
+				dq.add(_mm_loadu_ps(&p_rest.weights[i]), r0, r1, r2, r3, e0, e1, e2, e3);
+			}
+			dq.finish();
+
+			__m128 ox, oy, oz;
+			dq.transform(_mm_loadu_ps(&p_rest.px[base + h]), _mm_loadu_ps(&p_rest.py[base + h]), _mm_loadu_ps(&p_rest.pz[base + h]), true, ox, oy, oz);
+			_mm_store_ps(out[0] + h, ox);
+			_mm_store_ps(out[1] + h, oy);
+			_mm_store_ps(out[2] + h, oz);
+			if (normals)
+			{
+				dq.transform(_mm_loadu_ps(&p_rest.nx[base + h]), _mm_loadu_ps(&p_rest.ny[base + h]), _mm_loadu_ps(&p_rest.nz[base + h]), false, ox, oy, oz);
+				_mm_store_ps(out[3] + h, ox);
+				_mm_store_ps(out[4] + h, oy);
+				_mm_store_ps(out[5] + h, oz);
+			}
+		}
+#endif
+
+		for (unsigned lane = 0; lane < lanes; ++lane)
+		{
+			float *dst = p_target.positions + (base + lane) * p_target.stride;
+			dst[0] = out[0][lane];
+			dst[1] = out[1][lane];
+			dst[2] = out[2][lane];
+			if (normals)
+			{
+				dst = p_target.normals + (base + lane) * p_target.stride;
+				dst[0] = out[3][lane];
+				dst[1] = out[4][lane];
+				dst[2] = out[5][lane];
+			}
+		}
+	}
+}
+
+inline void skinVerticesDualQuat(JobSystem &p_jobs, const SkinningRest &p_rest, const float *p_dualQuats, const SkinTarget &p_target)
+{
+	const size_t blocksPerJob = 128;
+	p_jobs.parallelFor(p_rest.numBlocks, blocksPerJob, [&](size_t b0, size_t b1)
+	{
+		skinBlocksDualQuat(p_rest, p_dualQuats, (unsigned)b0, (unsigned)b1, p_target);
+	});
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// Automatic skinning weights by heat diffusion (Baran and Popovic,
+// "Automatic Rigging and Animation of 3D Characters", 2007).
+//
+// The weights of joint j are the equilibrium of heat flowing over the
+// surface, with every vertex also exchanging heat with its nearest bone:
+//
+//   (-Laplacian + H) w_j = H p_j
+//
+// H_ii = c / d_i^2, where d_i is the distance from vertex i to its
+// nearest bone. p_j(i) is 1 where that bone belongs to joint j and 0
+// elsewhere (split evenly on ties).
+// Multiplied by the vertex areas M this is the symmetric positive definite
+// system (K + M H) w_j = M H p_j, with K the cotangent stiffness matrix. It
+// is factored once (SimplicialLDLT) and solved for the joints in parallel.
+// The paper also drops bones a vertex can't see; here the nearest bone
+// always counts.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include <eigen>
+#include <SparseCore>
+#include <SparseCholesky>
+#include "skinweights.h"
+#include "jobs.h"
+
+// Fills p_dense with one column of p_vertices.size() weights per joint
+// (the dmat layout). p_triangles holds anything indexable with [0..2].
+// Returns false if the system can't be factored.
+template <typename Triangle>
+bool computeHeatWeights(JobSystem &p_jobs, const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Triangle> &p_triangles,
+	const JointBones &p_bones, std::vector<float> &p_dense)
+{
+	typedef Eigen::SparseMatrix<double> SparseMatrix;
+	const unsigned numVertices = (unsigned)p_vertices.size();
+	const unsigned numJoints = p_bones.numJoints();
+	const double heat = 1.0;	// c, as in the paper
+
+	// cotangent stiffness and lumped (one third of each triangle) areas
+	std::vector<Eigen::Triplet<double> > entries;
+	entries.reserve(p_triangles.size() * 12);
+	std::vector<double> area(numVertices, 0.0);
+	for (const Triangle &t : p_triangles)
+	{
+		const Eigen::Vector3d x[3] = { p_vertices[t[0]].template cast<double>(), p_vertices[t[1]].template cast<double>(), p_vertices[t[2]].template cast<double>() };
+		const double doubleArea = (x[1] - x[0]).cross(x[2] - x[0]).norm();
+		if (doubleArea <= 1e-20) continue;
+		for (int k = 0; k < 3; ++k)
+		{
+			area[t[k]] += doubleArea / 6.0;
+			// the edge opposite corner k
+			const int a = t[(k + 1) % 3], b = t[(k + 2) % 3];
+			const double cot = (x[(k + 1) % 3] - x[k]).dot(x[(k + 2) % 3] - x[k]) / doubleArea;
+			const double w = 0.5 * cot;
+			entries.push_back(Eigen::Triplet<double>(a, b, -w));
+			entries.push_back(Eigen::Triplet<double>(b, a, -w));
+			entries.push_back(Eigen::Triplet<double>(a, a, w));
+			entries.push_back(Eigen::Triplet<double>(b, b, w));
+		}
+	}
+
+	// nearest bones; d is kept away from 0 so H stays finite
+	std::vector<double> attach(numVertices);		// M_ii H_ii
+	std::vector<uint16_t> nearest(numVertices * size_t(numJoints), 0);	// [v * numJoints + j], ties
+	std::vector<uint8_t> numNearest(numVertices, 0);
+	p_jobs.parallelFor(numVertices, 1024, [&](size_t v0, size_t v1)
+	{
+		std::vector<float> d2(numJoints);
+		for (size_t v = v0; v < v1; ++v)
+		{
+			float best = 1e30f;
+			for (unsigned j = 0; j < numJoints; ++j)
+			{
+				d2[j] = p_bones.squaredDistance(p_vertices[v], j);
+				best = std::min(best, d2[j]);
+			}
+			unsigned n = 0;
+			for (unsigned j = 0; j < numJoints && n < 255; ++j)
+			{
+				if (d2[j] <= best * 1.0001f) nearest[v * numJoints + n++] = (uint16_t)j;
+			}
+			numNearest[v] = (uint8_t)n;
+			attach[v] = std::max(area[v], 1e-12) * heat / std::max<double>(best, 1e-8);
+		}
+	});
+	for (unsigned v = 0; v < numVertices; ++v) entries.push_back(Eigen::Triplet<double>(v, v, attach[v]));
+
+	SparseMatrix A(numVertices, numVertices);
+	A.setFromTriplets(entries.begin(), entries.end());
+	Eigen::SimplicialLDLT<SparseMatrix> solver(A);
+	if (solver.info() != Eigen::Success) return false;
+
+	// the factorization is only read from here on
+	p_dense.assign(size_t(numJoints) * numVertices, 0.0f);
+	p_jobs.parallelFor(numJoints, 1, [&](size_t j0, size_t j1)
+	{
+		Eigen::VectorXd b(numVertices);
+		for (size_t j = j0; j < j1; ++j)
+		{
+			for (unsigned v = 0; v < numVertices; ++v)
+			{
+				const uint16_t *n = &nearest[v * size_t(numJoints)];
+				const bool owns = std::find(n, n + numNearest[v], (uint16_t)j) != n + numNearest[v];
+				b[v] = owns ? attach[v] / numNearest[v] : 0.0;
+			}
+			const Eigen::VectorXd w = solver.solve(b);
+			float *column = &p_dense[j * numVertices];
+			for (unsigned v = 0; v < numVertices; ++v) column[v] = (float)std::min(std::max(w[v], 0.0), 1.0);
+		}
+	});
+	return true;
+}
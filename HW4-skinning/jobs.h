@@ -0,0 +1,123 @@
+#pragma once
+
+// Persistent worker pool for the per-frame skinning work.
+//
+// Threads are created once and sleep on a condition variable between
+// frames, so splitting a 60 Hz frame into chunks costs a wake-up instead of
+// a thread launch. parallelFor() hands out [begin, end) chunks from an
+// atomic counter; the calling thread works on chunks too and returns when
+// all chunks are done. It is not reentrant: a job must not call
+// parallelFor() itself.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem
+{
+public:
+	explicit JobSystem(unsigned p_threads = 0)
+	{
+		unsigned n = p_threads ? p_threads : std::thread::hardware_concurrency();
+		if (n == 0) n = 1;
+		for (unsigned i = 1; i < n; ++i) workers.push_back(std::thread(&JobSystem::workerLoop, this));
+	}
+
+	~JobSystem()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto &t : workers) t.join();
+	}
+
+	unsigned threadCount() const { return (unsigned)workers.size() + 1; }
+
+	void parallelFor(size_t p_count, size_t p_chunk, const std::function<void(size_t, size_t)> &p_body)
+	{
+		if (p_count == 0) return;
+		p_chunk = std::max<size_t>(p_chunk, 1);
+		if (workers.empty() || p_count <= p_chunk)
+		{
+			p_body(0, p_count);
+			return;
+		}
+
+		std::lock_guard<std::mutex> call(callMutex);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			body = &p_body;
+			count = p_count;
+			chunk = p_chunk;
+			next = 0;
+			pending = (unsigned)workers.size();
+			++generation;
+		}
+		wake.notify_all();
+
+		runChunks(p_body, p_count, p_chunk);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return pending == 0; });
+		body = nullptr;
+	}
+
+private:
+	void runChunks(const std::function<void(size_t, size_t)> &p_body, size_t p_count, size_t p_chunk)
+	{
+		for (;;)
+		{
+			const size_t first = next.fetch_add(p_chunk);
+			if (first >= p_count) break;
+			p_body(first, std::min(first + p_chunk, p_count));
+		}
+	}
+
+	void workerLoop()
+	{
+		unsigned seen = 0;
+		for (;;)
+		{
+			const std::function<void(size_t, size_t)> *job;
+			size_t jobCount, jobChunk;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stop || generation != seen; });
+				if (stop) return;
+				seen = generation;
+				job = body;
+				jobCount = count;
+				jobChunk = chunk;
+			}
+
+			runChunks(*job, jobCount, jobChunk);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0) done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex callMutex;	// one parallelFor at a time
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(size_t, size_t)> *body = nullptr;
+	size_t count = 0, chunk = 1;
+	std::atomic<size_t> next{ 0 };
+	unsigned pending = 0;
+	unsigned generation = 0;
+	bool stop = false;
+};
+
+// shared pool used by the skinning stages
+inline JobSystem &jobSystem()
+{
+	static JobSystem system;
+	return system;
+}
@@ -3,7 +3,25 @@
 #include <fstream>
 #include <vector>
 #include <iostream>
+#include <chrono>
 #include <eigen>
+#include "skinweights.h"
+#include "heatweights.h"
+#include "skinning.h"
+#include "dualquat.h"
+#include "skeleton.h"
+#include "crowd.h"
+#include "animation.h"
+#include "blendtree.h"
+#include "meshbuffer.h"
+#include "dirtyskin.h"
+#include "correctives.h"
+#include "normals.h"
+#include "simplify.h"
+#include "profiler.h"
+#include "rig.h"
+#include "pointcache.h"
+#include "meshio.h"
 
 using namespace Eigen;
 
@@ -27,13 +45,16 @@ char* g_windowName = "HW4-Skinning";
 
 GLFWwindow* g_window;
 
+std::string g_dataPath;                     // "data/<name>/" of the loaded mesh
 std::vector<Triangle> g_triangles;
 std::vector<Vector3f> g_vertices;
 std::vector<Vector3f> g_normals;
-std::vector<std::vector<float> > g_weights; // [jointID][vertexID]
-std::vector<std::vector<float> > g_poses;   // [poseID][jointID]
+SkinWeights g_weights;                      // sparse, vertex-major
+unsigned int g_maxInfluences = 4;           // influences kept per vertex (4 or 8), at most the joint count
+DMat g_poses;                               // [poseID][.bf joint ID * 4 + k], mapped when binary
 
-// joints
+// joints, in the order of g_rig: parents before children
+Rig g_rig;
 unsigned int g_numJoints;
 std::vector<int> g_jointParent;	// indices of parent joints
 
@@ -44,26 +65,90 @@ std::vector<Matrix4f> g_jointRotRest;		// joint local rest-pose rotation
 
 // ----------------------------------------------------------------------------
 
+// joints sorted into depth levels, with local and global poses in its layout
+Skeleton g_skeleton;
+AlignedFloats g_localPose;
+AlignedFloats g_globalPose;
+
 // global transformations
 std::vector<Matrix4f> g_jointTrans;			// joint global transformation
 std::vector<Matrix4f> g_jointTransRestInv;	// joint global rest-pose inverse transformation
 
 // deformed vertices
 std::vector<Vector3f> g_deformedVertices;
+std::vector<Vector3f> g_deformedNormals;
+
+// where the normals of the deformed mesh come from
+enum class NormalMode
+{
+	Rest,			// g_normals as they are; wrong once the mesh bends
+	Skinned,		// rest normals through the skinning kernel
+	Recomputed		// area-weighted face normals of g_deformedVertices
+};
+NormalMode g_normalMode = NormalMode::Skinned;
+NormalRecompute g_normalRecompute;			// vertex-to-triangle adjacency for NormalMode::Recomputed
+SkinningRest g_skinRest;					// SoA rest pose read by the skinning kernel
+SkinPalette g_skinPalette;					// jointTrans * restInv as 3x4 affines, rebuilt every frame
+AlignedFloats g_dualQuats;					// the palette as dual quaternions, 8 floats per joint
+SkinningMode g_skinningMode = SkinningMode::Linear;
+SkinnedMeshBuffer g_meshBuffer;				// GL buffers the kernel skins into
+std::vector<uint8_t> g_jointChanged;		// [jointID], g_jointTrans moved in the last animate()
+SkinDirtyTracker g_skinDirty;				// blocks each skinning target still lacks
+const unsigned int SKIN_TARGET_ARRAY = 2;	// targets 0 and 1 are the halves of g_meshBuffer
+CorrectiveShapes g_correctives;				// bulges at bending joints, applied to g_skinRest
+bool g_enableCorrectives = 0;				// the shapes are synthesized, not authored; B turns them on
+
+// crowd mode
+Crowd g_crowd;								// instances sharing the mesh, skinned every frame
+float g_crowdScale = 1.0f;					// fits the grid into the single-mesh view
+std::vector<SkinnedLod> g_crowdLods;		// the mesh at decreasing detail, 0 the full mesh
+bool g_enableCrowdLods = 1;					// pick a LOD per instance from its size on screen
+const float LOD_PIXEL_ERROR = 0.5f;			// largest simplification error shown, in pixels
+
+// profiling
+bool g_enableProfilerGraph = 0;				// stage times of the last frames over the scene
+bool g_headless = 0;						// hidden window without vsync, for --profile
+unsigned int g_profileFrames = 0;			// frames left to run, 0 to run until the window closes
 
 // ----------------------------------------------------------------------------
 
 int g_enableAnimate = 0;
+AnimationClip g_clip;						// the animation played in mode 0 and by the crowd
+ClipCursor g_clipCursor;
+std::vector<Quaternionf> g_clipRotations;
+BlendGraph g_blendGraph;					// layers of g_clip played in mode 3
+BlendState g_blendState;
 bool g_enableRenderSkeleton = 0;
 bool g_enableRenderSkinningWeights = 0;
+std::vector<Vector3f> g_weightColors;		// [vertexID], the weight view, rebuilt only when it changes
+int g_heatmapJoint = -1;					// weight view: -1 all joints, otherwise the weights of this one
+bool g_enableVertexBuffer = 1;			// draw from g_meshBuffer instead of immediate mode
 
 void animate();
+void buildWeightColors();
+void computeJointTransformationsSorted(const std::vector<Matrix4f>& p_local, std::vector<Matrix4f>& p_global, std::vector<uint8_t>* p_changed = nullptr);
 
 float getTime()
 {
 	return (float) glfwGetTime();
 }
 
+// colors of the stages in the profiler graph, then the time outside them
+const float g_profileColors[PROFILE_STAGES + 1][3] = {
+	{ 0.9f, 0.6f, 0.2f }, { 0.9f, 0.9f, 0.2f }, { 0.3f, 0.9f, 0.9f }, { 0.5f, 0.9f, 0.3f }, { 0.9f, 0.2f, 0.2f },
+	{ 0.8f, 0.3f, 0.9f }, { 0.2f, 0.6f, 0.9f }, { 0.3f, 0.3f, 0.4f }, { 0.6f, 0.6f, 0.6f } };
+
+// means over the last p_frames frames
+void printProfile(unsigned int p_frames)
+{
+	const FrameSample mean = frameProfiler().average(p_frames);
+	std::cout << "Frame " << mean.total << " ms over the last " << std::min(p_frames, frameProfiler().frameCount()) << " frames:" << std::endl;
+	for (unsigned int s = 0; s < PROFILE_STAGES; ++s)
+		std::cout << "  " << profileStageName(ProfileStage(s)) << " " << mean.stages[s] << " ms" << std::endl;
+	std::cout << "  other " << mean.other() << " ms" << std::endl;
+	std::cout << "Graph colors: orange pose, yellow kinematics, cyan correctives, green palette, red skinning, purple normals, blue draw, dark swap, gray other" << std::endl;
+}
+
 void glfwErrorCallback(int error, const char* description)
 {
 	std::cerr << "GLFW Error " << error << ": " << description << std::endl;
@@ -79,7 +164,7 @@ void glfwKeyCallback(GLFWwindow* p_window, int p_key, int p_scancode, int p_acti
 
 	if (p_key == GLFW_KEY_A && p_action == GLFW_PRESS)
 	{
-		g_enableAnimate = (g_enableAnimate + 1) % 3;
+		g_enableAnimate = (g_enableAnimate + 1) % 4;
 	}
 
 	if (p_key == GLFW_KEY_S && p_action == GLFW_PRESS)
@@ -91,6 +176,61 @@ void glfwKeyCallback(GLFWwindow* p_window, int p_key, int p_scancode, int p_acti
 	{
 		g_enableRenderSkinningWeights = !(g_enableRenderSkinningWeights);
 	}
+
+	if (p_key == GLFW_KEY_J && p_action == GLFW_PRESS)
+	{
+		g_heatmapJoint = g_heatmapJoint + 1 < (int)g_numJoints ? g_heatmapJoint + 1 : -1;
+		g_enableRenderSkinningWeights = 1;
+		buildWeightColors();
+		if (g_meshBuffer.ready()) g_meshBuffer.setColors(g_weightColors[0].data());
+		if (g_heatmapJoint < 0) std::cout << "Weights: all joints" << std::endl;
+		else std::cout << "Weights: joint " << g_heatmapJoint << " (.bf joint " << g_rig.sourceJoint[g_heatmapJoint] << ")" << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_D && p_action == GLFW_PRESS)
+	{
+		g_skinningMode = g_skinningMode == SkinningMode::Linear ? SkinningMode::DualQuaternion : SkinningMode::Linear;
+		g_skinDirty.invalidate();
+		std::cout << "Skinning: " << skinningModeName(g_skinningMode) << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_B && p_action == GLFW_PRESS)
+	{
+		g_enableCorrectives = !(g_enableCorrectives);
+		std::cout << "Corrective shapes: " << (g_enableCorrectives ? "on (linear blend skinning only)" : "off") << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_N && p_action == GLFW_PRESS)
+	{
+		g_normalMode = NormalMode(((int)g_normalMode + 1) % 3);
+		g_skinDirty.invalidate();
+		const char* names[] = { "rest", "skinned", "recomputed" };
+		std::cout << "Normals: " << names[(int)g_normalMode] << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_L && p_action == GLFW_PRESS && g_crowd.count)
+	{
+		g_enableCrowdLods = !(g_enableCrowdLods);
+		std::cout << "Crowd LODs: " << (g_enableCrowdLods ? "by screen size" : "off") << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_P && p_action == GLFW_PRESS)
+	{
+		g_enableProfilerGraph = !(g_enableProfilerGraph);
+		if (g_enableProfilerGraph) printProfile(60);
+	}
+
+	if (p_key == GLFW_KEY_C && p_action == GLFW_PRESS)
+	{
+		if (frameProfiler().writeCsv("profile.csv"))
+			std::cout << "Wrote " << frameProfiler().frameCount() << " frames to profile.csv" << std::endl;
+	}
+
+	if (p_key == GLFW_KEY_V && p_action == GLFW_PRESS && g_meshBuffer.ready())
+	{
+		g_enableVertexBuffer = !(g_enableVertexBuffer);
+		std::cout << "Rendering: " << (g_enableVertexBuffer ? "vertex buffers" : "immediate mode") << std::endl;
+	}
 }
 
 void initWindow()
@@ -103,6 +243,7 @@ void initWindow()
 		exit(1);
 	}
 
+	if (g_headless) glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
 	g_window = glfwCreateWindow(g_windowWidth, g_windowHeight, g_windowName, NULL, NULL);
 	if (!g_window)
 	{
@@ -117,13 +258,25 @@ void initWindow()
 	// Make the window's context current
 	glfwMakeContextCurrent(g_window);
 
-	// turn on VSYNC
-	glfwSwapInterval(1);
+	// turn on VSYNC, off when profiling headless so frames run flat out
+	glfwSwapInterval(g_headless ? 0 : 1);
+}
+
+void initMeshBuffer()
+{
+	if (glewInit() != GLEW_OK || !g_meshBuffer.init((unsigned int)g_vertices.size(), g_triangles[0].indices, 3 * g_triangles.size(), g_normals[0].data(), g_weightColors[0].data()))
+	{
+		std::cerr << "No vertex buffer objects, rendering in immediate mode" << std::endl;
+		g_enableVertexBuffer = false;
+		return;
+	}
+	std::cout << "Rendering: vertex buffers, " << (g_meshBuffer.isPersistent() ? "persistently mapped" : "mapped per frame") << std::endl;
 }
 
 void initGL()
 {
 	glClearColor(1.f, 1.f, 1.f, 1.0f);
+	initMeshBuffer();
 
 	glEnable(GL_LIGHTING);
 	glEnable(GL_LIGHT0);
@@ -135,15 +288,21 @@ void initGL()
 	gluPerspective(45.0f, (GLfloat)g_windowWidth / (GLfloat)g_windowHeight, 0.1f, 10.0f);
 }
 
+// the camera looks at the origin from here
+Vector3f cameraEye()
+{
+	if (g_enableAnimate == 0)
+		return Vector3f(sin(getTime() * 0.1f + 0.2f) * 3.0f, 1.0f, cos(getTime() * 0.1f + 0.2f) * 3.0f);
+	return Vector3f(2.0f, 1.0f, 2.0f);
+}
+
 void setModelViewMatrix()
 {
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	if (g_enableAnimate == 0)
-		gluLookAt(sin(getTime() * 0.1f + 0.2f) * 3.0f, 1.0f, cos(getTime() * 0.1f + 0.2f) * 3.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
-	else
-		gluLookAt(2.0f, 1.0f, 2.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+	const Vector3f eye = cameraEye();
+	gluLookAt(eye(0), eye(1), eye(2), 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
 }
 
 void renderSkeletonRig()
@@ -190,9 +349,53 @@ void renderSkeletonRig()
 	glColor3f(1.0f, 1.0f, 1.0f);
 }
 
+// weight color
+Vector3f weightColor(unsigned int p_vertex)
+{
+	float r = 0.4f, g = 0.4f, b = 0.4f;
+
+	const SkinInfluence* influences = g_weights.vertexInfluences(p_vertex);
+	for (unsigned int k = 0; k < g_weights.counts[p_vertex]; ++k)
+	{
+		// by .bf joint ID, so a renumbered rig keeps its colors
+		const unsigned int jointID = g_rig.sourceJoint[influences[k].joint];
+		const float w = influences[k].weight();
+		if (jointID == g_numJoints - 1) continue;
+		if (jointID % 3 == 0) r += 0.4f * w;
+		if (jointID % 3 == 1) g += 0.4f * w;
+		if (jointID % 3 == 2) b += 0.4f * w;
+	}
+	return Vector3f(r, g, b);
+}
+
+// weight of one joint, blue at 0 through green to red at 1
+Vector3f heatmapColor(float p_weight)
+{
+	const float w = std::min(std::max(p_weight, 0.0f), 1.0f);
+	return Vector3f(std::min(2.0f * w, 1.0f), 1.0f - std::fabs(2.0f * w - 1.0f), std::max(1.0f - 2.0f * w, 0.0f));
+}
+
+// g_weightColors for the current view; once per load or view change, so
+// the weight view costs nothing per frame
+void buildWeightColors()
+{
+	g_weightColors.resize(g_vertices.size());
+	for (unsigned int v = 0; v < g_vertices.size(); ++v)
+	{
+		g_weightColors[v] = g_heatmapJoint < 0 ? weightColor(v) : heatmapColor(g_weights.weight(v, (unsigned int)g_heatmapJoint));
+	}
+}
+
 void renderMesh()
 {
 	glEnable(GL_COLOR_MATERIAL);			
+	if (g_enableVertexBuffer)
+	{
+		glColor3f(0.8f, 0.8f, 0.8f);
+		g_meshBuffer.draw(g_enableRenderSkinningWeights, g_normalMode != NormalMode::Rest);
+		return;
+	}
+
 	glBegin(GL_TRIANGLES);
 
 	for (auto& triangle : g_triangles)
@@ -201,23 +404,13 @@ void renderMesh()
 		{
 			const int vidx = triangle[i];
 			const Vector3f v = g_deformedVertices[vidx];
-			const Vector3f vn = g_normals[vidx];
+			const Vector3f vn = g_normalMode == NormalMode::Rest ? g_normals[vidx] : g_deformedNormals[vidx];
 			glNormal3f(vn(0), vn(1), vn(2));
 
 			if (g_enableRenderSkinningWeights)
 			{
-				// weight color
-				float r = 0.4f, g = 0.4f, b = 0.4f;
-
-				for (unsigned int jointID = 0; jointID < g_numJoints - 1; ++jointID)
-				{
-					const float w = g_weights[jointID][vidx];
-					if (jointID % 3 == 0) r += 0.4f * w;
-					if (jointID % 3 == 1) g += 0.4f * w;
-					if (jointID % 3 == 2) b += 0.4f * w;
-				}
-
-				glColor3f(r, g, b);
+				const Vector3f& c = g_weightColors[vidx];
+				glColor3f(c(0), c(1), c(2));
 			}
 			else 
 			{
@@ -230,18 +423,113 @@ void renderMesh()
 	glEnd();
 }
 
+void renderCrowd()
+{
+	glEnable(GL_COLOR_MATERIAL);
+	glEnable(GL_NORMALIZE);
+	glColor3f(0.8f, 0.8f, 0.8f);
+	glPushMatrix();
+	glScalef(g_crowdScale, g_crowdScale, g_crowdScale);
+
+	// every instance is drawn from its slice of the crowd buffer with the
+	// rest normals and index list of its LOD
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	for (unsigned int i = 0; i < g_crowd.count; ++i)
+	{
+		const SkinnedLod& lod = g_crowdLods[g_crowd.lod[i]];
+		glNormalPointer(GL_FLOAT, 0, lod.normals[0].data());
+		glVertexPointer(3, GL_FLOAT, 0, g_crowd.instancePositions(i));
+		glDrawElements(GL_TRIANGLES, (GLsizei)lod.mesh.indices.size(), GL_UNSIGNED_INT, lod.mesh.indices.data());
+	}
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glPopMatrix();
+	glDisable(GL_NORMALIZE);
+}
+
+// one column per kept frame, newest on the right, stage times stacked from
+// the bottom at 10 pixels per ms; the line marks 16.7 ms (60 Hz)
+void renderProfilerGraph()
+{
+	const float pixelsPerMs = 10.0f;
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_LIGHTING);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0.0, g_windowWidth, 0.0, g_windowHeight, -1.0, 1.0);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	const FrameProfiler& profiler = frameProfiler();
+	const float width = std::max(1.0f, (float)g_windowWidth / profiler.capacity());
+	const float x0 = g_windowWidth - width * profiler.frameCount();
+	glBegin(GL_QUADS);
+	for (unsigned int i = 0; i < profiler.frameCount(); ++i)
+	{
+		const FrameSample& f = profiler.frame(i);
+		const float x = x0 + width * i;
+		float y = 0.0f;
+		for (unsigned int s = 0; s <= PROFILE_STAGES; ++s)
+		{
+			const float h = (s < PROFILE_STAGES ? f.stages[s] : f.other()) * pixelsPerMs;
+			glColor3fv(g_profileColors[s]);
+			glVertex2f(x, y); glVertex2f(x + width, y); glVertex2f(x + width, y + h); glVertex2f(x, y + h);
+			y += h;
+		}
+	}
+	glEnd();
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glBegin(GL_LINES);
+	glVertex2f(0.0f, 16.7f * pixelsPerMs);
+	glVertex2f((float)g_windowWidth, 16.7f * pixelsPerMs);
+	glEnd();
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glEnable(GL_LIGHTING);
+	glEnable(GL_DEPTH_TEST);
+}
+
 void render()
 {
+	ProfileScope scope(ProfileStage::Draw);
 	setModelViewMatrix();	
-	renderMesh();
-	if (g_enableRenderSkeleton) renderSkeletonRig();
+	if (g_crowd.count)
+	{
+		renderCrowd();
+	}
+	else
+	{
+		renderMesh();
+		if (g_enableRenderSkeleton) renderSkeletonRig();
+	}
+	if (g_enableProfilerGraph) renderProfilerGraph();
 }
 
 void renderLoop()
 {
 	while (!glfwWindowShouldClose(g_window))
 	{
-		animate();
+		frameProfiler().beginFrame();
+		if (g_crowd.count)
+		{
+			// the crowd is drawn scaled by g_crowdScale; in its own units
+			// the eye is farther away by the inverse
+			const float pixelsPerUnit = 0.5f * g_windowHeight / std::tan(0.5f * 45.0f * 3.14159265f / 180.0f);
+			if (g_enableCrowdLods)
+				g_crowd.selectLods(cameraEye() / g_crowdScale, pixelsPerUnit, LOD_PIXEL_ERROR);
+			else
+				g_crowd.forceLod(0);
+			g_crowd.update(jobSystem(), g_skeleton, g_clip, getTime());
+		}
+		else
+			animate();
 
 		// clear buffers
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -249,209 +537,305 @@ void renderLoop()
 		render();
 
 		// Swap front and back buffers
-		glfwSwapBuffers(g_window);
+		{
+			ProfileScope scope(ProfileStage::Swap);
+			glfwSwapBuffers(g_window);
+		}
 
 		// Poll for and process events
 		glfwPollEvents();
+		frameProfiler().endFrame();
+
+		if (g_profileFrames > 0 && --g_profileFrames == 0) break;
 	}
 }
 
 // ----------------------------------------------------------------------------
 
-bool loadObj(std::string fname, std::vector<Vector3f> &pts, std::vector<Vector3f> &pts_n, std::vector<Triangle> &triangles)
-{
-	char c[500];
-
-	int numVertices = 0, numFaces = 0;
-	bool normals = false, texture = false;
-	int tint;
-	char ch;
-	int p, q, r;
-	float x, y, z;
-	std::vector<Vector3f>::iterator v;
-	std::vector<Vector3f>::iterator vn;
-	std::vector<Triangle>::iterator t;
-	std::ifstream in1(fname.c_str(), std::ios::in);
-	if (!in1.is_open()) {
-		return false;
-	}
-	in1.flags(in1.flags() & ~std::ios::skipws);
-
-	while (in1 >> ch) {
-		if (ch == 'v') {
-			in1 >> ch;
-			if (ch == ' ') numVertices++;
-			else if (ch == 'n') normals = true;
-			else if (ch == 't') texture = true;
-			else std::cerr << "error \'" << ch << "\'" << std::endl;
+// the compiled rig while it is at least as new as the .bf, otherwise the
+// .bf checked and compiled (and the rig saved for next time); exits if the
+// .bf is broken
+void loadSkeleton(std::string fname) 
+{
+	const std::string cachePath = rigPath(fname);
+	const int64_t cacheTime = fileModifiedTime(cachePath);
+	if (!(cacheTime && cacheTime >= fileModifiedTime(fname) && g_rig.load(cachePath)))
+	{
+		std::vector<int> ids, parents;
+		std::vector<Vector3f> offsets;
+		std::string error;
+		if (!parseSkeletonFile(fname, ids, parents, offsets, error) || !g_rig.compile(ids, parents, offsets, error))
+		{
+			std::cerr << "Invalid skeleton " << fname << ": " << error << std::endl;
+			exit(1);
 		}
-		else if (ch == '#') {
-			while (in1 >> ch && ch != '\n'); // Read to the end of the line.
+		if (!g_rig.save(cachePath))
+		{
+			std::cerr << "Could not write rig cache " << cachePath << std::endl;
 		}
-		else if (ch == 'f') numFaces++;
 	}
-	in1.close();
 
-	std::cout << "Mesh vertices: " << numVertices << std::endl;
+	g_jointParent = g_rig.parent;
+	g_jointOffset = g_rig.offset;
+	g_numJoints = g_rig.numJoints;
 
-	pts.resize(numVertices);
-	pts_n.resize(numVertices);
-	triangles.resize(numFaces);
-	v = pts.begin();
-	vn = pts_n.begin();
-	t = triangles.begin();
+	unsigned int moved = 0;
+	for (unsigned int j = 0; j < g_numJoints; j++) moved += g_rig.sourceJoint[j] != j;
+	std::cout << "Loaded " << g_numJoints << " joints";
+	if (moved) std::cout << ", " << moved << " renumbered so that parents come first";
+	std::cout << std::endl;
+}
 
-	std::ifstream in(fname, std::ios::in);
-	if (!in.is_open()) {
-		return false;
+// rotation p_jointID of pose p_pose, as w x y z
+const float* poseRotation(unsigned int p_pose, unsigned int p_jointID)
+{
+	return g_poses.column(p_pose) + 4 * g_rig.sourceJoint[p_jointID];
+}
+
+void setJointRotations(float t)
+{
+	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
+	{
+		const float* pose = poseRotation(1, jointID);
+		Quaternionf qB = Quaternionf(pose[0], pose[1], pose[2], pose[3]);
+
+		Quaternionf qA;
+		qA.setIdentity();
+		Quaternionf q = qA.slerp(t, qB);
+
+		Matrix4f R;
+		R.setIdentity();
+		R.block<3, 3>(0, 0) = q.toRotationMatrix();
+
+		g_jointRot[jointID] = R;
 	}
+}
 
-	while (in >> ch) {
-		if (ch == '#') {
-			in.getline(c, 500);
-			continue;
-		}
-		if (ch == 'g') {
-			in.getline(c, 500);
-			continue;
-		}
-		if (ch == 's') {
-			in.getline(c, 500);
-			continue;
-		}
-		if (ch == 'm') {
-			in.getline(c, 500);
-			continue;
-		}
-		if (ch == 'u') {
-			in.getline(c, 500);
-			continue;
-		}
-		if (ch == 'v') {
-			ch = in.peek();
-			if (ch != 't' && ch != 'n') {
-				in >> x >> y >> z;
-				(*v) << x, y, z;
-				v++;
-			}
-			else if (ch == 'n') {
-				in >> ch;
-				in >> x >> y >> z;
-				(*vn) << x, y, z;
-				//(*vn).normalize();
-				vn++;
-			}
-			else {
-				in.getline(c, 500);
-			}
-			continue;
-		}
-		if (ch == 'f') {
-			if (normals && texture) {
-				in >> p >> ch >> tint >> ch >> tint >> q >> ch >> tint >> ch >> tint >> r >> ch >> tint >> ch >> tint;
-			}
-			else if (normals) {
-				in >> p >> ch >> ch >> tint >> q >> ch >> ch >> tint >> r >> ch >> ch >> tint;
-			}
-			else if (texture) {
-				in >> p >> ch >> tint >> q >> ch >> tint >> r >> ch >> tint;
-			}
-			else {
-				in >> p >> q >> r;
-			}
-			(*t)[0] = p - 1;
-			(*t)[1] = q - 1;
-			(*t)[2] = r - 1;
-			t++;
-			continue;
+// The original motion, slerp(identity, pose 1, |sin t|), as a clip over
+// one period: joints that pose 1 leaves alone get a single key, the others
+// p_keys keys along the curve.
+void buildDefaultClip(unsigned int p_keys)
+{
+	const float period = 3.14159265f;
+	g_clip.clear(period);
+	std::vector<float> times;
+	std::vector<Quaternionf> rotations;
+	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
+	{
+		const float* pose = poseRotation(1, jointID);
+		const Quaternionf qB = Quaternionf(pose[0], pose[1], pose[2], pose[3]).normalized();
+		const unsigned int keys = qB.angularDistance(Quaternionf::Identity()) < 1e-5f ? 1 : p_keys;
+		times.resize(keys);
+		rotations.resize(keys);
+		for (unsigned int k = 0; k < keys; ++k)
+		{
+			times[k] = keys > 1 ? period * k / (keys - 1) : 0.0f;
+			rotations[k] = Quaternionf::Identity().slerp(std::fabs(sinf(times[k])), qB);
 		}
+		g_clip.addTrack(times, rotations);
 	}
-	in.close();
-	return true;
 }
 
-void loadSkeleton(std::string fname) 
+// p_rotations by joint ID
+void setJointRotations(const Quaternionf* p_rotations)
 {
-	std::ifstream in(fname.c_str(), std::ios::in);
-	int jointID, parent;
-	float offsetX, offsetY, offsetZ;
-
-	while (in >> jointID >> parent >> offsetX >> offsetY >> offsetZ)
-	{				
-		g_jointParent.push_back(parent);
-
-		Matrix4f offset;
-		offset.setIdentity();
-		offset(0, 3) = offsetX;
-		offset(1, 3) = offsetY;
-		offset(2, 3) = offsetZ;
-		g_jointOffset.push_back(offset);
+	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
+	{
+		g_jointRot[jointID].setIdentity();
+		g_jointRot[jointID].block<3, 3>(0, 0) = p_rotations[jointID].toRotationMatrix();
 	}
+}
 
-	g_numJoints = (unsigned int) g_jointParent.size();
+// The default clip layered on itself: the limbs (joints two or more levels
+// below a root) mixed half and half with a copy half a period behind, and
+// the whole body swaying on top with an additive copy at double speed.
+void buildBlendGraph()
+{
+	std::vector<float> limbs(g_numJoints);
+	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
+	{
+		int depth = 0;
+		for (int j = g_jointParent[jointID]; j >= 0; j = g_jointParent[j]) depth++;
+		limbs[jointID] = depth >= 2 ? 1.0f : 0.0f;
+	}
 
-	std::cout << "Loaded " << g_numJoints << " joints" << std::endl;
+	g_blendGraph.reset(g_numJoints);
+	const unsigned base = g_blendGraph.addClip(g_clip);
+	const unsigned behind = g_blendGraph.addClip(g_clip, 1.0f, 0.5f * g_clip.duration);
+	const unsigned mixed = g_blendGraph.addBlend(base, behind, 0.5f, true, g_blendGraph.addMask(limbs));
+	const unsigned sway = g_blendGraph.addClip(g_clip, 2.0f);
+	g_blendGraph.compile(g_blendGraph.addAdditive(mixed, sway, 0.25f));
+	g_blendState.init(g_blendGraph);
 }
 
-void loaddmat(std::string fname, std::vector<std::vector<float> > &mat)
+// A bulge for every joint with a parent. Linear blend skinning loses volume
+// where a vertex is shared by a joint and its parent and the joint bends, so
+// the shape pushes those vertices out along their normals, most where the
+// two weights are even (4 w_joint w_parent = 1): up to a tenth of the bone
+// length into the joint at 90 degrees.
+void buildCorrectiveShapes()
 {
-	std::ifstream in(fname.c_str(), std::ios::in);
-	int cols, rows;
-	in >> cols >> rows;
-	mat.resize(cols);
-	for (int i = 0; i < cols; i++) {
-		mat[i].resize(rows);
-		for (int j = 0; j < rows; j++) {
-			in >> mat[i][j];
+	g_correctives.clear();
+	std::vector<unsigned int> vertices;
+	std::vector<Vector3f> deltas;
+	for (unsigned int j = 0; j < g_numJoints; j++)
+	{
+		const int parent = g_jointParent[j];
+		if (parent < 0) continue;
+		const float bulge = 0.1f * g_jointOffset[j].block<3, 1>(0, 3).norm();
+		vertices.clear();
+		deltas.clear();
+		for (unsigned int v = 0; v < g_vertices.size(); v++)
+		{
+			const float shared = 4.0f * g_weights.weight(v, j) * g_weights.weight(v, (unsigned int)parent);
+			if (shared <= 0.0f) continue;
+			vertices.push_back(v);
+			deltas.push_back(bulge * shared * g_normals[v].normalized());
 		}
+		g_correctives.addShape(j, 0.0f, 0.5f * 3.14159265f, vertices, deltas, 0.01f * bulge);
 	}
+	g_correctives.bind(g_skinRest);
 }
 
-void setJointRotations(float t)
+// the bulges make up for the volume linear blending loses; dual quaternions
+// don't lose it
+bool useCorrectives()
 {
-	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
-	{
-		Quaternionf qB = Quaternionf(g_poses[1][4 * jointID], g_poses[1][4 * jointID + 1], g_poses[1][4 * jointID + 2], g_poses[1][4 * jointID + 3]);
+	return g_enableCorrectives && g_skinningMode == SkinningMode::Linear;
+}
 
-		Quaternionf qA;
-		qA.setIdentity();
-		Quaternionf q = qA.slerp(t, qB);
+// joint positions of the rest pose, for binding vertices to bones
+JointBones restPoseBones()
+{
+	std::vector<Vector3f> jointPositions(g_numJoints);
+	for (unsigned int j = 0; j < g_numJoints; j++) jointPositions[j] = g_rig.restGlobal[j].block<3, 1>(0, 3);
+	return JointBones(jointPositions, g_jointParent);
+}
 
-		Matrix4f R;
-		R.setIdentity();
-		R.block<3, 3>(0, 0) = q.toRotationMatrix();
+// where the heat diffusion weights of the data set in p_dataPath are
+// cached; not weights.bdmat, which is the sidecar of weights.dmat
+std::string heatWeightsPath(const std::string& p_dataPath)
+{
+	return p_dataPath + "heatweights.bdmat";
+}
 
-		g_jointRot[jointID] = R;
+// heat diffusion weights for the loaded mesh, saved to p_cachePath
+bool solveAutomaticWeights(const std::string& p_cachePath)
+{
+	std::cout << "Solving heat diffusion weights (" << g_vertices.size() << " vertices, " << g_numJoints << " joints)" << std::endl;
+	const auto start = std::chrono::high_resolution_clock::now();
+	std::vector<float> dense;
+	if (!computeHeatWeights(jobSystem(), g_vertices, g_triangles, restPoseBones(), dense))
+	{
+		std::cerr << "Could not solve for weights" << std::endl;
+		return false;
+	}
+	std::cout << "Solved in " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+	// cached by .bf joint ID, like weights.dmat, so a renumbered rig reads
+	// it the same way
+	const size_t numVertices = g_vertices.size();
+	std::vector<float> bySource(dense.size());
+	for (unsigned int j = 0; j < g_numJoints; j++)
+		std::copy(&dense[j * numVertices], &dense[j * numVertices] + numVertices, &bySource[g_rig.sourceJoint[j] * numVertices]);
+	if (!DMat::saveBinary(p_cachePath, g_numJoints, (unsigned int)numVertices, bySource.data()))
+	{
+		std::cerr << "Could not write weight cache " << p_cachePath << std::endl;
 	}
+	buildSkinWeights(dense.data(), g_numJoints, (unsigned int)g_vertices.size(), g_maxInfluences, 0.01f, g_weights);
+	return true;
 }
 
 void loadData(std::string p_inputData)
 {
+	g_dataPath = "data/" + p_inputData + "/";
 	// load data
 	std::cout << "Loading obj" << std::endl;
-	loadObj("data/" + p_inputData + "/mesh.obj", g_vertices, g_normals, g_triangles);
+	if (!loadMesh("data/" + p_inputData + "/mesh.obj", g_vertices, g_normals, g_triangles))
+	{
+		std::cerr << "Could not load mesh for " << p_inputData << std::endl;
+		exit(1);
+	}
 
 	std::cout << "Loading skeleton" << std::endl;
+	g_jointParent.clear();
+	g_jointOffset.clear();
 	loadSkeleton("data/" + p_inputData + "/skeleton.bf");
-
-	std::cout << "Loading weights" << std::endl;
-	loaddmat("data/" + p_inputData + "/weights.dmat", g_weights);
+	if (!g_skeleton.build(g_jointParent, g_jointOffset))
+	{
+		std::cerr << "Invalid joint hierarchy in " << p_inputData << std::endl;
+		exit(1);
+	}
+	g_localPose.assign(g_skeleton.poseFloats(), 0.0f);
+	g_globalPose.assign(g_skeleton.poseFloats(), 0.0f);
 
 	std::cout << "Loading poses" << std::endl;
-	loaddmat("data/" + p_inputData + "/pose.dmat", g_poses);
+	if (!g_poses.load("data/" + p_inputData + "/pose.dmat") || g_poses.cols < 2)
+	{
+		std::cerr << "Could not load poses for " << p_inputData << std::endl;
+		exit(1);
+	}
+	std::string poseError;
+	if (!validatePoses(g_poses.data(), g_poses.cols, g_poses.rows, g_numJoints, 1e-3f, poseError))
+	{
+		std::cerr << "Invalid poses for " << p_inputData << ": " << poseError << std::endl;
+		exit(1);
+	}
 
 	// initialize data structures
 	Matrix4f ident;
 	ident.setIdentity();
 	g_deformedVertices.resize(g_vertices.size());
+	g_deformedNormals = g_normals;
+	g_normalRecompute.build((unsigned int)g_vertices.size(), g_triangles[0].indices, g_triangles.size());
 	g_jointRot.resize(g_numJoints, ident);
 	g_jointRotRest.resize(g_numJoints, ident);
-	g_jointTrans.resize(g_numJoints, ident);
-	g_jointTransRestInv.resize(g_numJoints, ident);
+	// the rest pose comes with the rig
+	g_jointTrans = g_rig.restGlobal;
+	g_jointTransRestInv = g_rig.restInv;
 
 	// set rest-pose rotation matrices
 	setJointRotations(0.0f);
 	g_jointRotRest = g_jointRot;
+	buildDefaultClip(33);
+	buildBlendGraph();
+
+	// weights.dmat, or for meshes shipped without one (the ogre) heat
+	// diffusion weights, cached in heatweights.bdmat until the mesh or the
+	// skeleton change. Both have a column per .bf joint ID; the heat weights
+	// are solved in rig order.
+	std::cout << "Loading weights" << std::endl;
+	const std::string weightsPath = "data/" + p_inputData + "/weights.dmat";
+	const std::string cachePath = heatWeightsPath(g_dataPath);
+	const int64_t sourceTime = std::max(fileModifiedTime("data/" + p_inputData + "/mesh.obj"), fileModifiedTime("data/" + p_inputData + "/skeleton.bf"));
+	bool hasWeights = false;
+	if (fileModifiedTime(weightsPath))
+	{
+		hasWeights = loadSkinWeights(weightsPath, g_maxInfluences, 0.01f, g_weights);
+		if (hasWeights) g_weights.remapJoints(g_rig.compiledJoint);
+	}
+	else if (fileModifiedTime(cachePath) >= sourceTime)
+	{
+		DMat cache;
+		hasWeights = cache.loadBinary(cachePath) && cache.cols == g_numJoints && cache.rows == g_vertices.size();
+		if (hasWeights)
+		{
+			buildSkinWeights(cache.data(), cache.cols, cache.rows, g_maxInfluences, 0.01f, g_weights);
+			g_weights.remapJoints(g_rig.compiledJoint);
+		}
+	}
+	if (!hasWeights)
+		hasWeights = solveAutomaticWeights(cachePath);
+	if (!hasWeights)
+	{
+		std::cout << "No weights for " << p_inputData << ", binding vertices to the nearest bones" << std::endl;
+		computeProximityWeights(g_vertices, restPoseBones(), g_maxInfluences, 0.01f, g_weights);
+	}
+	g_skinRest.build(g_vertices, g_normals, g_weights);
+	g_skinDirty.build(g_skinRest, g_numJoints, SKIN_TARGET_ARRAY + 1);
+	buildCorrectiveShapes();
+	g_heatmapJoint = -1;
+	buildWeightColors();
+	g_jointChanged.assign(g_numJoints, 1);
 }
 
 // ----------------------------------------------------------------------------
@@ -470,18 +854,40 @@ Vector4f toHomog(const Vector3f& homog)
 
 // ----------------------------------------------------------------------------
 
+// p_changed, if given, is set per joint to whether its global transform
+// differs from what p_global held before
 void computeJointTransformations(
 	const std::vector<Matrix4f>& p_local, 
 	const std::vector<Matrix4f>& p_offset, 
 	const std::vector<int>& p_jointParent, 
 	const unsigned int p_numJoints, 
-	std::vector<Matrix4f>& p_global)
+	std::vector<Matrix4f>& p_global,
+	std::vector<uint8_t>* p_changed = nullptr)
 {
 	// TASK 1 comes here
-	//input the root into the global rig
-	p_global[0] = p_offset[0] * p_local[0];
-	for (int j = 1; j < p_numJoints; j++) {
-		p_global[j] = p_global[p_jointParent[j]] * p_offset[j] * p_local[j];
+	//roots (any joint without a parent, the rig may have several) start the chain
+	for (unsigned int j = 0; j < p_numJoints; j++) {
+		const Matrix4f global = p_jointParent[j] < 0 ? Matrix4f(p_offset[j] * p_local[j]) : Matrix4f(p_global[p_jointParent[j]] * p_offset[j] * p_local[j]);
+		if (p_changed) (*p_changed)[j] = global != p_global[j];
+		p_global[j] = global;
+	}
+}
+
+// same result as computeJointTransformations(), level by level through
+// g_skeleton, so parents may come after their children in the file
+void computeJointTransformationsSorted(
+	const std::vector<Matrix4f>& p_local,
+	std::vector<Matrix4f>& p_global,
+	std::vector<uint8_t>* p_changed)
+{
+	for (unsigned int j = 0; j < g_numJoints; j++) {
+		g_skeleton.setAffine(g_localPose.data(), g_skeleton.sortedIndex[j], p_local[j]);
+	}
+	g_skeleton.computeGlobals(g_localPose.data(), g_globalPose.data());
+	for (unsigned int j = 0; j < g_numJoints; j++) {
+		const Matrix4f global = g_skeleton.affine(g_globalPose.data(), g_skeleton.sortedIndex[j]);
+		if (p_changed) (*p_changed)[j] = global != p_global[j];
+		p_global[j] = global;
 	}
 }
 
@@ -490,50 +896,808 @@ void skinning(
 		const unsigned int p_numJoints,
 		const std::vector<Matrix4f>& p_jointTrans,
 		const std::vector<Matrix4f>& p_jointTransRestInv,
-		const std::vector<std::vector<float>>& p_weights,
+		const SkinWeights& p_weights,
 		std::vector<Vector3f>& p_deformedVertices)
 {
-	// The following code simply copies rest pose vertex positions
-	// You will need to replace this by your solution of TASK 2
+	// TASK 2: linear blend skinning
+	// skinning matrix of every joint, computed once per call
+	std::vector<Matrix4f> skin(p_numJoints);
+	for (unsigned int j = 0; j < p_numJoints; j++) {
+		skin[j] = p_jointTrans[j] * p_jointTransRestInv[j];
+	}
+	//blend the influences of each vertex, read from its packed slot
 	for (unsigned int v = 0; v < p_vertices.size(); v++)
 	{
-		p_deformedVertices[v] = p_vertices[v];
+		const Vector4f rest = toHomog(p_vertices[v]);
+		const SkinInfluence* influences = p_weights.vertexInfluences(v);
+		Vector4f deformed = Vector4f::Zero();
+		for (unsigned int k = 0; k < p_weights.counts[v]; k++) {
+			deformed += influences[k].weight() * (skin[influences[k].joint] * rest);
+		}
+		p_deformedVertices[v] = fromHomog(deformed);
 	}
 }
 
-void initRestPose()
+// the SIMD kernel; skinning() above is the scalar reference
+void skinMesh(JobSystem& p_jobs, const SkinTarget& p_target)
 {
-	computeJointTransformations(g_jointRotRest, g_jointOffset, g_jointParent, g_numJoints, g_jointTrans);
-	for (unsigned int jointID = 0; jointID < g_numJoints; ++jointID)
+	g_skinPalette.build(g_jointTrans, g_jointTransRestInv);
+	if (g_skinningMode == SkinningMode::DualQuaternion)
 	{
-		g_jointTransRestInv[jointID] = g_jointTrans[jointID].inverse();
+		computeDualQuats(g_skinPalette, g_dualQuats);
+		skinVerticesDualQuat(p_jobs, g_skinRest, g_dualQuats.data(), p_target);
+	}
+	else
+	{
+		skinVertices(p_jobs, g_skinRest, g_skinPalette, p_target);
+	}
+}
+
+void skinMesh(JobSystem& p_jobs, std::vector<Vector3f>& p_deformedVertices, std::vector<Vector3f>* p_deformedNormals)
+{
+	const SkinTarget target = { p_deformedVertices[0].data(), p_deformedNormals ? (*p_deformedNormals)[0].data() : nullptr, 3 };
+	skinMesh(p_jobs, target);
+}
+
+// only the blocks of p_target that g_skinDirty says are out of date
+void skinMeshIncremental(JobSystem& p_jobs, unsigned int p_targetID, const SkinTarget& p_target)
+{
+	const std::vector<BlockRange>& ranges = g_skinDirty.pending(p_targetID, 128);
+	if (ranges.empty()) return;
+	const bool dualQuat = g_skinningMode == SkinningMode::DualQuaternion;
+	{
+		ProfileScope scope(ProfileStage::Palette);
+		g_skinPalette.build(g_jointTrans, g_jointTransRestInv);
+		if (dualQuat) computeDualQuats(g_skinPalette, g_dualQuats);
+	}
+	ProfileScope scope(ProfileStage::Skinning);
+	p_jobs.parallelFor(ranges.size(), 1, [&](size_t r0, size_t r1)
+	{
+		for (size_t r = r0; r < r1; r++)
+		{
+			if (dualQuat) skinBlocksDualQuat(g_skinRest, g_dualQuats.data(), ranges[r].begin, ranges[r].end, p_target);
+			else skinBlocks(g_skinRest, g_skinPalette.data.data(), ranges[r].begin, ranges[r].end, p_target);
+		}
+	});
+}
+
+// g_deformedVertices and, unless they stay at rest, g_deformedNormals
+void updateDeformedArrays(JobSystem& p_jobs)
+{
+	const bool skinNormals = g_normalMode == NormalMode::Skinned;
+	const SkinTarget target = { g_deformedVertices[0].data(), skinNormals ? g_deformedNormals[0].data() : nullptr, 3 };
+	skinMeshIncremental(p_jobs, SKIN_TARGET_ARRAY, target);
+	if (g_normalMode == NormalMode::Recomputed && g_skinDirty.pendingBlocks() > 0)
+	{
+		ProfileScope scope(ProfileStage::Normals);
+		g_normalRecompute.update(p_jobs, g_triangles[0].indices, g_deformedVertices[0].data(), g_deformedNormals[0].data(), 3);
 	}
 }
 
 void animate()
 {
-	const float t = std::fabsf(sinf(getTime()));
-	switch (g_enableAnimate)
 	{
-		case 0: setJointRotations(t); break;
-		case 1: setJointRotations(0.0f); break;
-		case 2: setJointRotations(1.0f); break;
-	}	
+		ProfileScope scope(ProfileStage::Pose);
+		switch (g_enableAnimate)
+		{
+			case 0:
+				g_clipCursor.sample(g_clip, getTime(), true, g_clipRotations);
+				setJointRotations(g_clipRotations.data());
+				break;
+			case 1: setJointRotations(0.0f); break;
+			case 2: setJointRotations(1.0f); break;
+			case 3: setJointRotations(g_blendState.evaluate(g_blendGraph, getTime())); break;
+		}
+	}
+	{
+		ProfileScope scope(ProfileStage::Kinematics);
+		computeJointTransformationsSorted(g_jointRot, g_jointTrans, &g_jointChanged);
+		g_skinDirty.markChanged(g_jointChanged.data());
+	}
+	{
+		// the blocks of the vertices the shapes moved need skinning again
+		ProfileScope scope(ProfileStage::Correctives);
+		g_correctives.drive(g_jointRot, useCorrectives() ? 1.0f : 0.0f);
+		g_correctives.apply(g_skinRest, [](const uint32_t* p_vertices, size_t p_count) { g_skinDirty.markVertices(p_vertices, p_count); });
+	}
+	if (!g_enableVertexBuffer)
+	{
+		updateDeformedArrays(jobSystem());
+		return;
+	}
+
+	// the frame on screen is still right while nothing moved
+	const unsigned int previous = g_meshBuffer.frameIndex();
+	if (g_skinDirty.isCurrent(previous)) return;
+	float* frame = g_meshBuffer.beginFrame();
+	const unsigned int current = g_meshBuffer.frameIndex();
+	// the other half holds an older frame, an orphaned buffer nothing
+	if (!g_meshBuffer.isPersistent() || !frame) g_skinDirty.invalidate(current);
+	if (frame && g_normalMode == NormalMode::Recomputed)
+	{
+		// the normal pass reads positions back, which a write-only mapping
+		// can't do fast; it runs on the arrays, and the frame is a copy
+		updateDeformedArrays(jobSystem());
+		for (size_t v = 0; v < g_deformedVertices.size(); ++v)
+		{
+			float* dst = frame + v * SkinnedMeshBuffer::FRAME_STRIDE;
+			dst[0] = g_deformedVertices[v](0); dst[1] = g_deformedVertices[v](1); dst[2] = g_deformedVertices[v](2);
+			dst[3] = g_deformedNormals[v](0); dst[4] = g_deformedNormals[v](1); dst[5] = g_deformedNormals[v](2);
+		}
+		g_skinDirty.markCurrent(current);
+	}
+	else if (frame)
+	{
+		// straight into the GL buffer
+		const SkinTarget target = { frame, g_normalMode == NormalMode::Skinned ? frame + 3 : nullptr, SkinnedMeshBuffer::FRAME_STRIDE };
+		skinMeshIncremental(jobSystem(), current, target);
+	}
+	g_meshBuffer.endFrame();
+}
+
+// LOD 0 is the loaded mesh, then 1/2, 1/4, 1/8 and 1/16 of its triangles;
+// the chain is cached in mesh.lods until the mesh or its weights change
+void buildCrowdLods()
+{
+	const std::vector<float> ratios = { 0.5f, 0.25f, 0.125f, 0.0625f };
+	const std::string cachePath = g_dataPath + "mesh.lods";
+	const std::string weightsPath = g_dataPath + "weights.dmat";
+	// the weights come from weights.dmat or, without it, the heat weights
+	// cached in heatweights.bdmat
+	const int64_t weightsTime = fileModifiedTime(weightsPath) ? fileModifiedTime(weightsPath) : fileModifiedTime(heatWeightsPath(g_dataPath));
+	const int64_t sourceTime = std::max(std::max(fileModifiedTime(g_dataPath + "mesh.obj"), fileModifiedTime(g_dataPath + "skeleton.bf")), weightsTime);
+	std::vector<MeshLod> lods;
+	if (fileModifiedTime(cachePath) < sourceTime || !loadMeshLods(cachePath, (unsigned int)g_vertices.size(), lods) || lods.size() != ratios.size() + 1)
+	{
+		std::cout << "Simplifying the mesh into " << ratios.size() << " LODs" << std::endl;
+		simplifyMeshLods(g_vertices, g_triangles, g_weights, ratios, lods);
+		if (!saveMeshLods(cachePath, (unsigned int)g_vertices.size(), lods))
+			std::cerr << "Could not write " << cachePath << std::endl;
+	}
+	g_crowdLods.resize(lods.size());
+	for (size_t k = 0; k < lods.size(); ++k) g_crowdLods[k].build(lods[k], g_vertices, g_normals, g_weights);
+}
+
+// p_count instances of the loaded mesh on a grid, in the rest pose
+void initCrowd(unsigned int p_count)
+{
+	Vector3f lo = g_vertices[0], hi = g_vertices[0];
+	for (const Vector3f& v : g_vertices)
+	{
+		lo = lo.cwiseMin(v);
+		hi = hi.cwiseMax(v);
+	}
+	const float spacing = 1.5f * std::max(hi(0) - lo(0), hi(2) - lo(2));
+	buildCrowdLods();
+	g_crowd.build(g_skeleton, g_crowdLods[0].rest, g_jointTransRestInv, p_count, spacing, g_clip.duration);
+	std::vector<const SkinningRest*> rests;
+	std::vector<float> errors;
+	for (size_t k = 1; k < g_crowdLods.size(); ++k)
+	{
+		rests.push_back(&g_crowdLods[k].rest);
+		errors.push_back(g_crowdLods[k].mesh.error);
+	}
+	g_crowd.setLods(rests, errors);
+	g_crowdScale = 1.0f / std::ceil(std::sqrt((float)p_count));
+}
+
+// what one bake job needs for a frame of its own: the correctives move the
+// rest positions, so a job that applies them skins from its own copy
+struct BakeWorker
+{
+	ClipCursor cursor;
+	std::vector<Quaternionf> rotations;
+	std::vector<Matrix4f> local, global;
+	AlignedFloats localPose, globalPose;
+	SkinPalette palette;
+	AlignedFloats dualQuats;
+	CorrectiveShapes correctives;
+	SkinningRest rest;
+
+	// deformed positions of clip time p_time, xyz per vertex
+	void skinFrame(float p_time, bool p_correctives, float* p_positions)
+	{
+		if (local.empty())
+		{
+			local.assign(g_numJoints, Matrix4f::Identity());
+			global.assign(g_numJoints, Matrix4f::Identity());
+			localPose.assign(g_skeleton.poseFloats(), 0.0f);
+			globalPose.assign(g_skeleton.poseFloats(), 0.0f);
+			if (p_correctives)
+			{
+				correctives = g_correctives;
+				rest = g_skinRest;
+			}
+		}
+		cursor.sample(g_clip, p_time, true, rotations);
+		for (unsigned int j = 0; j < g_numJoints; j++)
+		{
+			local[j].block<3, 3>(0, 0) = rotations[j].toRotationMatrix();
+			g_skeleton.setAffine(localPose.data(), g_skeleton.sortedIndex[j], local[j]);
+		}
+		g_skeleton.computeGlobals(localPose.data(), globalPose.data());
+		for (unsigned int j = 0; j < g_numJoints; j++) global[j] = g_skeleton.affine(globalPose.data(), g_skeleton.sortedIndex[j]);
+		palette.build(global, g_jointTransRestInv);
+
+		if (p_correctives)
+		{
+			correctives.drive(local, 1.0f);
+			correctives.apply(rest, [](const uint32_t*, size_t) {});
+		}
+		const SkinningRest& skinRest = p_correctives ? rest : g_skinRest;
+		const SkinTarget target = { p_positions, nullptr, 3 };
+		if (g_skinningMode == SkinningMode::DualQuaternion)
+		{
+			computeDualQuats(palette, dualQuats);
+			skinBlocksDualQuat(skinRest, dualQuats.data(), 0, skinRest.numBlocks, target);
+		}
+		else
+		{
+			skinBlocks(skinRest, palette.data.data(), 0, skinRest.numBlocks, target);
+		}
+	}
+};
+
+// Frames 0 to p_frames - 1 of g_clip at p_fps, skinned without a window and
+// written to p_path as a point cache. Frames don't depend on each other, so
+// each job skins whole frames; a batch of them is skinned in parallel, then
+// written in order while memory stays at one batch.
+bool bakeAnimation(const std::string& p_path, unsigned int p_frames, float p_fps)
+{
+	JobSystem& jobs = jobSystem();
+	const unsigned int numVertices = g_skinRest.numVertices;
+	const size_t frameFloats = size_t(numVertices) * 3;
+	const bool correctives = useCorrectives() && !g_correctives.shapes.empty();
+
+	PointCacheWriter cache;
+	if (!cache.open(p_path, numVertices, 0.0f, 1.0f))
+	{
+		std::cerr << "Could not write " << p_path << std::endl;
+		return false;
+	}
+
+	// a worker per thread, handed to the jobs as they start
+	std::vector<BakeWorker> workers(jobs.threadCount());
+	std::vector<BakeWorker*> idle;
+	for (BakeWorker& w : workers) idle.push_back(&w);
+	std::mutex idleMutex;
+
+	const unsigned int batchFrames = std::min(p_frames, 8 * jobs.threadCount());
+	AlignedFloats batch(batchFrames * frameFloats);
+	const auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned int f0 = 0; f0 < p_frames; f0 += batchFrames)
+	{
+		const unsigned int count = std::min(batchFrames, p_frames - f0);
+		jobs.parallelFor(count, 1, [&](size_t i0, size_t i1)
+		{
+			BakeWorker* worker;
+			{
+				std::lock_guard<std::mutex> lock(idleMutex);
+				worker = idle.back();
+				idle.pop_back();
+			}
+			for (size_t i = i0; i < i1; ++i) worker->skinFrame((f0 + i) / p_fps, correctives, &batch[i * frameFloats]);
+			std::lock_guard<std::mutex> lock(idleMutex);
+			idle.push_back(worker);
+		});
+		if (!cache.write(batch.data(), count)) break;
+	}
+	const unsigned int written = cache.samples();
+	if (!cache.close() || written != p_frames)
+	{
+		std::cerr << "Could not write " << p_path << std::endl;
+		std::remove(p_path.c_str());
+		return false;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	const double megabytes = (sizeof(PointCacheHeader) + p_frames * frameFloats * sizeof(float)) / (1024.0 * 1024.0);
+	std::cout << "Baked " << p_frames << " frames of " << numVertices << " vertices at " << p_fps << " fps to " << p_path
+		<< " (" << megabytes << " MB) in " << seconds << " s, " << p_frames / seconds << " frames/s on " << jobs.threadCount() << " threads" << std::endl;
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+
+// runs p_body p_frames times and returns vertices per millisecond
+template <typename Body>
+double measureThroughput(size_t p_numVertices, int p_frames, Body p_body)
+{
+	p_body(); // warm up
+	const auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < p_frames; i++) p_body();
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	return double(p_numVertices) * p_frames / ms;
+}
+
+void benchmarkCurrentMesh(const char* p_name, int p_frames)
+{
+	JobSystem single(1);
+	std::vector<Vector3f> normals(g_vertices.size());
+	const size_t n = g_vertices.size();
+
+	std::cout << p_name << " (" << n << " vertices, " << g_numJoints << " joints, " << g_weights.maxInfluences << " influences):" << std::endl;
+	std::cout << "  scalar reference (LBS)     " << measureThroughput(n, p_frames, [&] {
+		skinning(g_vertices, g_numJoints, g_jointTrans, g_jointTransRestInv, g_weights, g_deformedVertices);
+	}) << " vertices/ms" << std::endl;
+	const SkinningMode modes[2] = { SkinningMode::Linear, SkinningMode::DualQuaternion };
+	for (int m = 0; m < 2; m++)
+	{
+		g_skinningMode = modes[m];
+		std::cout << "  " << skinningModeName(g_skinningMode) << ":" << std::endl;
+		std::cout << "    1 thread                 " << measureThroughput(n, p_frames, [&] {
+			skinMesh(single, g_deformedVertices, nullptr);
+		}) << " vertices/ms" << std::endl;
+		std::cout << "    1 thread, normals        " << measureThroughput(n, p_frames, [&] {
+			skinMesh(single, g_deformedVertices, &normals);
+		}) << " vertices/ms" << std::endl;
+		std::cout << "    " << jobSystem().threadCount() << " thread(s)             " << measureThroughput(n, p_frames, [&] {
+			skinMesh(jobSystem(), g_deformedVertices, nullptr);
+		}) << " vertices/ms" << std::endl;
+		std::cout << "    " << jobSystem().threadCount() << " thread(s), normals    " << measureThroughput(n, p_frames, [&] {
+			skinMesh(jobSystem(), g_deformedVertices, &normals);
+		}) << " vertices/ms" << std::endl;
+	}
+	g_skinningMode = SkinningMode::Linear;
+}
+
+// forward kinematics of p_characters random poses of one skeleton
+void benchmarkKinematics(const std::string& p_skeleton, unsigned p_characters, int p_frames)
+{
+	g_jointParent.clear();
+	g_jointOffset.clear();
+	loadSkeleton(p_skeleton);
+	if (!g_skeleton.build(g_jointParent, g_jointOffset)) return;
+	g_localPose.assign(g_skeleton.poseFloats(), 0.0f);
+	g_globalPose.assign(g_skeleton.poseFloats(), 0.0f);
+
+	// random rotations, kept both as matrices and as sorted poses
+	std::vector<std::vector<Matrix4f> > local(p_characters, std::vector<Matrix4f>(g_numJoints));
+	AlignedFloats locals(g_skeleton.batchFloats(p_characters), 0.0f);
+	AlignedFloats globals(locals.size(), 0.0f);
+	srand(1);
+	for (unsigned c = 0; c < p_characters; c++)
+	{
+		for (unsigned int j = 0; j < g_numJoints; j++)
+		{
+			Quaternionf q(Vector4f::Random());
+			q.normalize();
+			local[c][j].setIdentity();
+			local[c][j].block<3, 3>(0, 0) = q.toRotationMatrix();
+			g_skeleton.setBatchAffine(locals.data(), c, g_skeleton.sortedIndex[j], local[c][j]);
+		}
+	}
+
+	std::cout << "forward kinematics (" << p_characters << " characters, " << g_numJoints << " joints, "
+		<< g_skeleton.numLevels() << " levels):" << std::endl;
+	std::vector<Matrix4f> global(g_numJoints);
+	JobSystem single(1);
+	std::cout << "  serial, Matrix4f           " << measureThroughput(p_characters, p_frames, [&] {
+		for (unsigned c = 0; c < p_characters; c++) computeJointTransformations(local[c], g_jointOffset, g_jointParent, g_numJoints, global);
+	}) << " characters/ms" << std::endl;
+	std::cout << "  sorted, one at a time     " << measureThroughput(p_characters, p_frames, [&] {
+		for (unsigned c = 0; c < p_characters; c++) computeJointTransformationsSorted(local[c], global);
+	}) << " characters/ms" << std::endl;
+	std::cout << "  batch, 1 thread            " << measureThroughput(p_characters, p_frames, [&] {
+		g_skeleton.computeGlobalsBatch(single, locals.data(), globals.data(), p_characters);
+	}) << " characters/ms" << std::endl;
+	std::cout << "  batch, " << jobSystem().threadCount() << " thread(s)         " << measureThroughput(p_characters, p_frames, [&] {
+		g_skeleton.computeGlobalsBatch(jobSystem(), locals.data(), globals.data(), p_characters);
+	}) << " characters/ms" << std::endl;
+
+	// both paths must agree
+	float error = 0.0f;
+	computeJointTransformations(local.back(), g_jointOffset, g_jointParent, g_numJoints, global);
+	for (unsigned int j = 0; j < g_numJoints; j++)
+	{
+		const Matrix4f m = g_skeleton.batchAffine(globals.data(), p_characters - 1, g_skeleton.sortedIndex[j]);
+		error = std::max(error, (m - global[j]).cwiseAbs().maxCoeff());
+	}
+	std::cout << "  max difference             " << error << std::endl;
+}
+
+// a long random clip: memory against float keys, and sampling cost for
+// playback (cached segments) and for random times (binary searches)
+void benchmarkClips(unsigned int p_tracks, unsigned int p_keys, int p_frames)
+{
+	AnimationClip clip;
+	clip.clear(p_keys / 30.0f);
+	std::vector<float> times(p_keys);
+	std::vector<Quaternionf> rotations(p_keys);
+	float error = 0.0f;
+	srand(2);
+	for (unsigned int j = 0; j < p_tracks; j++)
+	{
+		Quaternionf q = Quaternionf::Identity();
+		for (unsigned int k = 0; k < p_keys; k++)
+		{
+			times[k] = k / 30.0f;
+			q = (q * Quaternionf(AngleAxisf(0.1f, Vector3f::Random().normalized()))).normalized();
+			rotations[k] = q;
+			error = std::max(error, unpackQuat(packQuat(q)).angularDistance(q));
+		}
+		clip.addTrack(times, rotations);
+	}
+	const size_t floatBytes = size_t(p_tracks) * p_keys * (sizeof(float) + sizeof(Quaternionf));
+
+	std::cout << "clip (" << p_tracks << " tracks, " << p_keys << " keys each, " << (clip.memoryBytes() >> 10) << " KB, "
+		<< (floatBytes >> 10) << " KB as floats, max quantization error " << error << " rad):" << std::endl;
+	ClipCursor cursor;
+	std::vector<Quaternionf> pose;
+	float time = 0.0f;
+	std::cout << "  playback at 60 Hz          " << measureThroughput(p_tracks, p_frames, [&] {
+		cursor.sample(clip, time += 1.0f / 60.0f, true, pose);
+	}) << " joints/ms" << std::endl;
+	std::cout << "  random times               " << measureThroughput(p_tracks, p_frames, [&] {
+		cursor.sample(clip, clip.duration * rand() / RAND_MAX, true, pose);
+	}) << " joints/ms" << std::endl;
+}
+
+// p_characters each evaluating a graph of p_layers random clips over
+// p_joints joints: every layer after the first is mixed in by a masked
+// lerp, a slerp or an additive node in turn
+void benchmarkBlendGraph(unsigned int p_layers, unsigned int p_joints, unsigned int p_characters, int p_frames)
+{
+	const unsigned int keys = 31;
+	std::vector<AnimationClip> clips(p_layers);
+	std::vector<float> times(keys);
+	std::vector<Quaternionf> rotations(keys);
+	srand(3);
+	for (AnimationClip& clip : clips)
+	{
+		clip.clear(1.0f);
+		for (unsigned int j = 0; j < p_joints; j++)
+		{
+			Quaternionf q = Quaternionf::Identity();
+			for (unsigned int k = 0; k < keys; k++)
+			{
+				times[k] = k / 30.0f;
+				q = (q * Quaternionf(AngleAxisf(0.1f, Vector3f::Random().normalized()))).normalized();
+				rotations[k] = q;
+			}
+			clip.addTrack(times, rotations);
+		}
+	}
+	std::vector<float> upper(p_joints);
+	for (unsigned int j = 0; j < p_joints; j++) upper[j] = j >= p_joints / 2 ? 1.0f : 0.0f;
+
+	BlendGraph graph;
+	graph.reset(p_joints);
+	const int mask = graph.addMask(upper);
+	unsigned node = graph.addClip(clips[0]);
+	for (unsigned int i = 1; i < p_layers; i++)
+	{
+		const unsigned layer = graph.addClip(clips[i], 1.0f + 0.1f * i);
+		switch (i % 3)
+		{
+			case 0: node = graph.addAdditive(node, layer, 0.3f); break;
+			case 1: node = graph.addBlend(node, layer, 0.5f, false, mask); break;
+			case 2: node = graph.addBlend(node, layer, 0.5f, true); break;
+		}
+	}
+	if (!graph.compile(node)) return;
+
+	std::vector<BlendState> states(p_characters);
+	for (BlendState& state : states) state.init(graph);
+	std::vector<const Quaternionf*> poses(p_characters);
+	float time = 0.0f;
+	auto frame = [&](JobSystem& p_jobs) {
+		time += 1.0f / 60.0f;
+		p_jobs.parallelFor(p_characters, 16, [&](size_t c0, size_t c1)
+		{
+			for (size_t c = c0; c < c1; c++) poses[c] = states[c].evaluate(graph, time + 0.01f * c);
+		});
+	};
+
+	std::cout << "blend graph (" << p_layers << " layers, " << p_joints << " joints, " << p_characters << " characters, stack depth "
+		<< graph.stackDepth << "):" << std::endl;
+	JobSystem single(1);
+	const double serial = measureThroughput(p_characters, p_frames, [&] { frame(single); });
+	std::cout << "  1 thread                   " << serial << " characters/ms, " << p_characters / serial << " ms/frame" << std::endl;
+	const double parallel = measureThroughput(p_characters, p_frames, [&] { frame(jobSystem()); });
+	std::cout << "  " << jobSystem().threadCount() << " thread(s)                " << parallel << " characters/ms, " << p_characters / parallel << " ms/frame" << std::endl;
+}
+
+// parsing the OBJ against loading its .meshbin cache
+void benchmarkMeshLoading(const std::string& p_objPath, int p_repeats)
+{
+	std::vector<Vector3f> vertices, normals;
+	std::vector<Triangle> triangles;
+	const std::string cachePath = meshBinPath(p_objPath);
+	std::cout << p_objPath << ":" << std::endl;
+	std::cout << "  OBJ, single pass           " << 1.0 / measureThroughput(1, p_repeats, [&] {
+		loadObjFile(p_objPath, vertices, normals, triangles);
+	}) << " ms" << std::endl;
+	saveMeshBin(cachePath, vertices, normals, triangles);
+	std::cout << "  .meshbin                   " << 1.0 / measureThroughput(1, p_repeats, [&] {
+		loadMeshBin(cachePath, vertices, normals, triangles);
+	}) << " ms" << std::endl;
+}
+
+// parsing a text dmat against mapping its binary sidecar
+void benchmarkMatrixLoading(const std::string& p_path, int p_repeats)
+{
+	DMat m;
+	std::cout << p_path << ":" << std::endl;
+	std::cout << "  text                       " << 1.0 / measureThroughput(1, p_repeats, [&] {
+		m.loadText(p_path);
+	}) << " ms" << std::endl;
+	const std::string binaryPath = DMat::sidecarPath(p_path);
+	convertDMat(p_path, binaryPath);
+	std::cout << "  binary, mapped             " << 1.0 / measureThroughput(1, p_repeats, [&] {
+		m.loadBinary(binaryPath);
+	}) << " ms" << std::endl;
+}
+
+// a frame of the loaded mesh skinned as a whole, incrementally while one
+// joint turns (the one influencing the fewest blocks, then one of the
+// root's children) and incrementally while nothing moves
+void benchmarkIncremental(const char* p_name, int p_frames)
+{
+	unsigned int fewest = 0, child = 0, fewestBlocks = ~0u;
+	for (unsigned int j = 0; j < g_numJoints; j++)
+	{
+		unsigned int blocks = 0;
+		for (unsigned int r = g_skinDirty.rangeStart[j]; r < g_skinDirty.rangeStart[j + 1]; r++) blocks += g_skinDirty.ranges[r].end - g_skinDirty.ranges[r].begin;
+		if (blocks > 0 && blocks < fewestBlocks)
+		{
+			fewest = j;
+			fewestBlocks = blocks;
+		}
+		if (child == 0 && g_jointParent[j] == 0) child = j;
+	}
+	const SkinTarget target = { g_deformedVertices[0].data(), nullptr, 3 };
+	const std::vector<Matrix4f> rest = g_jointRotRest;
+	float angle = 0.0f;
+	auto frame = [&](int p_joint) {
+		if (p_joint >= 0) g_jointRot[p_joint].block<3, 3>(0, 0) = AngleAxisf(angle += 0.01f, Vector3f::UnitZ()).toRotationMatrix();
+		computeJointTransformationsSorted(g_jointRot, g_jointTrans, &g_jointChanged);
+		g_skinDirty.markChanged(g_jointChanged.data());
+		skinMeshIncremental(jobSystem(), SKIN_TARGET_ARRAY, target);
+	};
+
+	std::cout << p_name << " incremental skinning (" << g_skinRest.numBlocks << " blocks, " << jobSystem().threadCount() << " thread(s)):" << std::endl;
+	g_jointRot = rest;
+	std::cout << "  every vertex               " << 1.0 / measureThroughput(1, p_frames, [&] {
+		computeJointTransformationsSorted(g_jointRot, g_jointTrans);
+		skinMesh(jobSystem(), target);
+	}) << " ms/frame" << std::endl;
+	const int joints[2] = { (int)fewest, (int)child };
+	for (int joint : joints)
+	{
+		g_jointRot = rest;
+		frame(-1);
+		frame(joint);
+		const unsigned int blocks = g_skinDirty.pendingBlocks();
+		const std::string label = "joint " + std::to_string(joint) + " moving";
+		std::cout << "  " << label << std::string(27 - label.size(), ' ') << 1.0 / measureThroughput(1, p_frames, [&] { frame(joint); })
+			<< " ms/frame, " << blocks << " blocks" << std::endl;
+	}
+	std::cout << "  still pose                 " << 1.0 / measureThroughput(1, p_frames, [&] { frame(-1); }) << " ms/frame, "
+		<< g_skinDirty.pendingBlocks() << " blocks" << std::endl;
+	g_jointRot = rest;
+}
+
+// deformed normals of the loaded mesh in the current pose: skinned with the
+// positions against recomputed from the skinned positions, and how far
+// apart (and from the rest normals) they end up
+void benchmarkNormals(const char* p_name, int p_frames)
+{
+	const size_t n = g_vertices.size();
+	std::vector<Vector3f> skinned(n), recomputed(n);
+	const SkinTarget positions = { g_deformedVertices[0].data(), nullptr, 3 };
+	const SkinTarget withNormals = { g_deformedVertices[0].data(), skinned[0].data(), 3 };
+	JobSystem single(1);
+	std::cout << p_name << " deformed normals (" << n << " vertices, " << g_triangles.size() << " triangles):" << std::endl;
+	for (JobSystem* jobs : { &single, &jobSystem() })
+	{
+		const std::string threads = std::to_string(jobs->threadCount()) + " thread(s)";
+		std::cout << "  " << threads << std::string(25 - threads.size(), ' ') << "positions only " << 1.0 / measureThroughput(1, p_frames, [&] {
+			skinMesh(*jobs, positions);
+		}) << " ms, skinned normals " << 1.0 / measureThroughput(1, p_frames, [&] {
+			skinMesh(*jobs, withNormals);
+		}) << " ms, recomputed " << 1.0 / measureThroughput(1, p_frames, [&] {
+			skinMesh(*jobs, positions);
+			g_normalRecompute.update(*jobs, g_triangles[0].indices, g_deformedVertices[0].data(), recomputed[0].data(), 3);
+		}) << " ms" << std::endl;
+	}
+
+	// mean angles, in degrees
+	double skinnedRest = 0.0, skinnedRecomputed = 0.0;
+	for (size_t v = 0; v < n; v++)
+	{
+		skinnedRest += std::acos(std::min(std::max(skinned[v].dot(g_normals[v].normalized()), -1.0f), 1.0f));
+		skinnedRecomputed += std::acos(std::min(std::max(skinned[v].dot(recomputed[v]), -1.0f), 1.0f));
+	}
+	std::cout << "  skinned normals are " << skinnedRecomputed / n * 57.2958 << " degrees from the recomputed ones on average ("
+		<< skinnedRest / n * 57.2958 << " from the rest normals)" << std::endl;
+}
+
+// the corrective shapes of the loaded mesh: applying them at a new weight
+// every frame, and a whole frame of incremental skinning with them
+void benchmarkCorrectives(const char* p_name, int p_frames)
+{
+	const size_t deltas = g_correctives.vertices.size();
+	std::cout << p_name << " corrective shapes (" << g_correctives.shapes.size() << " shapes, " << deltas << " deltas, "
+		<< g_correctives.memoryBytes() / 1024 << " KB, dense: " << g_correctives.shapes.size() * g_vertices.size() * 12 / 1024 << " KB):" << std::endl;
+	float scale = 0.0f;
+	std::cout << "  apply                      " << 1.0 / measureThroughput(1, p_frames, [&] {
+		scale = scale == 1.0f ? 0.5f : 1.0f;
+		for (float& w : g_correctives.weights) w = scale;
+		g_correctives.apply(g_skinRest, [](const uint32_t* p_vertices, size_t p_count) { g_skinDirty.markVertices(p_vertices, p_count); });
+	}) << " ms/frame" << std::endl;
+	const SkinTarget target = { g_deformedVertices[0].data(), nullptr, 3 };
+	std::cout << "  apply and skin             " << 1.0 / measureThroughput(1, p_frames, [&] {
+		scale = scale == 1.0f ? 0.5f : 1.0f;
+		for (float& w : g_correctives.weights) w = scale;
+		g_correctives.apply(g_skinRest, [](const uint32_t* p_vertices, size_t p_count) { g_skinDirty.markVertices(p_vertices, p_count); });
+		skinMeshIncremental(jobSystem(), SKIN_TARGET_ARRAY, target);
+	}) << " ms/frame, " << g_skinDirty.pendingBlocks() << " of " << g_skinRest.numBlocks << " blocks" << std::endl;
+
+	for (float& w : g_correctives.weights) w = 0.0f;
+	g_correctives.apply(g_skinRest, [](const uint32_t* p_vertices, size_t p_count) { g_skinDirty.markVertices(p_vertices, p_count); });
+}
+
+// p_count instances per frame, all at the full mesh and then all at each
+// coarser LOD; a frame at 60 Hz has 16.7 ms
+void benchmarkCrowd(const char* p_name, unsigned int p_count, int p_frames)
+{
+	initCrowd(p_count);
+	std::cout << p_name << " crowd (" << p_count << " instances, " << jobSystem().threadCount() << " thread(s)):" << std::endl;
+	float time = 0.0f;
+	for (unsigned int k = 0; k < g_crowd.numLods(); ++k)
+	{
+		g_crowd.forceLod(k);
+		const double perMs = measureThroughput(p_count, p_frames, [&] {
+			g_crowd.update(jobSystem(), g_skeleton, g_clip, time += 0.016f);
+		});
+		std::cout << "  LOD " << k << " (" << g_crowdLods[k].rest.numVertices << " vertices, " << g_crowdLods[k].mesh.indices.size() / 3
+			<< " triangles): " << p_count / perMs << " ms/frame, " << perMs * 1000.0 / 60.0 << " instances per 60 Hz frame" << std::endl;
+	}
+	g_crowd = Crowd();
+}
+
+// builds the crowd LOD chain of the loaded mesh without the cache
+void benchmarkSimplification(const char* p_name)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshLod> lods;
+	simplifyMeshLods(g_vertices, g_triangles, g_weights, { 0.5f, 0.25f, 0.125f, 0.0625f }, lods);
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << p_name << " simplification (" << g_triangles.size() << " triangles): " << ms << " ms for " << lods.size() - 1 << " LODs" << std::endl;
+	for (size_t k = 1; k < lods.size(); ++k)
+		std::cout << "  LOD " << k << ": " << lods[k].indices.size() / 3 << " triangles, error " << lods[k].error << std::endl;
+}
+
+// headless: skins the capsule, a 1M-vertex mesh made of capsule copies and
+// crowds of capsules and ogres
+void runBenchmark()
+{
+#if defined(__AVX2__)
+	std::cout << "Skinning benchmark (AVX2 kernel)" << std::endl;
+#else
+	std::cout << "Skinning benchmark (SSE kernel)" << std::endl;
+#endif
+	loadData("capsule");
+	setJointRotations(0.7f);
 	computeJointTransformations(g_jointRot, g_jointOffset, g_jointParent, g_numJoints, g_jointTrans);
-	skinning(g_vertices, g_numJoints, g_jointTrans, g_jointTransRestInv, g_weights, g_deformedVertices);
+	benchmarkCurrentMesh("capsule", 200);
+	benchmarkCrowd("capsule", 256, 10);
+
+	// tile the capsule until the mesh has 1M vertices
+	const unsigned numBase = (unsigned)g_vertices.size();
+	const unsigned numBig = 1000000;
+	std::vector<Vector3f> vertices(numBig), normals(numBig);
+	SkinWeights weights;
+	weights.reset(numBig, g_weights.numJoints, g_weights.maxInfluences);
+	for (unsigned v = 0; v < numBig; v++)
+	{
+		const unsigned src = v % numBase;
+		vertices[v] = g_vertices[src] + Vector3f(0.01f * (v / numBase), 0.0f, 0.0f);
+		normals[v] = g_normals[src];
+		std::copy(g_weights.vertexInfluences(src), g_weights.vertexInfluences(src) + g_weights.maxInfluences,
+			weights.influences.begin() + size_t(v) * weights.maxInfluences);
+		weights.counts[v] = g_weights.counts[src];
+	}
+	g_vertices.swap(vertices);
+	g_normals.swap(normals);
+	g_weights = weights;
+	g_deformedVertices.resize(numBig);
+	g_skinRest.build(g_vertices, g_normals, g_weights);
+	benchmarkCurrentMesh("synthetic", 10);
+
+	benchmarkKinematics("data/ogre/skeleton.bf", 1000, 20);
+	benchmarkClips(100, 10000, 10000);
+	benchmarkBlendGraph(10, 100, 1000, 20);
+
+	loadData("ogre");
+	benchmarkIncremental("ogre", 100);
+	benchmarkCorrectives("ogre", 100);
+	setJointRotations(0.7f);
+	computeJointTransformationsSorted(g_jointRot, g_jointTrans);
+	benchmarkNormals("ogre", 50);
+	benchmarkSimplification("ogre");
+	benchmarkCrowd("ogre", 64, 10);
+
+	benchmarkMeshLoading("data/ogre/mesh.obj", 10);
+	benchmarkMatrixLoading("data/capsule/weights.dmat", 10);
 }
 
 int main(int argc, char *argv[]) 
 {
+	if (argc > 1 && std::string(argv[1]) == "--bench")
+	{
+		runBenchmark();
+		return 0;
+	}
+	if (argc > 3 && std::string(argv[1]) == "--convert-dmat")
+	{
+		// --convert-dmat in.dmat out.bdmat
+		if (!convertDMat(argv[2], argv[3]))
+		{
+			std::cerr << "Could not convert " << argv[2] << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --bake N FPS out.pc2 [data]: N frames of the clip at FPS, skinned on
+	// every core without a window, to a point cache
+	if (argc > 4 && std::string(argv[1]) == "--bake")
+	{
+		loadData(argc > 5 ? argv[5] : "capsule");
+		const unsigned int frames = (unsigned int)std::max(1, atoi(argv[2]));
+		const float fps = (float)atof(argv[3]);
+		if (!(fps > 0.0f))
+		{
+			std::cerr << "Frame rate must be positive" << std::endl;
+			return 1;
+		}
+		return bakeAnimation(argv[4], frames, fps) ? 0 : 1;
+	}
+
 	loadData("capsule"); // replace this with the following line to load the Ogre instead
 	//loadData("ogre");
-	
-	initRestPose();
+
+	// --crowd N: N animated copies of the mesh instead of one
+	if (argc > 2 && std::string(argv[1]) == "--crowd")
+	{
+		initCrowd((unsigned int)std::max(1, atoi(argv[2])));
+		std::cout << "Crowd mode: " << g_crowd.count << " instances" << std::endl;
+	}
+
+	// --profile N [M]: N frames without vsync in a hidden window, of M crowd
+	// instances if given, then the stage times to profile.csv
+	if (argc > 2 && std::string(argv[1]) == "--profile")
+	{
+		const unsigned int profileFrames = (unsigned int)std::max(1, atoi(argv[2]));
+		g_headless = 1;
+		g_profileFrames = profileFrames;
+		frameProfiler().reset(profileFrames);
+		if (argc > 3) initCrowd((unsigned int)std::max(1, atoi(argv[3])));
+		initWindow();
+		initGL();
+		renderLoop();
+		printProfile(profileFrames);
+		if (!frameProfiler().writeCsv("profile.csv"))
+		{
+			std::cerr << "Could not write profile.csv" << std::endl;
+			return 1;
+		}
+		std::cout << "Wrote " << frameProfiler().frameCount() << " frames to profile.csv" << std::endl;
+		return 0;
+	}
 
 	std::cout << std::endl << "Controls:" << std::endl
 		<< "Press key A to switch animation control" << std::endl
 		<< "Press key S to show skeleton rig" << std::endl
-		<< "Press key W to show skinning weights" << std::endl;
+		<< "Press key W to show skinning weights, J to show one joint at a time" << std::endl
+		<< "Press key D to switch between linear blend and dual quaternion skinning" << std::endl
+		<< "Press key B to switch corrective shapes on and off (linear blend skinning)" << std::endl
+		<< "Press key N to switch between rest, skinned and recomputed normals" << std::endl
+		<< "Press key L to switch crowd LODs on and off" << std::endl
+		<< "Press key P to show frame times, C to write them to profile.csv" << std::endl
+		<< "Press key V to switch between vertex buffers and immediate mode" << std::endl;
 
 	initWindow();
 	initGL();
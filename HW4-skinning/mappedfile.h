@@ -0,0 +1,135 @@
+#pragma once
+
+// Read-only memory-mapped file.
+//
+// The loaders parse straight out of the mapping instead of streaming through
+// ifstream, so a file is read by page faults and never copied into a buffer
+// first. Windows and POSIX each get their own few lines below.
+
+#include <cstdint>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFile
+{
+public:
+	MappedFile() {}
+	explicit MappedFile(const std::string &p_path) { open(p_path); }
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	// false if the file is missing or can't be mapped; an empty file maps
+	// to data() == nullptr with size() == 0 and counts as open
+	bool open(const std::string &p_path)
+	{
+		close();
+#if defined(_WIN32)
+		file = CreateFileA(p_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER length;
+		if (!GetFileSizeEx(file, &length))
+		{
+			close();
+			return false;
+		}
+		bytes = (size_t)length.QuadPart;
+		if (bytes == 0) return true;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = ::open(p_path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		if (fstat(fd, &info) != 0)
+		{
+			close();
+			return false;
+		}
+		bytes = (size_t)info.st_size;
+		if (bytes == 0) return true;
+		view = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view == MAP_FAILED) view = nullptr;
+		else madvise(view, bytes, MADV_SEQUENTIAL);
+#endif
+		if (!view)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		if (view) UnmapViewOfFile(view);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (view) munmap(view, bytes);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		view = nullptr;
+		bytes = 0;
+	}
+
+	const char *data() const { return (const char *)view; }
+	size_t size() const { return bytes; }
+
+private:
+	void *view = nullptr;
+	size_t bytes = 0;
+#if defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// last write time in unspecified units, comparable between files; 0 if the
+// file doesn't exist
+inline int64_t fileModifiedTime(const std::string &p_path)
+{
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExA(p_path.c_str(), GetFileExInfoStandard, &info)) return 0;
+	return (int64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat info;
+	if (stat(p_path.c_str(), &info) != 0) return 0;
+#if defined(__APPLE__)
+	return int64_t(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+// p_path with its extension replaced by p_extension (".meshbin"), or
+// appended if the file name has none; the caches sit next to their sources
+inline std::string replaceExtension(const std::string &p_path, const std::string &p_extension)
+{
+	const size_t dot = p_path.rfind('.');
+	const size_t slash = p_path.find_last_of("/\\");
+	const bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+	return (hasExtension ? p_path.substr(0, dot) : p_path) + p_extension;
+}
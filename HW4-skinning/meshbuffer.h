@@ -0,0 +1,162 @@
+#pragma once
+
+// Vertex and index buffers for the skinned mesh.
+//
+// Indices, rest normals and the weight colors never change and go to static
+// buffers once. Positions and deformed normals change every frame and go,
+// interleaved, to a dynamic buffer that the skinning kernel writes into
+// directly, so there is no copy between a CPU-side array and GL:
+//
+// - With ARB_buffer_storage and ARB_sync the dynamic buffer holds two
+//   frames and stays mapped (persistent and coherent). A frame is skinned
+//   into one half while the GPU may still be drawing the other; a fence per
+//   half makes the CPU wait before overwriting a frame still in flight.
+// - Otherwise there are two plain buffers, orphaned and mapped once per
+//   frame with glMapBuffer().
+
+#include "GL/glew.h"
+
+class SkinnedMeshBuffer
+{
+public:
+	static const unsigned FRAME_STRIDE = 6;	// floats per vertex in a frame
+
+	// Needs a current context and glewInit(). p_normals and p_colors hold 3
+	// floats per vertex; returns false without vertex buffer objects.
+	bool init(unsigned p_numVertices, const int *p_indices, size_t p_numIndices, const float *p_normals, const float *p_colors)
+	{
+		if (!GLEW_VERSION_1_5) return false;
+		numVertices = p_numVertices;
+		numIndices = p_numIndices;
+		restBytes = size_t(p_numVertices) * 3 * sizeof(float);
+		frameBytes = 2 * restBytes;
+
+		glGenBuffers(1, &indexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, p_numIndices * sizeof(int), p_indices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+		// normals, then colors
+		glGenBuffers(1, &staticBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, staticBuffer);
+		glBufferData(GL_ARRAY_BUFFER, 2 * restBytes, NULL, GL_STATIC_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, restBytes, p_normals);
+		glBufferSubData(GL_ARRAY_BUFFER, restBytes, restBytes, p_colors);
+
+		glGenBuffers(2, dynamicBuffers);
+		persistent = false;
+		if (GLEW_ARB_buffer_storage && GLEW_ARB_sync)
+		{
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBindBuffer(GL_ARRAY_BUFFER, dynamicBuffers[0]);
+			glBufferStorage(GL_ARRAY_BUFFER, 2 * frameBytes, NULL, flags);
+			mapped = (float *)glMapBufferRange(GL_ARRAY_BUFFER, 0, 2 * frameBytes, flags);
+			persistent = mapped != nullptr;
+			if (!persistent)
+			{
+				// immutable storage can't be respecified; start over with fresh names
+				glDeleteBuffers(2, dynamicBuffers);
+				glGenBuffers(2, dynamicBuffers);
+			}
+		}
+		if (!persistent)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, dynamicBuffers[i]);
+				glBufferData(GL_ARRAY_BUFFER, frameBytes, NULL, GL_STREAM_DRAW);
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return true;
+	}
+
+	// replaces the colors given to init(), e.g. for another weight view
+	void setColors(const float *p_colors)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, staticBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER, restBytes, restBytes, p_colors);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	bool ready() const { return indexBuffer != 0; }
+	bool isPersistent() const { return persistent; }
+	unsigned frameIndex() const { return current; }	// 0 or 1: the half written last, and drawn
+
+	// Where to skin the next frame: per vertex 3 floats of position and 3 of
+	// normal (FRAME_STRIDE), or null if the buffer could not be mapped.
+	// Every call must be followed by endFrame().
+	float *beginFrame()
+	{
+		current ^= 1;
+		if (persistent)
+		{
+			if (fences[current])
+			{
+				glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+				glDeleteSync(fences[current]);
+				fences[current] = 0;
+			}
+			return mapped + size_t(current) * numVertices * FRAME_STRIDE;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, dynamicBuffers[current]);
+		glBufferData(GL_ARRAY_BUFFER, frameBytes, NULL, GL_STREAM_DRAW); // orphan
+		float *ptr = (float *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return ptr;
+	}
+
+	void endFrame()
+	{
+		if (persistent) return;
+		glBindBuffer(GL_ARRAY_BUFFER, dynamicBuffers[current]);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	// draws the last finished frame; colors come from the static buffer
+	// when p_colors is set, from glColor otherwise, and normals from the
+	// frame or, without p_deformedNormals, the static rest normals
+	void draw(bool p_colors, bool p_deformedNormals)
+	{
+		const GLsizei stride = FRAME_STRIDE * sizeof(float);
+		const size_t frameOffset = persistent ? current * frameBytes : 0;
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		if (p_colors) glEnableClientState(GL_COLOR_ARRAY);
+
+		glBindBuffer(GL_ARRAY_BUFFER, persistent ? dynamicBuffers[0] : dynamicBuffers[current]);
+		glVertexPointer(3, GL_FLOAT, stride, (const GLvoid *)frameOffset);
+		if (p_deformedNormals) glNormalPointer(GL_FLOAT, stride, (const GLvoid *)(frameOffset + 3 * sizeof(float)));
+		glBindBuffer(GL_ARRAY_BUFFER, staticBuffer);
+		if (!p_deformedNormals) glNormalPointer(GL_FLOAT, 0, (const GLvoid *)0);
+		if (p_colors) glColorPointer(3, GL_FLOAT, 0, (const GLvoid *)restBytes);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glDrawElements(GL_TRIANGLES, (GLsizei)numIndices, GL_UNSIGNED_INT, (const GLvoid *)0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		if (p_colors) glDisableClientState(GL_COLOR_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
+
+		if (persistent)
+		{
+			if (fences[current]) glDeleteSync(fences[current]);	// drawn twice
+			fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+
+private:
+	unsigned numVertices = 0;
+	size_t numIndices = 0;
+	size_t restBytes = 0;			// one float3 per vertex
+	size_t frameBytes = 0;			// positions and normals of one frame
+	GLuint indexBuffer = 0;
+	GLuint staticBuffer = 0;
+	GLuint dynamicBuffers[2] = { 0, 0 };	// persistent: [0] holds both frames
+	bool persistent = false;
+	float *mapped = nullptr;		// persistent mapping of both frames
+	GLsync fences[2] = { 0, 0 };	// draws still reading a frame
+	unsigned current = 1;			// frame being written, then drawn
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+// Mesh loading: a single-pass OBJ parser and a binary cache.
+//
+// The OBJ is mapped (MappedFile) and parsed in one pass with hand-written
+// number parsing; no stream, no locale, no second pass to count elements.
+// Only what the skinning code uses is read: "v" positions, "vn" normals
+// (matched to positions by order, as the data files are written), and the
+// position index of every "f" corner. Polygons are split into fans.
+//
+// The result is written next to the OBJ as a .meshbin file: a header and
+// the arrays exactly as they are held in memory. loadMesh() uses the cache
+// while it is newer than the OBJ, so after the first run loading a mesh is
+// mapping a file and copying three arrays out of it.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <eigen>
+#include "mappedfile.h"
+#include "textparse.h"
+
+// the position index of a face corner ("p", "p/t", "p//n" or "p/t/n"),
+// 0-based; negative OBJ indices count back from p_count
+static inline bool parseCorner(const char *&p, const char *end, size_t p_count, int &p_index)
+{
+	bool negative = false;
+	if (p < end && *p == '-') negative = *p++ == '-';
+	if (p >= end || !isDigit(*p)) return false;
+	long long i = 0;
+	for (; p < end && isDigit(*p); ++p) i = i * 10 + (*p - '0');
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') ++p; // "/t/n"
+	p_index = int(negative ? (long long)p_count - i : i - 1);
+	return true;
+}
+
+// p_triangles holds any type with set(a, b, c) and a default constructor
+template <typename Triangle>
+bool parseObj(const char *p, const char *end, std::vector<Eigen::Vector3f> &p_vertices, std::vector<Eigen::Vector3f> &p_normals, std::vector<Triangle> &p_triangles)
+{
+	p_vertices.clear();
+	p_normals.clear();
+	p_triangles.clear();
+	// roughly 30 bytes per line, half of the lines faces
+	p_vertices.reserve((end - p) / 120);
+	p_normals.reserve((end - p) / 120);
+	p_triangles.reserve((end - p) / 60);
+
+	std::vector<int> corners;
+	while (p < end)
+	{
+		p = skipBlanks(p, end);
+		if (end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			p += 2;
+			const float x = parseFloat(p, end), y = parseFloat(p, end), z = parseFloat(p, end);
+			p_vertices.push_back(Eigen::Vector3f(x, y, z));
+		}
+		else if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+		{
+			p += 3;
+			const float x = parseFloat(p, end), y = parseFloat(p, end), z = parseFloat(p, end);
+			p_normals.push_back(Eigen::Vector3f(x, y, z));
+		}
+		else if (end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			p += 2;
+			corners.clear();
+			int index;
+			for (p = skipBlanks(p, end); p < end && *p != '\r' && *p != '\n' && *p != '#'; p = skipBlanks(p, end))
+			{
+				if (!parseCorner(p, end, p_vertices.size(), index)) return false;
+				corners.push_back(index);
+			}
+			for (size_t k = 2; k < corners.size(); ++k)
+			{
+				p_triangles.push_back(Triangle());
+				p_triangles.back().set(corners[0], corners[k - 1], corners[k]);
+			}
+		}
+		p = skipLine(p, end);
+	}
+
+	for (const Triangle &t : p_triangles)
+	{
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			if (t[i] < 0 || t[i] >= (int)p_vertices.size()) return false;
+		}
+	}
+	p_normals.resize(p_vertices.size(), Eigen::Vector3f::Zero());
+	return true;
+}
+
+template <typename Triangle>
+bool loadObjFile(const std::string &p_path, std::vector<Eigen::Vector3f> &p_vertices, std::vector<Eigen::Vector3f> &p_normals, std::vector<Triangle> &p_triangles)
+{
+	MappedFile file;
+	if (!file.open(p_path)) return false;
+	return parseObj(file.data(), file.data() + file.size(), p_vertices, p_normals, p_triangles);
+}
+
+// .meshbin: header, then positions and normals (3 floats per vertex) and
+// triangles (3 int32 each)
+struct MeshBinHeader
+{
+	char magic[8];			// "MESHBIN" and a terminating 0
+	uint32_t version;
+	uint32_t numVertices;
+	uint32_t numTriangles;
+	uint32_t reserved;
+};
+
+static const uint32_t MESHBIN_VERSION = 1;
+
+template <typename Triangle>
+bool loadMeshBin(const std::string &p_path, std::vector<Eigen::Vector3f> &p_vertices, std::vector<Eigen::Vector3f> &p_normals, std::vector<Triangle> &p_triangles)
+{
+	static_assert(sizeof(Triangle) == 3 * sizeof(int32_t), "triangles are stored as 3 indices");
+	static_assert(sizeof(Eigen::Vector3f) == 3 * sizeof(float), "vertices are stored as 3 floats");
+
+	MappedFile file;
+	if (!file.open(p_path) || file.size() < sizeof(MeshBinHeader)) return false;
+	MeshBinHeader header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	const size_t vertexBytes = size_t(header.numVertices) * sizeof(Eigen::Vector3f);
+	const size_t triangleBytes = size_t(header.numTriangles) * sizeof(Triangle);
+	if (std::memcmp(header.magic, "MESHBIN", 8) != 0 || header.version != MESHBIN_VERSION
+		|| file.size() != sizeof(header) + 2 * vertexBytes + triangleBytes) return false;
+
+	const char *payload = file.data() + sizeof(header);
+	p_vertices.resize(header.numVertices);
+	p_normals.resize(header.numVertices);
+	p_triangles.resize(header.numTriangles);
+	if (vertexBytes)
+	{
+		std::memcpy(p_vertices[0].data(), payload, vertexBytes);
+		std::memcpy(p_normals[0].data(), payload + vertexBytes, vertexBytes);
+	}
+	if (triangleBytes) std::memcpy((void *)p_triangles.data(), payload + 2 * vertexBytes, triangleBytes);
+	return true;
+}
+
+template <typename Triangle>
+bool saveMeshBin(const std::string &p_path, const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Eigen::Vector3f> &p_normals, const std::vector<Triangle> &p_triangles)
+{
+	MeshBinHeader header = {};
+	std::memcpy(header.magic, "MESHBIN", 8);
+	header.version = MESHBIN_VERSION;
+	header.numVertices = (uint32_t)p_vertices.size();
+	header.numTriangles = (uint32_t)p_triangles.size();
+
+	std::ofstream out(p_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write((const char *)&header, sizeof(header));
+	out.write((const char *)p_vertices.data(), p_vertices.size() * sizeof(Eigen::Vector3f));
+	out.write((const char *)p_normals.data(), p_normals.size() * sizeof(Eigen::Vector3f));
+	out.write((const char *)p_triangles.data(), p_triangles.size() * sizeof(Triangle));
+	out.close();
+	if (!out)
+	{
+		std::remove(p_path.c_str()); // a partial cache would be rejected anyway
+		return false;
+	}
+	return true;
+}
+
+// path.obj -> path.meshbin
+inline std::string meshBinPath(const std::string &p_objPath)
+{
+	return replaceExtension(p_objPath, ".meshbin");
+}
+
+// the cache while it is at least as new as the OBJ, otherwise the OBJ (and
+// a fresh cache for next time)
+template <typename Triangle>
+bool loadMesh(const std::string &p_objPath, std::vector<Eigen::Vector3f> &p_vertices, std::vector<Eigen::Vector3f> &p_normals, std::vector<Triangle> &p_triangles)
+{
+	const std::string cachePath = meshBinPath(p_objPath);
+	const int64_t cacheTime = fileModifiedTime(cachePath);
+	if (cacheTime && cacheTime >= fileModifiedTime(p_objPath) && loadMeshBin(cachePath, p_vertices, p_normals, p_triangles))
+	{
+		std::cout << "Mesh vertices: " << p_vertices.size() << " (" << cachePath << ")" << std::endl;
+		return true;
+	}
+	if (!loadObjFile(p_objPath, p_vertices, p_normals, p_triangles)) return false;
+	std::cout << "Mesh vertices: " << p_vertices.size() << std::endl;
+	if (!saveMeshBin(cachePath, p_vertices, p_normals, p_triangles))
+	{
+		std::cerr << "Could not write mesh cache " << cachePath << std::endl;
+	}
+	return true;
+}
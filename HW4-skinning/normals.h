@@ -0,0 +1,87 @@
+#pragma once
+
+// Vertex normals of the deformed mesh, recomputed from its triangles.
+//
+// The other way to get them is to let the skinning kernel transform the
+// rest normals (SkinTarget::normals). Recomputing is exact for the deformed
+// surface, skinning is cheaper and needs no neighbours.
+//
+// Two passes, both split over the job system and free of atomics:
+//
+// 1. every triangle writes its cross product, whose length is twice its
+//    area, into its own slot;
+// 2. every vertex sums the slots of its triangles (area weighting) and
+//    normalizes. The triangles of a vertex come from a CSR adjacency
+//    (faces [offsets[v], offsets[v + 1])) built once, so no two jobs ever
+//    write the same vertex.
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "jobs.h"
+
+class NormalRecompute
+{
+public:
+	std::vector<unsigned> offsets;	// [vertex], into faces
+	std::vector<unsigned> faces;	// triangles around each vertex
+
+	// p_indices: 3 per triangle
+	void build(unsigned p_numVertices, const int *p_indices, size_t p_numTriangles)
+	{
+		offsets.assign(p_numVertices + 1, 0);
+		for (size_t i = 0; i < 3 * p_numTriangles; ++i) offsets[p_indices[i] + 1]++;
+		for (unsigned v = 0; v < p_numVertices; ++v) offsets[v + 1] += offsets[v];
+		faces.resize(offsets[p_numVertices]);
+		std::vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < 3 * p_numTriangles; ++i) faces[fill[p_indices[i]]++] = unsigned(i / 3);
+		faceNormals.resize(3 * p_numTriangles);
+	}
+
+	// p_indices as given to build(); positions and normals are 3 floats
+	// every p_stride floats and may be interleaved in one buffer
+	void update(JobSystem &p_jobs, const int *p_indices, const float *p_positions, float *p_normals, size_t p_stride)
+	{
+		const int *tri = p_indices;
+		p_jobs.parallelFor(faceNormals.size() / 3, 4096, [&](size_t t0, size_t t1)
+		{
+			for (size_t t = t0; t < t1; ++t)
+			{
+				const float *a = p_positions + tri[3 * t] * p_stride;
+				const float *b = p_positions + tri[3 * t + 1] * p_stride;
+				const float *c = p_positions + tri[3 * t + 2] * p_stride;
+				const float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				const float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				float *n = &faceNormals[3 * t];
+				n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+				n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+				n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+			}
+		});
+
+		const unsigned numVertices = (unsigned)offsets.size() - 1;
+		p_jobs.parallelFor(numVertices, 4096, [&](size_t v0, size_t v1)
+		{
+			for (size_t v = v0; v < v1; ++v)
+			{
+				float x = 0.0f, y = 0.0f, z = 0.0f;
+				for (unsigned i = offsets[v]; i < offsets[v + 1]; ++i)
+				{
+					const float *n = &faceNormals[3 * size_t(faces[i])];
+					x += n[0];
+					y += n[1];
+					z += n[2];
+				}
+				const float length = std::sqrt(x * x + y * y + z * z);
+				const float inv = length > 1e-30f ? 1.0f / length : 0.0f;
+				float *dst = p_normals + v * p_stride;
+				dst[0] = x * inv;
+				dst[1] = y * inv;
+				dst[2] = z * inv;
+			}
+		});
+	}
+
+private:
+	std::vector<float> faceNormals;	// [triangle] xyz, twice the area long
+};
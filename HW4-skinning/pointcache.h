@@ -0,0 +1,79 @@
+#pragma once
+
+// Writer for point caches in the PC2 format, which 3ds Max, Maya and
+// Blender read: a 32-byte header, then per sample the xyz of every point as
+// little-endian floats.
+//
+// Frames are appended as they come, so a bake of thousands of frames never
+// holds more than the frames in flight. The header is written with zero
+// samples first and patched by close(), so an interrupted bake leaves a
+// file that reads as empty rather than one that claims frames it lacks.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#pragma pack(push, 1)
+struct PointCacheHeader
+{
+	char magic[12];			// "POINTCACHE2" and a terminating 0
+	int32_t version;		// 1
+	int32_t numPoints;
+	float startFrame;
+	float sampleRate;		// frames between samples
+	int32_t numSamples;
+};
+#pragma pack(pop)
+
+class PointCacheWriter
+{
+public:
+	PointCacheWriter() {}
+	~PointCacheWriter() { close(); }
+	PointCacheWriter(const PointCacheWriter &) = delete;
+	PointCacheWriter &operator=(const PointCacheWriter &) = delete;
+
+	bool open(const std::string &p_path, unsigned p_numPoints, float p_startFrame, float p_sampleRate)
+	{
+		close();
+		file = std::fopen(p_path.c_str(), "wb");
+		if (!file) return false;
+		std::memcpy(header.magic, "POINTCACHE2", 12);
+		header.version = 1;
+		header.numPoints = (int32_t)p_numPoints;
+		header.startFrame = p_startFrame;
+		header.sampleRate = p_sampleRate;
+		header.numSamples = 0;
+		ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+		return ok;
+	}
+
+	// p_count samples of numPoints xyz floats each, one after the other
+	bool write(const float *p_samples, unsigned p_count)
+	{
+		if (!file || !ok) return false;
+		const size_t floats = size_t(p_count) * header.numPoints * 3;
+		ok = std::fwrite(p_samples, sizeof(float), floats, file) == floats;
+		if (ok) header.numSamples += (int32_t)p_count;
+		return ok;
+	}
+
+	unsigned samples() const { return (unsigned)header.numSamples; }
+
+	// patches the sample count; false if anything failed since open()
+	bool close()
+	{
+		if (!file) return false;
+		if (ok && std::fseek(file, 0, SEEK_SET) == 0) ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+		else ok = false;
+		ok = std::fclose(file) == 0 && ok;
+		file = nullptr;
+		return ok;
+	}
+
+private:
+	std::FILE *file = nullptr;
+	PointCacheHeader header = {};
+	bool ok = false;
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+// Frame profiler: CPU time per stage of the animate/render loop.
+//
+// A ProfileScope times the block it lives in and adds the milliseconds to
+// its stage in the current frame of frameProfiler(); a stage entered twice
+// in a frame sums. The loop brackets every frame with beginFrame() and
+// endFrame(), which stores the frame in a ring buffer of the last
+// capacity() frames. Whatever the scopes don't cover (event polling, copies)
+// is the difference between the frame total and the sum of its stages.
+//
+// The times are CPU times on the calling thread: a stage that runs jobs
+// counts until the last job is done, and Draw only measures submission,
+// since the GPU works asynchronously. Time the driver makes the CPU wait,
+// for vsync or a full command queue, shows up in Swap.
+//
+// Scopes are meant for the main thread; the profiler isn't synchronized.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum class ProfileStage
+{
+	Pose,			// clip sampling and blending
+	Kinematics,		// local to global joint transforms
+	Correctives,	// corrective shapes on the rest positions
+	Palette,		// skinning matrices or dual quaternions
+	Skinning,
+	Normals,		// recomputed from the deformed triangles
+	Draw,			// GL submission
+	Swap,			// glfwSwapBuffers, including the vsync wait
+	Count
+};
+
+static const unsigned PROFILE_STAGES = (unsigned)ProfileStage::Count;
+
+inline const char *profileStageName(ProfileStage p_stage)
+{
+	static const char *names[PROFILE_STAGES] = { "pose", "kinematics", "correctives", "palette", "skinning", "normals", "draw", "swap" };
+	return names[(unsigned)p_stage];
+}
+
+struct FrameSample
+{
+	float total;					// ms from beginFrame() to endFrame()
+	float stages[PROFILE_STAGES];	// ms per stage
+
+	float other() const
+	{
+		float sum = 0.0f;
+		for (unsigned s = 0; s < PROFILE_STAGES; ++s) sum += stages[s];
+		return std::max(total - sum, 0.0f);
+	}
+};
+
+class FrameProfiler
+{
+public:
+	typedef std::chrono::high_resolution_clock Clock;
+
+	FrameProfiler() { reset(240); }
+
+	// drops all frames
+	void reset(unsigned p_capacity)
+	{
+		frames.assign(std::max(p_capacity, 1u), FrameSample());
+		head = 0;
+		count = 0;
+		inFrame = false;
+	}
+
+	unsigned capacity() const { return (unsigned)frames.size(); }
+	unsigned frameCount() const { return count; }
+
+	// p_index 0 is the oldest frame kept, frameCount() - 1 the last one
+	const FrameSample &frame(unsigned p_index) const { return frames[(head + capacity() - count + p_index) % capacity()]; }
+
+	void beginFrame()
+	{
+		current = FrameSample();
+		frameStart = Clock::now();
+		inFrame = true;
+	}
+
+	void endFrame()
+	{
+		if (!inFrame) return;
+		current.total = std::chrono::duration<float, std::milli>(Clock::now() - frameStart).count();
+		frames[head] = current;
+		head = (head + 1) % capacity();
+		count = std::min(count + 1, capacity());
+		inFrame = false;
+	}
+
+	void add(ProfileStage p_stage, float p_ms) { current.stages[(unsigned)p_stage] += p_ms; }
+
+	// means over the last p_frames frames (all kept frames if fewer)
+	FrameSample average(unsigned p_frames) const
+	{
+		FrameSample mean = FrameSample();
+		const unsigned n = std::min(p_frames, count);
+		for (unsigned i = count - n; i < count; ++i)
+		{
+			const FrameSample &f = frame(i);
+			mean.total += f.total;
+			for (unsigned s = 0; s < PROFILE_STAGES; ++s) mean.stages[s] += f.stages[s];
+		}
+		if (n == 0) return mean;
+		mean.total /= n;
+		for (unsigned s = 0; s < PROFILE_STAGES; ++s) mean.stages[s] /= n;
+		return mean;
+	}
+
+	// one row per kept frame, oldest first, times in ms
+	bool writeCsv(const std::string &p_path) const
+	{
+		std::ofstream out(p_path.c_str());
+		if (!out) return false;
+		out << "frame,total";
+		for (unsigned s = 0; s < PROFILE_STAGES; ++s) out << "," << profileStageName(ProfileStage(s));
+		out << ",other\n";
+		for (unsigned i = 0; i < count; ++i)
+		{
+			const FrameSample &f = frame(i);
+			out << i << "," << f.total;
+			for (unsigned s = 0; s < PROFILE_STAGES; ++s) out << "," << f.stages[s];
+			out << "," << f.other() << "\n";
+		}
+		return bool(out);
+	}
+
+private:
+	std::vector<FrameSample> frames;	// ring buffer, head is the next slot written
+	unsigned head = 0;
+	unsigned count = 0;
+	FrameSample current = FrameSample();
+	Clock::time_point frameStart;
+	bool inFrame = false;
+};
+
+// the profiler of the animate/render loop
+inline FrameProfiler &frameProfiler()
+{
+	static FrameProfiler profiler;
+	return profiler;
+}
+
+class ProfileScope
+{
+public:
+	explicit ProfileScope(ProfileStage p_stage) : stage(p_stage), start(FrameProfiler::Clock::now()) {}
+	~ProfileScope() { frameProfiler().add(stage, std::chrono::duration<float, std::milli>(FrameProfiler::Clock::now() - start).count()); }
+	ProfileScope(const ProfileScope &) = delete;
+	ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+	ProfileStage stage;
+	FrameProfiler::Clock::time_point start;
+};
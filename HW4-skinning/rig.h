@@ -0,0 +1,299 @@
+#pragma once
+
+// Rig compiler: skeleton.bf checked, ordered and baked into skeleton.rig.
+//
+// A .bf line is "jointID parentID x y z", the parent -1 for a root and
+// (x, y, z) the joint's offset from its parent. Nothing in the format says
+// the lines come in joint ID order, that every ID is there, or that parents
+// come before children, which computeJointTransformations() relies on.
+// compile() checks all of it and reports the first problem: IDs missing,
+// repeated or out of range, parents out of range, cycles.
+//
+// The compiled rig numbers joints so that every parent comes before its
+// children, keeping the file order where it already does (then the
+// numbering is the identity). sourceJoint and compiledJoint translate
+// between the two numberings: weights.dmat and pose.dmat stay indexed by
+// the IDs in the .bf, everything at runtime by compiled index.
+//
+// Joints rest with identity local rotations, so the rest globals are the
+// chained offsets. The rig stores them and their inverses, which skinning
+// needs every frame, and a binary .rig holds the lot for the next start.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <eigen>
+#include "mappedfile.h"
+#include "textparse.h"
+
+// .rig: header, then per compiled joint a RigFileJoint
+struct RigFileHeader
+{
+	char magic[8];			// "SKELRIG" and a terminating 0
+	uint32_t version;
+	uint32_t numJoints;
+	uint32_t reserved[2];
+};
+
+struct RigFileJoint
+{
+	int32_t parent;			// compiled index, -1 for roots
+	uint32_t sourceJoint;	// ID in the .bf
+	float offset[3];
+	float restGlobal[12];	// 3x4 row-major
+	float restInv[12];
+};
+
+static const uint32_t RIG_VERSION = 1;
+
+class Rig
+{
+public:
+	unsigned numJoints = 0;
+	std::vector<int> parent;						// [compiled], -1 for roots, always smaller than the joint
+	std::vector<Eigen::Matrix4f> offset;			// [compiled] translation from the parent
+	std::vector<Eigen::Matrix4f> restGlobal;		// [compiled] global transform at rest
+	std::vector<Eigen::Matrix4f> restInv;			// [compiled] its inverse
+	std::vector<unsigned> sourceJoint;				// [compiled] -> joint ID in the .bf
+	std::vector<unsigned> compiledJoint;			// [joint ID in the .bf] -> compiled
+
+	// p_ids, p_parents and p_offsets per .bf line; on failure p_error says why
+	bool compile(const std::vector<int> &p_ids, const std::vector<int> &p_parents, const std::vector<Eigen::Vector3f> &p_offsets, std::string &p_error)
+	{
+		const unsigned n = (unsigned)p_ids.size();
+		if (n == 0) return fail(p_error, "no joints");
+
+		// line of every joint ID
+		std::vector<int> line(n, -1);
+		for (unsigned i = 0; i < n; ++i)
+		{
+			const int id = p_ids[i];
+			if (id < 0 || id >= (int)n) return fail(p_error, "joint ID " + std::to_string(id) + " out of range for " + std::to_string(n) + " joints");
+			if (line[id] >= 0) return fail(p_error, "joint " + std::to_string(id) + " defined twice");
+			line[id] = (int)i;
+		}
+		// n IDs in [0, n) without repeats: none missing
+		std::vector<int> parentOf(n);
+		for (unsigned j = 0; j < n; ++j)
+		{
+			const int p = p_parents[line[j]];
+			if (p < -1 || p >= (int)n) return fail(p_error, "joint " + std::to_string(j) + " has parent " + std::to_string(p) + ", which doesn't exist");
+			if (!p_offsets[line[j]].allFinite()) return fail(p_error, "joint " + std::to_string(j) + " has an invalid offset");
+			parentOf[j] = p;
+		}
+
+		// ancestors first, in .bf order otherwise; a joint met again while
+		// its ancestors are being placed closes a cycle
+		enum { Unvisited, Visiting, Placed };
+		std::vector<uint8_t> state(n, Unvisited);
+		std::vector<unsigned> chain;
+		sourceJoint.clear();
+		for (unsigned i = 0; i < n; ++i)
+		{
+			chain.clear();
+			for (int j = p_ids[i]; j >= 0 && state[j] != Placed; j = parentOf[j])
+			{
+				if (state[j] == Visiting) return fail(p_error, "joint " + std::to_string(j) + " is its own ancestor");
+				state[j] = Visiting;
+				chain.push_back((unsigned)j);
+			}
+			for (size_t k = chain.size(); k-- > 0;)
+			{
+				state[chain[k]] = Placed;
+				sourceJoint.push_back(chain[k]);
+			}
+		}
+
+		numJoints = n;
+		compiledJoint.resize(n);
+		for (unsigned c = 0; c < n; ++c) compiledJoint[sourceJoint[c]] = c;
+		parent.resize(n);
+		offset.assign(n, Eigen::Matrix4f::Identity());
+		for (unsigned c = 0; c < n; ++c)
+		{
+			const unsigned j = sourceJoint[c];
+			parent[c] = parentOf[j] < 0 ? -1 : (int)compiledJoint[parentOf[j]];
+			offset[c].block<3, 1>(0, 3) = p_offsets[line[j]];
+		}
+		computeRest();
+		return true;
+	}
+
+	bool save(const std::string &p_path) const
+	{
+		RigFileHeader header = {};
+		std::memcpy(header.magic, "SKELRIG", 8);
+		header.version = RIG_VERSION;
+		header.numJoints = numJoints;
+
+		std::vector<RigFileJoint> joints(numJoints);
+		for (unsigned c = 0; c < numJoints; ++c)
+		{
+			RigFileJoint &f = joints[c];
+			f.parent = parent[c];
+			f.sourceJoint = sourceJoint[c];
+			for (int r = 0; r < 3; ++r)
+			{
+				f.offset[r] = offset[c](r, 3);
+				for (int k = 0; k < 4; ++k)
+				{
+					f.restGlobal[4 * r + k] = restGlobal[c](r, k);
+					f.restInv[4 * r + k] = restInv[c](r, k);
+				}
+			}
+		}
+
+		std::ofstream out(p_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write((const char *)&header, sizeof(header));
+		out.write((const char *)joints.data(), joints.size() * sizeof(RigFileJoint));
+		out.close();
+		if (!out)
+		{
+			std::remove(p_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// false for a file that isn't a rig or breaks the ordering
+	bool load(const std::string &p_path)
+	{
+		MappedFile file;
+		if (!file.open(p_path) || file.size() < sizeof(RigFileHeader)) return false;
+		RigFileHeader header;
+		std::memcpy(&header, file.data(), sizeof(header));
+		if (std::memcmp(header.magic, "SKELRIG", 8) != 0 || header.version != RIG_VERSION || header.numJoints == 0
+			|| file.size() != sizeof(header) + size_t(header.numJoints) * sizeof(RigFileJoint)) return false;
+
+		const unsigned n = header.numJoints;
+		std::vector<RigFileJoint> joints(n);
+		std::memcpy(joints.data(), file.data() + sizeof(header), n * sizeof(RigFileJoint));
+		std::vector<uint8_t> seen(n, 0);
+		for (unsigned c = 0; c < n; ++c)
+		{
+			if (joints[c].parent < -1 || joints[c].parent >= (int)c || joints[c].sourceJoint >= n || seen[joints[c].sourceJoint]) return false;
+			seen[joints[c].sourceJoint] = 1;
+		}
+
+		numJoints = n;
+		parent.resize(n);
+		sourceJoint.resize(n);
+		compiledJoint.resize(n);
+		offset.assign(n, Eigen::Matrix4f::Identity());
+		restGlobal.assign(n, Eigen::Matrix4f::Identity());
+		restInv.assign(n, Eigen::Matrix4f::Identity());
+		for (unsigned c = 0; c < n; ++c)
+		{
+			const RigFileJoint &f = joints[c];
+			parent[c] = f.parent;
+			sourceJoint[c] = f.sourceJoint;
+			compiledJoint[f.sourceJoint] = c;
+			for (int r = 0; r < 3; ++r)
+			{
+				offset[c](r, 3) = f.offset[r];
+				for (int k = 0; k < 4; ++k)
+				{
+					restGlobal[c](r, k) = f.restGlobal[4 * r + k];
+					restInv[c](r, k) = f.restInv[4 * r + k];
+				}
+			}
+		}
+		return true;
+	}
+
+private:
+	static bool fail(std::string &p_error, const std::string &p_message)
+	{
+		p_error = p_message;
+		return false;
+	}
+
+	void computeRest()
+	{
+		restGlobal.resize(numJoints);
+		restInv.resize(numJoints);
+		for (unsigned c = 0; c < numJoints; ++c)
+		{
+			restGlobal[c] = parent[c] < 0 ? offset[c] : Eigen::Matrix4f(restGlobal[parent[c]] * offset[c]);
+			restInv[c] = restGlobal[c].inverse();
+		}
+	}
+};
+
+// the lines of a .bf; false if the file is missing or a line isn't five
+// numbers, with the line in p_error
+inline bool parseSkeletonFile(const std::string &p_path, std::vector<int> &p_ids, std::vector<int> &p_parents, std::vector<Eigen::Vector3f> &p_offsets, std::string &p_error)
+{
+	p_ids.clear();
+	p_parents.clear();
+	p_offsets.clear();
+	MappedFile file;
+	if (!file.open(p_path))
+	{
+		p_error = "can't open " + p_path;
+		return false;
+	}
+	const char *p = file.data(), *end = p + file.size();
+	for (unsigned lineNumber = 1; p < end; ++lineNumber)
+	{
+		p = skipBlanks(p, end);
+		if (p == end) break;
+		if (*p == '\n' || *p == '\r')
+		{
+			p = skipLine(p, end);
+			continue;
+		}
+		float v[5];
+		for (int k = 0; k < 5; ++k)
+		{
+			p = skipBlanks(p, end);
+			const char *start = p;
+			v[k] = parseFloat(p, end);
+			if (p == start || (k < 2 && v[k] != std::floor(v[k])))
+			{
+				p_error = p_path + ", line " + std::to_string(lineNumber) + ": expected \"jointID parentID x y z\"";
+				return false;
+			}
+		}
+		p_ids.push_back((int)v[0]);
+		p_parents.push_back((int)v[1]);
+		p_offsets.push_back(Eigen::Vector3f(v[2], v[3], v[4]));
+		p = skipLine(p, end);
+	}
+	return true;
+}
+
+// path.bf -> path.rig
+inline std::string rigPath(const std::string &p_skeletonPath)
+{
+	return replaceExtension(p_skeletonPath, ".rig");
+}
+
+// p_rows per pose, 4 per source joint (w x y z); every joint's rotation
+// must be a finite unit quaternion within p_tolerance
+inline bool validatePoses(const float *p_data, unsigned p_cols, unsigned p_rows, unsigned p_numJoints, float p_tolerance, std::string &p_error)
+{
+	if (p_rows < 4 * p_numJoints)
+	{
+		p_error = std::to_string(p_rows) + " rows, " + std::to_string(4 * p_numJoints) + " needed for " + std::to_string(p_numJoints) + " joints";
+		return false;
+	}
+	for (unsigned pose = 0; pose < p_cols; ++pose)
+	{
+		for (unsigned j = 0; j < p_numJoints; ++j)
+		{
+			const float *q = p_data + size_t(pose) * p_rows + 4 * j;
+			const float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+			if (!(std::fabs(length - 1.0f) <= p_tolerance))
+			{
+				p_error = "pose " + std::to_string(pose) + ", joint " + std::to_string(j) + ": rotation of length " + std::to_string(length);
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,474 @@
+#pragma once
+
+// Levels of detail for skinned meshes by quadric error simplification
+// (Garland and Heckbert, "Surface Simplification Using Quadric Error
+// Metrics", 1997).
+//
+// Every vertex gets the quadric of the planes of its triangles (weighted by
+// area, plus perpendicular planes along open borders so they don't shrink);
+// collapsing an edge sums the quadrics of its ends, and the cheapest
+// collapse goes first. Collapses are half-edge collapses: the edge folds into
+// one of its endpoints, so a LOD vertex is a vertex of the full mesh and
+// keeps its position, normal and skin weights. Nothing is interpolated, the
+// LODs only remap vertex indices. Since a vertex that folds into another now
+// moves with the other's joints, the cost also grows with how much the two
+// vertices' weights differ, which keeps the borders between bones.
+//
+// Collapses that would flip a triangle or make the mesh non-manifold are
+// skipped. The simplifier keeps its state between calls, so successively
+// smaller targets give a LOD chain from one run. That run is the slow part
+// (most of a second for the ogre), so the chain is saved next to the mesh
+// as a .lods file: a header, then per LOD its vertex map and indices.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <eigen>
+#include "mappedfile.h"
+#include "skinweights.h"
+#include "skinning.h"
+
+// sum of w (n.p + d)^2 over planes, as the symmetric 4x4 matrix
+// [a2 ab ac ad; b2 bc bd; c2 cd; d2] and the total weight
+struct Quadric
+{
+	double q[10];
+	double weight;
+
+	void clear()
+	{
+		std::fill(q, q + 10, 0.0);
+		weight = 0.0;
+	}
+
+	void addPlane(const Eigen::Vector3d &p_n, double p_d, double p_w)
+	{
+		const double a = p_n(0), b = p_n(1), c = p_n(2), d = p_d;
+		q[0] += p_w * a * a; q[1] += p_w * a * b; q[2] += p_w * a * c; q[3] += p_w * a * d;
+		q[4] += p_w * b * b; q[5] += p_w * b * c; q[6] += p_w * b * d;
+		q[7] += p_w * c * c; q[8] += p_w * c * d;
+		q[9] += p_w * d * d;
+		weight += p_w;
+	}
+
+	void add(const Quadric &p_other)
+	{
+		for (int i = 0; i < 10; ++i) q[i] += p_other.q[i];
+		weight += p_other.weight;
+	}
+
+	double error(const Eigen::Vector3d &p_p) const
+	{
+		const double x = p_p(0), y = p_p(1), z = p_p(2);
+		return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+			+ q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+			+ q[7] * z * z + 2.0 * q[8] * z + q[9];
+	}
+};
+
+struct MeshLod
+{
+	std::vector<unsigned> vertices;	// [LOD vertex], the full mesh vertex it is
+	std::vector<int> indices;		// 3 per triangle, into vertices
+	float error = 0.0f;				// RMS distance to the planes of the full mesh, worst vertex
+};
+
+class MeshSimplifier
+{
+public:
+	// p_triangles holds anything indexable with [0..2]
+	template <typename Triangle>
+	MeshSimplifier(const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Triangle> &p_triangles, const SkinWeights &p_weights)
+		: weights(p_weights)
+	{
+		const unsigned numVertices = (unsigned)p_vertices.size();
+		positions.resize(numVertices);
+		for (unsigned v = 0; v < numVertices; ++v) positions[v] = p_vertices[v].cast<double>();
+		quadrics.resize(numVertices);
+		for (Quadric &q : quadrics) q.clear();
+		vertexTriangles.resize(numVertices);
+		version.assign(numVertices, 0);
+
+		Eigen::Vector3d lo = positions.empty() ? Eigen::Vector3d::Zero() : positions[0], hi = lo;
+		for (const Eigen::Vector3d &p : positions)
+		{
+			lo = lo.cwiseMin(p);
+			hi = hi.cwiseMax(p);
+		}
+		const double diagonal = (hi - lo).norm();
+		// a vertex taking over completely different weights costs as much
+		// as moving it 0.5% of the model size off its planes; without this
+		// the posed LODs are off twice as far at the joints
+		weightCost = 0.5 * (0.005 * diagonal) * (0.005 * diagonal);
+
+		// triangle planes; edges seen once are borders
+		std::unordered_map<uint64_t, unsigned> edgeUses;
+		for (const Triangle &t : p_triangles)
+		{
+			const Face f = { { t[0], t[1], t[2] } };
+			if (f.v[0] == f.v[1] || f.v[1] == f.v[2] || f.v[0] == f.v[2]) continue;
+			const unsigned id = (unsigned)faces.size();
+			faces.push_back(f);
+			alive.push_back(1);
+			for (int k = 0; k < 3; ++k)
+			{
+				vertexTriangles[f.v[k]].push_back(id);
+				edgeUses[edgeKey(f.v[k], f.v[(k + 1) % 3])]++;
+			}
+			const Eigen::Vector3d cross = (positions[f.v[1]] - positions[f.v[0]]).cross(positions[f.v[2]] - positions[f.v[0]]);
+			const double area = 0.5 * cross.norm();
+			if (area <= 0.0) continue;
+			const Eigen::Vector3d n = cross.normalized();
+			for (int k = 0; k < 3; ++k) quadrics[f.v[k]].addPlane(n, -n.dot(positions[f.v[0]]), area);
+		}
+		numAlive = faces.size();
+
+		for (const Face &f : faces)
+		{
+			const Eigen::Vector3d n = (positions[f.v[1]] - positions[f.v[0]]).cross(positions[f.v[2]] - positions[f.v[0]]).normalized();
+			for (int k = 0; k < 3; ++k)
+			{
+				const int a = f.v[k], b = f.v[(k + 1) % 3];
+				if (edgeUses[edgeKey(a, b)] != 1) continue;
+				const Eigen::Vector3d edge = positions[b] - positions[a];
+				const Eigen::Vector3d side = edge.cross(n).normalized();
+				if (!side.allFinite()) continue;
+				const double w = 10.0 * edge.squaredNorm();
+				quadrics[a].addPlane(side, -side.dot(positions[a]), w);
+				quadrics[b].addPlane(side, -side.dot(positions[a]), w);
+			}
+		}
+
+		for (unsigned v = 0; v < numVertices; ++v) pushCollapses(v);
+	}
+
+	size_t numTriangles() const { return numAlive; }
+
+	// collapses until at most p_targetTriangles remain (or nothing can be
+	// collapsed) and writes the result
+	void simplify(size_t p_targetTriangles, MeshLod &p_lod)
+	{
+		while (numAlive > p_targetTriangles && !heap.empty())
+		{
+			const Collapse c = heap.top();
+			heap.pop();
+			if (version[c.from] != c.fromVersion || version[c.to] != c.toVersion) continue;	// stale
+			if (!canCollapse(c.from, c.to)) continue;
+			collapse(c.from, c.to);
+		}
+		snapshot(p_lod);
+	}
+
+private:
+	struct Face
+	{
+		int v[3];
+	};
+
+	struct Collapse
+	{
+		double cost;
+		unsigned from, to;
+		unsigned fromVersion, toVersion;
+		bool operator>(const Collapse &p_other) const { return cost > p_other.cost; }
+	};
+
+	static uint64_t edgeKey(int a, int b) { return a < b ? (uint64_t(a) << 32) | unsigned(b) : (uint64_t(b) << 32) | unsigned(a); }
+
+	// sum over joints of |w_a - w_b|, in [0, 2]
+	double weightDifference(unsigned a, unsigned b) const
+	{
+		const SkinInfluence *ia = weights.vertexInfluences(a), *ib = weights.vertexInfluences(b);
+		double sum = 0.0;
+		for (unsigned k = 0; k < weights.counts[a]; ++k) sum += std::fabs(ia[k].weight() - weights.weight(b, ia[k].joint));
+		for (unsigned k = 0; k < weights.counts[b]; ++k)
+		{
+			if (weights.weight(a, ib[k].joint) == 0.0f) sum += ib[k].weight();
+		}
+		return sum;
+	}
+
+	// u folds into v; the weight term is scaled by the area like the planes
+	double cost(unsigned u, unsigned v) const
+	{
+		Quadric q = quadrics[u];
+		q.add(quadrics[v]);
+		return std::max(q.error(positions[v]), 0.0) + q.weight * weightCost * weightDifference(u, v);
+	}
+
+	// every edge at v, in its cheaper direction
+	void pushCollapses(unsigned v)
+	{
+		for (unsigned t : vertexTriangles[v])
+		{
+			if (!alive[t]) continue;
+			for (int k = 0; k < 3; ++k)
+			{
+				const unsigned x = (unsigned)faces[t].v[k];
+				if (x == v) continue;
+				const double toV = cost(x, v), toX = cost(v, x);
+				heap.push(toV <= toX ? Collapse{ toV, x, v, version[x], version[v] } : Collapse{ toX, v, x, version[v], version[x] });
+			}
+		}
+	}
+
+	// the edge must have at most two common neighbours (the link
+	// condition, for a manifold result) and no triangle may flip
+	bool canCollapse(unsigned u, unsigned v)
+	{
+		neighboursU.clear();
+		neighboursV.clear();
+		bool adjacent = false;
+		for (unsigned t : vertexTriangles[u])
+		{
+			if (!alive[t]) continue;
+			for (int k = 0; k < 3; ++k)
+			{
+				if (faces[t].v[k] != (int)u) neighboursU.push_back(faces[t].v[k]);
+				if (faces[t].v[k] == (int)v) adjacent = true;
+			}
+		}
+		if (!adjacent) return false;
+		for (unsigned t : vertexTriangles[v])
+		{
+			if (!alive[t]) continue;
+			for (int k = 0; k < 3; ++k)
+			{
+				if (faces[t].v[k] != (int)v) neighboursV.push_back(faces[t].v[k]);
+			}
+		}
+		std::sort(neighboursU.begin(), neighboursU.end());
+		neighboursU.erase(std::unique(neighboursU.begin(), neighboursU.end()), neighboursU.end());
+		std::sort(neighboursV.begin(), neighboursV.end());
+		neighboursV.erase(std::unique(neighboursV.begin(), neighboursV.end()), neighboursV.end());
+		unsigned common = 0;
+		for (size_t i = 0, j = 0; i < neighboursU.size() && j < neighboursV.size();)
+		{
+			if (neighboursU[i] < neighboursV[j]) ++i;
+			else if (neighboursV[j] < neighboursU[i]) ++j;
+			else
+			{
+				++common;
+				++i;
+				++j;
+			}
+		}
+		if (common > 2) return false;
+
+		for (unsigned t : vertexTriangles[u])
+		{
+			if (!alive[t]) continue;
+			const Face &f = faces[t];
+			if (f.v[0] == (int)v || f.v[1] == (int)v || f.v[2] == (int)v) continue;	// goes away
+			Eigen::Vector3d p[3], moved[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				p[k] = positions[f.v[k]];
+				moved[k] = f.v[k] == (int)u ? positions[v] : p[k];
+			}
+			const Eigen::Vector3d before = (p[1] - p[0]).cross(p[2] - p[0]);
+			const Eigen::Vector3d after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+			if (after.dot(before) <= 0.2 * before.norm() * after.norm()) return false;
+		}
+		return true;
+	}
+
+	void collapse(unsigned u, unsigned v)
+	{
+		quadrics[v].add(quadrics[u]);
+		for (unsigned t : vertexTriangles[u])
+		{
+			if (!alive[t]) continue;
+			Face &f = faces[t];
+			if (f.v[0] == (int)v || f.v[1] == (int)v || f.v[2] == (int)v)
+			{
+				alive[t] = 0;
+				--numAlive;
+				continue;
+			}
+			for (int k = 0; k < 3; ++k)
+			{
+				if (f.v[k] == (int)u) f.v[k] = (int)v;
+			}
+			vertexTriangles[v].push_back(t);
+		}
+		vertexTriangles[u].clear();
+		std::vector<unsigned> &around = vertexTriangles[v];
+		around.erase(std::remove_if(around.begin(), around.end(), [&](unsigned t) { return !alive[t]; }), around.end());
+		++version[u];
+		++version[v];
+		pushCollapses(v);
+	}
+
+	void snapshot(MeshLod &p_lod) const
+	{
+		std::vector<int> remap(positions.size(), -1);
+		for (size_t t = 0; t < faces.size(); ++t)
+		{
+			if (!alive[t]) continue;
+			for (int k = 0; k < 3; ++k) remap[faces[t].v[k]] = 0;
+		}
+		p_lod.vertices.clear();
+		p_lod.error = 0.0f;
+		for (unsigned v = 0; v < positions.size(); ++v)
+		{
+			if (remap[v] < 0) continue;
+			remap[v] = (int)p_lod.vertices.size();
+			p_lod.vertices.push_back(v);
+			const Quadric &q = quadrics[v];
+			if (q.weight > 0.0) p_lod.error = std::max(p_lod.error, (float)std::sqrt(std::max(q.error(positions[v]), 0.0) / q.weight));
+		}
+		p_lod.indices.clear();
+		p_lod.indices.reserve(3 * numAlive);
+		for (size_t t = 0; t < faces.size(); ++t)
+		{
+			if (!alive[t]) continue;
+			for (int k = 0; k < 3; ++k) p_lod.indices.push_back(remap[faces[t].v[k]]);
+		}
+	}
+
+	const SkinWeights &weights;
+	double weightCost = 0.0;
+	std::vector<Eigen::Vector3d> positions;
+	std::vector<Quadric> quadrics;
+	std::vector<Face> faces;
+	std::vector<uint8_t> alive;						// [face]
+	size_t numAlive = 0;
+	std::vector<std::vector<unsigned> > vertexTriangles;
+	std::vector<unsigned> version;					// [vertex], bumped when its collapses change
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse> > heap;
+	std::vector<int> neighboursU, neighboursV;		// scratch of canCollapse()
+};
+
+struct MeshLodHeader
+{
+	char magic[8];			// "MESHLOD" and a terminating 0
+	uint32_t version;
+	uint32_t numLods;
+	uint32_t numSourceVertices;	// of the full mesh, to reject a cache of another mesh
+	uint32_t reserved;
+};
+
+static const uint32_t MESHLOD_VERSION = 1;
+
+// per LOD: vertex count, index count, error, then the two arrays
+inline bool saveMeshLods(const std::string &p_path, unsigned p_numSourceVertices, const std::vector<MeshLod> &p_lods)
+{
+	MeshLodHeader header = {};
+	std::memcpy(header.magic, "MESHLOD", 8);
+	header.version = MESHLOD_VERSION;
+	header.numLods = (uint32_t)p_lods.size();
+	header.numSourceVertices = p_numSourceVertices;
+
+	std::ofstream out(p_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write((const char *)&header, sizeof(header));
+	for (const MeshLod &lod : p_lods)
+	{
+		const uint32_t counts[2] = { (uint32_t)lod.vertices.size(), (uint32_t)lod.indices.size() };
+		out.write((const char *)counts, sizeof(counts));
+		out.write((const char *)&lod.error, sizeof(float));
+		out.write((const char *)lod.vertices.data(), lod.vertices.size() * sizeof(unsigned));
+		out.write((const char *)lod.indices.data(), lod.indices.size() * sizeof(int));
+	}
+	out.close();
+	if (!out)
+	{
+		std::remove(p_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+inline bool loadMeshLods(const std::string &p_path, unsigned p_numSourceVertices, std::vector<MeshLod> &p_lods)
+{
+	MappedFile file;
+	if (!file.open(p_path) || file.size() < sizeof(MeshLodHeader)) return false;
+	MeshLodHeader header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, "MESHLOD", 8) != 0 || header.version != MESHLOD_VERSION || header.numSourceVertices != p_numSourceVertices) return false;
+
+	const char *p = file.data() + sizeof(header), *end = file.data() + file.size();
+	p_lods.resize(header.numLods);
+	for (MeshLod &lod : p_lods)
+	{
+		uint32_t counts[2];
+		if (end - p < ptrdiff_t(sizeof(counts) + sizeof(float))) return false;
+		std::memcpy(counts, p, sizeof(counts));
+		std::memcpy(&lod.error, p + sizeof(counts), sizeof(float));
+		p += sizeof(counts) + sizeof(float);
+		if (size_t(end - p) < counts[0] * sizeof(unsigned) + size_t(counts[1]) * sizeof(int)) return false;
+		lod.vertices.resize(counts[0]);
+		lod.indices.resize(counts[1]);
+		if (counts[0]) std::memcpy(lod.vertices.data(), p, counts[0] * sizeof(unsigned));
+		p += counts[0] * sizeof(unsigned);
+		if (counts[1]) std::memcpy(lod.indices.data(), p, counts[1] * sizeof(int));
+		p += counts[1] * sizeof(int);
+		for (unsigned v : lod.vertices)
+		{
+			if (v >= p_numSourceVertices) return false;
+		}
+		for (int i : lod.indices)
+		{
+			if (i < 0 || i >= (int)counts[0]) return false;
+		}
+	}
+	return p == end;
+}
+
+// a LOD ready for the crowd: the LOD's share of the full mesh's rest
+// normals and weights, and its SoA rest pose for the kernel
+struct SkinnedLod
+{
+	MeshLod mesh;
+	std::vector<Eigen::Vector3f> normals;
+	SkinWeights weights;
+	SkinningRest rest;
+
+	void build(const MeshLod &p_mesh, const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Eigen::Vector3f> &p_normals, const SkinWeights &p_weights)
+	{
+		mesh = p_mesh;
+		const unsigned n = (unsigned)p_mesh.vertices.size();
+		std::vector<Eigen::Vector3f> vertices(n);
+		normals.resize(n);
+		weights.reset(n, p_weights.numJoints, p_weights.maxInfluences);
+		for (unsigned i = 0; i < n; ++i)
+		{
+			const unsigned src = p_mesh.vertices[i];
+			vertices[i] = p_vertices[src];
+			normals[i] = p_normals[src];
+			std::copy(p_weights.vertexInfluences(src), p_weights.vertexInfluences(src) + p_weights.maxInfluences,
+				weights.influences.begin() + size_t(i) * weights.maxInfluences);
+			weights.counts[i] = p_weights.counts[src];
+		}
+		rest.build(vertices, normals, weights);
+	}
+};
+
+// the full mesh as LOD 0, then one LOD per entry of p_ratios (fractions
+// of the full triangle count, descending)
+template <typename Triangle>
+void simplifyMeshLods(const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Triangle> &p_triangles, const SkinWeights &p_weights,
+	const std::vector<float> &p_ratios, std::vector<MeshLod> &p_lods)
+{
+	p_lods.resize(p_ratios.size() + 1);
+	MeshLod &full = p_lods[0];
+	full.vertices.resize(p_vertices.size());
+	for (unsigned v = 0; v < p_vertices.size(); ++v) full.vertices[v] = v;
+	full.indices.clear();
+	for (const Triangle &t : p_triangles)
+	{
+		for (int k = 0; k < 3; ++k) full.indices.push_back(t[k]);
+	}
+	full.error = 0.0f;
+
+	MeshSimplifier simplifier(p_vertices, p_triangles, p_weights);
+	for (size_t i = 0; i < p_ratios.size(); ++i) simplifier.simplify(size_t(p_ratios[i] * p_triangles.size()), p_lods[i + 1]);
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+// Skeleton sorted into depth levels for forward kinematics.
+//
+// computeJointTransformations() walks the joints in file order and needs
+// every parent to come before its children. Skeleton::build() sorts the
+// joints topologically instead: level 0 holds the roots, level l the joints
+// whose parent is in level l - 1. All joints of a level are independent, so
+// globals are computed a level at a time, 4 joints per SSE operation.
+//
+// A single pose is stored as 12 planes (one per entry of the 3x4 affine,
+// row-major as in SkinPalette) of paddedJoints floats, in sorted joint
+// order, and a level is done 4 joints per SSE operation. Levels of the rigs
+// we have are narrow (the 30-joint ogre has levels of 1 to 6 joints), and
+// the parents of 4 joints have to be gathered one float at a time.
+//
+// Crowds therefore use a batch layout: groups of 4 characters with the same
+// skeleton, interleaved so that entry e of joint j of the 4 characters is
+// one register. Each SSE operation handles one joint of 4 characters, the
+// parent is a plain load, and groups are spread over the job system.
+
+#include <algorithm>
+#include <vector>
+#include <xmmintrin.h>
+#include <eigen>
+#include "skinning.h"
+#include "jobs.h"
+
+// 4 affines, one register per entry (row-major, as in SkinPalette).
+// Written out entry by entry so they stay in registers.
+struct Affine4
+{
+	__m128 m0, m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11;
+};
+
+template <typename Fetch>
+static inline Affine4 fetchAffine4(Fetch f)
+{
+	Affine4 a;
+	a.m0 = f(0); a.m1 = f(1); a.m2 = f(2); a.m3 = f(3);
+	a.m4 = f(4); a.m5 = f(5); a.m6 = f(6); a.m7 = f(7);
+	a.m8 = f(8); a.m9 = f(9); a.m10 = f(10); a.m11 = f(11);
+	return a;
+}
+
+template <typename Store>
+static inline void storeAffine4(const Affine4 &a, Store s)
+{
+	s(0, a.m0); s(1, a.m1); s(2, a.m2); s(3, a.m3);
+	s(4, a.m4); s(5, a.m5); s(6, a.m6); s(7, a.m7);
+	s(8, a.m8); s(9, a.m9); s(10, a.m10); s(11, a.m11);
+}
+
+static inline __m128 dot3(__m128 a0, __m128 a1, __m128 a2, __m128 b0, __m128 b1, __m128 b2)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, b0), _mm_mul_ps(a1, b1)), _mm_mul_ps(a2, b2));
+}
+
+// a * b, with the implicit last row 0 0 0 1
+static inline Affine4 mulAffine4(const Affine4 &a, const Affine4 &b)
+{
+	Affine4 c;
+	c.m0 = dot3(a.m0, a.m1, a.m2, b.m0, b.m4, b.m8);
+	c.m1 = dot3(a.m0, a.m1, a.m2, b.m1, b.m5, b.m9);
+	c.m2 = dot3(a.m0, a.m1, a.m2, b.m2, b.m6, b.m10);
+	c.m3 = _mm_add_ps(dot3(a.m0, a.m1, a.m2, b.m3, b.m7, b.m11), a.m3);
+	c.m4 = dot3(a.m4, a.m5, a.m6, b.m0, b.m4, b.m8);
+	c.m5 = dot3(a.m4, a.m5, a.m6, b.m1, b.m5, b.m9);
+	c.m6 = dot3(a.m4, a.m5, a.m6, b.m2, b.m6, b.m10);
+	c.m7 = _mm_add_ps(dot3(a.m4, a.m5, a.m6, b.m3, b.m7, b.m11), a.m7);
+	c.m8 = dot3(a.m8, a.m9, a.m10, b.m0, b.m4, b.m8);
+	c.m9 = dot3(a.m8, a.m9, a.m10, b.m1, b.m5, b.m9);
+	c.m10 = dot3(a.m8, a.m9, a.m10, b.m2, b.m6, b.m10);
+	c.m11 = _mm_add_ps(dot3(a.m8, a.m9, a.m10, b.m3, b.m7, b.m11), a.m11);
+	return c;
+}
+
+class Skeleton
+{
+public:
+	unsigned numJoints = 0;
+	unsigned paddedJoints = 0;			// plane length; a 4-wide load at any joint stays inside
+	std::vector<int> parent;			// [sorted], -1 for roots
+	std::vector<unsigned> order;		// sorted index -> joint ID
+	std::vector<unsigned> sortedIndex;	// joint ID -> sorted index
+	std::vector<unsigned> levelStart;	// level l is [levelStart[l], levelStart[l + 1])
+	AlignedFloats offset;				// joint offsets as a pose
+
+	unsigned numLevels() const { return (unsigned)levelStart.size() - 1; }
+	size_t poseFloats() const { return size_t(SKIN_AFFINE) * paddedJoints; }
+
+	// batch layout: character c, entry e, sorted joint j at
+	// [(c / 4) * batchGroupFloats() + (e * numJoints + j) * 4 + c % 4]
+	size_t batchGroupFloats() const { return size_t(SKIN_AFFINE) * numJoints * 4; }
+	size_t batchFloats(unsigned p_characters) const { return (p_characters + 3) / 4 * batchGroupFloats(); }
+
+	// p_parents and p_offsets are indexed by joint ID, in any order.
+	// Fails on parent indices out of range and on cycles.
+	bool build(const std::vector<int> &p_parents, const std::vector<Eigen::Matrix4f> &p_offsets)
+	{
+		numJoints = (unsigned)p_parents.size();
+		paddedJoints = (numJoints + 6) & ~3u;
+
+		// depth of every joint, following parents until a known depth
+		std::vector<int> depth(numJoints, -1);
+		std::vector<unsigned> chain;
+		for (unsigned j = 0; j < numJoints; ++j)
+		{
+			unsigned k = j;
+			chain.clear();
+			while (depth[k] < 0)
+			{
+				if (chain.size() > numJoints) return false; // cycle
+				chain.push_back(k);
+				const int p = p_parents[k];
+				if (p < 0) break;
+				if (p >= (int)numJoints) return false;
+				k = (unsigned)p;
+			}
+			int d = depth[k] >= 0 ? depth[k] : -1;
+			for (size_t i = chain.size(); i-- > 0;) depth[chain[i]] = ++d;
+		}
+
+		order.resize(numJoints);
+		for (unsigned j = 0; j < numJoints; ++j) order[j] = j;
+		std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return depth[a] < depth[b]; });
+
+		sortedIndex.resize(numJoints);
+		for (unsigned s = 0; s < numJoints; ++s) sortedIndex[order[s]] = s;
+
+		parent.assign(paddedJoints, 0);
+		gatherParent.assign(paddedJoints, 0);
+		levelStart.clear();
+		for (unsigned s = 0; s < numJoints; ++s)
+		{
+			const int p = p_parents[order[s]];
+			parent[s] = p < 0 ? -1 : (int)sortedIndex[p];
+			gatherParent[s] = p < 0 ? 0 : sortedIndex[p];
+			if (s == 0 || depth[order[s]] != depth[order[s - 1]]) levelStart.push_back(s);
+		}
+		levelStart.push_back(numJoints);
+
+		offset.assign(poseFloats(), 0.0f);
+		for (unsigned s = 0; s < numJoints; ++s) setAffine(offset.data(), s, p_offsets[order[s]]);
+		for (unsigned s = numJoints; s < paddedJoints; ++s) setAffine(offset.data(), s, Eigen::Matrix4f::Identity());
+		return true;
+	}
+
+	void setAffine(float *p_pose, unsigned p_sorted, const Eigen::Matrix4f &p_m) const
+	{
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 4; ++c) p_pose[size_t(4 * r + c) * paddedJoints + p_sorted] = p_m(r, c);
+		}
+	}
+
+	Eigen::Matrix4f affine(const float *p_pose, unsigned p_sorted) const
+	{
+		Eigen::Matrix4f m = Eigen::Matrix4f::Identity();
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 4; ++c) m(r, c) = p_pose[size_t(4 * r + c) * paddedJoints + p_sorted];
+		}
+		return m;
+	}
+
+	void setBatchAffine(float *p_batch, unsigned p_character, unsigned p_sorted, const Eigen::Matrix4f &p_m) const
+	{
+		float *group = p_batch + (p_character / 4) * batchGroupFloats() + p_character % 4;
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 4; ++c) group[(size_t(4 * r + c) * numJoints + p_sorted) * 4] = p_m(r, c);
+		}
+	}
+
+	Eigen::Matrix4f batchAffine(const float *p_batch, unsigned p_character, unsigned p_sorted) const
+	{
+		const float *group = p_batch + (p_character / 4) * batchGroupFloats() + p_character % 4;
+		Eigen::Matrix4f m = Eigen::Matrix4f::Identity();
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 4; ++c) m(r, c) = group[(size_t(4 * r + c) * numJoints + p_sorted) * 4];
+		}
+		return m;
+	}
+
+	// globals_j = globals_parent * offset_j * locals_j, for one character
+	void computeGlobals(const float *p_locals, float *p_globals) const
+	{
+		const size_t n = paddedJoints;
+		for (unsigned l = 0; l < numLevels(); ++l)
+		{
+			for (unsigned j = levelStart[l]; j < levelStart[l + 1]; j += 4)
+			{
+				// Lanes past the level end compute joints of the next level
+				// with stale parents; those are overwritten later.
+				const Affine4 o = fetchAffine4([&](unsigned e) { return _mm_loadu_ps(&offset[e * n + j]); });
+				const Affine4 t = mulAffine4(o, fetchAffine4([&](unsigned e) { return _mm_loadu_ps(&p_locals[e * n + j]); }));
+				if (l == 0)
+				{
+					storeAffine4(t, [&](unsigned e, __m128 v) { _mm_storeu_ps(&p_globals[e * n + j], v); });
+					continue;
+				}
+				const unsigned *p = &gatherParent[j];
+				const Affine4 pg = fetchAffine4([&](unsigned e)
+				{
+					const float *plane = &p_globals[e * n];
+					return _mm_setr_ps(plane[p[0]], plane[p[1]], plane[p[2]], plane[p[3]]);
+				});
+				storeAffine4(mulAffine4(pg, t), [&](unsigned e, __m128 v) { _mm_storeu_ps(&p_globals[e * n + j], v); });
+			}
+		}
+	}
+
+	// p_count characters in the batch layout; buffers must be aligned to 16
+	void computeGlobalsBatch(JobSystem &p_jobs, const float *p_locals, float *p_globals, unsigned p_count) const
+	{
+		const size_t stride = batchGroupFloats();
+		p_jobs.parallelFor((p_count + 3) / 4, 4, [&](size_t g0, size_t g1)
+		{
+			for (size_t g = g0; g < g1; ++g) computeGroup(p_locals + g * stride, p_globals + g * stride);
+		});
+	}
+
+private:
+	std::vector<unsigned> gatherParent;	// parent, or 0 where there is none
+
+	// one group of 4 characters in the batch layout, joints in sorted order
+	void computeGroup(const float *p_locals, float *p_globals) const
+	{
+		const size_t n = numJoints;
+		for (unsigned j = 0; j < numJoints; ++j)
+		{
+			const Affine4 o = fetchAffine4([&](unsigned e) { return _mm_set1_ps(offset[e * paddedJoints + j]); });
+			const Affine4 t = mulAffine4(o, fetchAffine4([&](unsigned e) { return _mm_load_ps(&p_locals[(e * n + j) * 4]); }));
+			const auto store = [&](unsigned e, __m128 v) { _mm_store_ps(&p_globals[(e * n + j) * 4], v); };
+			if (parent[j] >= 0)
+			{
+				const size_t pj = (size_t)parent[j];
+				storeAffine4(mulAffine4(fetchAffine4([&](unsigned e) { return _mm_load_ps(&p_globals[(e * n + pj) * 4]); }), t), store);
+			}
+			else
+			{
+				storeAffine4(t, store);
+			}
+		}
+	}
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+// Linear blend skinning kernel.
+//
+// The rest pose is re-laid out as structure-of-arrays in blocks of 8
+// vertices: positions, normals and, per influence slot, the 8 joint indices
+// and 8 weights sit next to each other. With AVX2 one block is skinned per
+// iteration: the joint matrices are fetched with gathers, blended in
+// registers and applied to 8 vertices at once. Without AVX2 a block is
+// done as two halves of 4 vertices with SSE, and the gathers become row
+// loads plus a transpose; that path is only for builds without /arch:AVX2
+// (the x64 project sets it) and barely keeps up with the scalar reference.
+// Blocks are independent and are split over the job system.
+//
+// The kernel only reads a SkinPalette: jointTrans * restInv of every joint,
+// built once per frame as 3x4 row-major affines. The constant last row is
+// never stored, blended or multiplied.
+//
+// Results are written through a pointer and a stride so the same kernel can
+// fill a std::vector<Vector3f> or an interleaved vertex buffer.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <eigen>
+#include "skinweights.h"
+#include "jobs.h"
+
+static const unsigned SKIN_BLOCK = 8;	// vertices per SoA block
+static const unsigned SKIN_AFFINE = 12;	// floats per palette entry
+
+typedef std::vector<float, Eigen::aligned_allocator<float> > AlignedFloats;
+typedef std::vector<int32_t, Eigen::aligned_allocator<int32_t> > AlignedInts;
+
+class SkinningRest
+{
+public:
+	unsigned numVertices = 0;
+	unsigned numBlocks = 0;
+	unsigned slots = 0;						// influence slots per vertex
+	bool hasNormals = false;
+	AlignedFloats px, py, pz;				// [vertexID], padded to whole blocks
+	AlignedFloats nx, ny, nz;
+	AlignedInts joints;						// [(block * slots + k) * 8 + lane]
+	AlignedFloats weights;					// same layout, 0 for unused slots
+	std::vector<uint8_t> blockSlots;		// slots used by any vertex of a block
+	std::vector<uint8_t> uniformSlots;		// bit k: every lane of slot k uses the same joint
+
+	void build(const std::vector<Eigen::Vector3f> &p_vertices, const std::vector<Eigen::Vector3f> &p_normals, const SkinWeights &p_weights)
+	{
+		numVertices = (unsigned)p_vertices.size();
+		numBlocks = (numVertices + SKIN_BLOCK - 1) / SKIN_BLOCK;
+		slots = p_weights.maxInfluences;
+		hasNormals = p_normals.size() == p_vertices.size();
+
+		const size_t padded = size_t(numBlocks) * SKIN_BLOCK;
+		AlignedFloats *planes[6] = { &px, &py, &pz, &nx, &ny, &nz };
+		for (int c = 0; c < 6; ++c) planes[c]->assign(padded, 0.0f);
+		joints.assign(padded * slots, 0);
+		weights.assign(padded * slots, 0.0f);
+		blockSlots.assign(numBlocks, 0);
+		uniformSlots.assign(numBlocks, 0);
+
+		for (unsigned v = 0; v < numVertices; ++v)
+		{
+			px[v] = p_vertices[v][0];
+			py[v] = p_vertices[v][1];
+			pz[v] = p_vertices[v][2];
+			if (hasNormals)
+			{
+				nx[v] = p_normals[v][0];
+				ny[v] = p_normals[v][1];
+				nz[v] = p_normals[v][2];
+			}
+			const unsigned block = v / SKIN_BLOCK, lane = v % SKIN_BLOCK;
+			const SkinInfluence *inf = p_weights.vertexInfluences(v);
+			const unsigned count = p_weights.counts[v];
+			for (unsigned k = 0; k < count; ++k)
+			{
+				const size_t i = (size_t(block) * slots + k) * SKIN_BLOCK + lane;
+				joints[i] = inf[k].joint;
+				weights[i] = inf[k].weight();
+			}
+			blockSlots[block] = (uint8_t)std::max<unsigned>(blockSlots[block], count);
+		}
+
+		// Neighbouring vertices mostly hang off the same joints. Lanes with
+		// zero weight may point anywhere, so they take the joint of a used
+		// lane; a slot whose lanes then agree is fetched with broadcasts
+		// instead of gathers.
+		for (unsigned block = 0; block < numBlocks; ++block)
+		{
+			for (unsigned k = 0; k < blockSlots[block]; ++k)
+			{
+				int32_t *j = &joints[(size_t(block) * slots + k) * SKIN_BLOCK];
+				const float *w = &weights[(size_t(block) * slots + k) * SKIN_BLOCK];
+				int32_t common = -1;
+				bool uniform = true;
+				for (unsigned lane = 0; lane < SKIN_BLOCK; ++lane)
+				{
+					if (w[lane] == 0.0f) continue;
+					if (common < 0) common = j[lane];
+					else if (j[lane] != common) uniform = false;
+				}
+				if (common < 0) common = 0;
+				for (unsigned lane = 0; lane < SKIN_BLOCK; ++lane)
+				{
+					if (w[lane] == 0.0f) j[lane] = common;
+				}
+				if (uniform) uniformSlots[block] |= uint8_t(1u << k);
+			}
+		}
+	}
+};
+
+// Per-frame skinning matrices, one 3x4 row-major affine per joint:
+// entry (r, c) of joint j is data[12 * j + 4 * r + c]. Entries are 48 bytes,
+// so each row is 16-byte aligned.
+class SkinPalette
+{
+public:
+	AlignedFloats data;
+
+	unsigned numJoints() const { return (unsigned)(data.size() / SKIN_AFFINE); }
+	const float *joint(unsigned p_joint) const { return &data[size_t(p_joint) * SKIN_AFFINE]; }
+
+	// M_j = jointTrans_j * jointTransRestInv_j; both are affine, so only the
+	// top three rows are computed
+	void build(const std::vector<Eigen::Matrix4f> &p_jointTrans, const std::vector<Eigen::Matrix4f> &p_jointTransRestInv)
+	{
+		data.resize(p_jointTrans.size() * SKIN_AFFINE);
+		for (size_t j = 0; j < p_jointTrans.size(); ++j)
+		{
+			const Eigen::Matrix4f &a = p_jointTrans[j];
+			const Eigen::Matrix4f &b = p_jointTransRestInv[j];
+			float *m = &data[j * SKIN_AFFINE];
+			for (int r = 0; r < 3; ++r)
+			{
+				for (int c = 0; c < 4; ++c)
+				{
+					m[4 * r + c] = a(r, 0) * b(0, c) + a(r, 1) * b(1, c) + a(r, 2) * b(2, c);
+				}
+				m[4 * r + 3] += a(r, 3);
+			}
+		}
+	}
+};
+
+// where skinned vertices go: vertex v is written to positions + v * stride
+// (and normals + v * stride); normals may be null to skip them
+struct SkinTarget
+{
+	float *positions;
+	float *normals;
+	size_t stride;		// in floats
+};
+
+// Lane-width independent arithmetic, so the SSE (4 vertices) and AVX2
+// (8 vertices) paths share the math of the kernels.
+static inline __m128 vadd(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+static inline __m128 vsub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+static inline __m128 vmul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+static inline __m128 vsplat(__m128, float a) { return _mm_set1_ps(a); }
+static inline __m128 vrsqrt(__m128 a) { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_max_ps(a, _mm_set1_ps(1e-30f)))); }
+static inline __m128 vflip(__m128 w, __m128 dot) { return _mm_xor_ps(w, _mm_and_ps(dot, _mm_set1_ps(-0.0f))); }
+#if defined(__AVX2__)
+static inline __m256 vadd(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+static inline __m256 vsub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+static inline __m256 vmul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+static inline __m256 vsplat(__m256, float a) { return _mm256_set1_ps(a); }
+static inline __m256 vrsqrt(__m256 a) { return _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(_mm256_max_ps(a, _mm256_set1_ps(1e-30f)))); }
+static inline __m256 vflip(__m256 w, __m256 dot) { return _mm256_xor_ps(w, _mm256_and_ps(dot, _mm256_set1_ps(-0.0f))); }
+#endif
+
+// Lane widths the kernel templates are instantiated with. The register type
+// is wrapped because as a template argument it would lose its alignment
+// attribute (GCC warns with -Wignored-attributes).
+struct Lanes4 { typedef __m128 V; };
+#if defined(__AVX2__)
+struct Lanes8 { typedef __m256 V; };
+#endif
+
+// Blended affines of a group of lanes, one register per palette entry.
+template <typename L>
+struct AffineLanes
+{
+	typedef typename L::V V;
+	V m0, m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11;
+
+	void reset(V zero)
+	{
+		m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = m8 = m9 = m10 = m11 = zero;
+	}
+
+	// c: the 12 palette entries of each lane's joint
+	void add(V w, const V *c)
+	{
+		m0 = vadd(m0, vmul(w, c[0])); m1 = vadd(m1, vmul(w, c[1])); m2 = vadd(m2, vmul(w, c[2])); m3 = vadd(m3, vmul(w, c[3]));
+		m4 = vadd(m4, vmul(w, c[4])); m5 = vadd(m5, vmul(w, c[5])); m6 = vadd(m6, vmul(w, c[6])); m7 = vadd(m7, vmul(w, c[7]));
+		m8 = vadd(m8, vmul(w, c[8])); m9 = vadd(m9, vmul(w, c[9])); m10 = vadd(m10, vmul(w, c[10])); m11 = vadd(m11, vmul(w, c[11]));
+	}
+
+	void transformPoint(V x, V y, V z, V &ox, V &oy, V &oz) const
+	{
+		ox = vadd(vadd(vmul(m0, x), vmul(m1, y)), vadd(vmul(m2, z), m3));
+		oy = vadd(vadd(vmul(m4, x), vmul(m5, y)), vadd(vmul(m6, z), m7));
+		oz = vadd(vadd(vmul(m8, x), vmul(m9, y)), vadd(vmul(m10, z), m11));
+	}
+
+	// by the inverse transpose of the linear part, renormalized. A blend of
+	// rotations is no rotation (it shrinks and shears), so the linear part
+	// itself would tilt normals; the cofactor matrix, whose columns are
+	// cross products of the linear part's columns, is the inverse transpose
+	// up to the determinant, which the normalization drops
+	void transformNormal(V x, V y, V z, V &ox, V &oy, V &oz) const
+	{
+		// columns a = (m0, m4, m8), b = (m1, m5, m9), c = (m2, m6, m10):
+		// n' = x (b x c) + y (c x a) + z (a x b)
+		const V bc0 = vsub(vmul(m5, m10), vmul(m9, m6)), bc1 = vsub(vmul(m9, m2), vmul(m1, m10)), bc2 = vsub(vmul(m1, m6), vmul(m5, m2));
+		const V ca0 = vsub(vmul(m6, m8), vmul(m10, m4)), ca1 = vsub(vmul(m10, m0), vmul(m2, m8)), ca2 = vsub(vmul(m2, m4), vmul(m6, m0));
+		const V ab0 = vsub(vmul(m4, m9), vmul(m8, m5)), ab1 = vsub(vmul(m8, m1), vmul(m0, m9)), ab2 = vsub(vmul(m0, m5), vmul(m4, m1));
+		ox = vadd(vadd(vmul(bc0, x), vmul(ca0, y)), vmul(ab0, z));
+		oy = vadd(vadd(vmul(bc1, x), vmul(ca1, y)), vmul(ab1, z));
+		oz = vadd(vadd(vmul(bc2, x), vmul(ca2, y)), vmul(ab2, z));
+		const V inv = vrsqrt(vadd(vadd(vmul(ox, ox), vmul(oy, oy)), vmul(oz, oz)));
+		ox = vmul(ox, inv); oy = vmul(oy, inv); oz = vmul(oz, inv);
+	}
+};
+
+// palette entries of 4 lanes' joints, as components: each lane loads its
+// three rows, three transposes turn them into 12 registers
+static inline void fetchAffine4(const float *p_palette, const int32_t *p_joints, __m128 *c)
+{
+	const float *a = p_palette + SKIN_AFFINE * p_joints[0], *b = p_palette + SKIN_AFFINE * p_joints[1];
+	const float *d = p_palette + SKIN_AFFINE * p_joints[2], *e = p_palette + SKIN_AFFINE * p_joints[3];
+	for (int r = 0; r < 3; ++r)
+	{
+		__m128 r0 = _mm_load_ps(a + 4 * r), r1 = _mm_load_ps(b + 4 * r), r2 = _mm_load_ps(d + 4 * r), r3 = _mm_load_ps(e + 4 * r);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		c[4 * r] = r0; c[4 * r + 1] = r1; c[4 * r + 2] = r2; c[4 * r + 3] = r3;
+	}
+}
+
+// p_palette is laid out as SkinPalette::data
+inline void skinBlocks(const SkinningRest &p_rest, const float *p_palette, unsigned p_blockBegin, unsigned p_blockEnd, const SkinTarget &p_target)
+{
+	const bool normals = p_target.normals && p_rest.hasNormals;
+	const float *palette = p_palette;
+	for (unsigned b = p_blockBegin; b < p_blockEnd; ++b)
+	{
+		const size_t base = size_t(b) * SKIN_BLOCK;
+		const unsigned lanes = std::min<unsigned>(SKIN_BLOCK, p_rest.numVertices - (unsigned)base);
+		alignas(32) float out[6][SKIN_BLOCK];
+
+#if defined(__AVX2__)
+		AffineLanes<Lanes8> m;
+		m.reset(_mm256_setzero_ps());
+		for (unsigned k = 0; k < p_rest.blockSlots[b]; ++k)
+		{
+			const size_t i = (size_t(b) * p_rest.slots + k) * SKIN_BLOCK;
+			__m256 c[SKIN_AFFINE];
+			if (p_rest.uniformSlots[b] & (1u << k))
+			{
+				const float *mat = palette + SKIN_AFFINE * p_rest.joints[i];
+				for (unsigned e = 0; e < SKIN_AFFINE; ++e) c[e] = _mm256_broadcast_ss(mat + e);
+			}
+			else
+			{
+				// joint * 12 as shifts
+				const __m256i joint = _mm256_loadu_si256((const __m256i *)&p_rest.joints[i]);
+				const __m256i j = _mm256_add_epi32(_mm256_slli_epi32(joint, 3), _mm256_slli_epi32(joint, 2));
+				for (unsigned e = 0; e < SKIN_AFFINE; ++e) c[e] = _mm256_i32gather_ps(palette + e, j, 4);
+			}
+			m.add(_mm256_loadu_ps(&p_rest.weights[i]), c);
+		}
+
+		__m256 ox, oy, oz;
+		m.transformPoint(_mm256_loadu_ps(&p_rest.px[base]), _mm256_loadu_ps(&p_rest.py[base]), _mm256_loadu_ps(&p_rest.pz[base]), ox, oy, oz);
+		_mm256_store_ps(out[0], ox);
+		_mm256_store_ps(out[1], oy);
+		_mm256_store_ps(out[2], oz);
+		if (normals)
+		{
+			m.transformNormal(_mm256_loadu_ps(&p_rest.nx[base]), _mm256_loadu_ps(&p_rest.ny[base]), _mm256_loadu_ps(&p_rest.nz[base]), ox, oy, oz);
+			_mm256_store_ps(out[3], ox);
+			_mm256_store_ps(out[4], oy);
+			_mm256_store_ps(out[5], oz);
+		}
+#else
+		for (unsigned h = 0; h < SKIN_BLOCK; h += 4)
+		{
+			AffineLanes<Lanes4> m;
+			m.reset(_mm_setzero_ps());
+			for (unsigned k = 0; k < p_rest.blockSlots[b]; ++k)
+			{
+				const size_t i = (size_t(b) * p_rest.slots + k) * SKIN_BLOCK + h;
+				__m128 c[SKIN_AFFINE];
+				if (p_rest.uniformSlots[b] & (1u << k))
+				{
+					const float *mat = palette + SKIN_AFFINE * p_rest.joints[i];
+					for (unsigned e = 0; e < SKIN_AFFINE; ++e) c[e] = _mm_set1_ps(mat[e]);
+				}
+				else
+				{
+					fetchAffine4(palette, &p_rest.joints[i], c);
+				}
+				m.add(_mm_loadu_ps(&p_rest.weights[i]), c);
+			}
+
+			__m128 ox, oy, oz;
+			m.transformPoint(_mm_loadu_ps(&p_rest.px[base + h]), _mm_loadu_ps(&p_rest.py[base + h]), _mm_loadu_ps(&p_rest.pz[base + h]), ox, oy, oz);
+			_mm_store_ps(out[0] + h, ox);
+			_mm_store_ps(out[1] + h, oy);
+			_mm_store_ps(out[2] + h, oz);
+			if (normals)
+			{
+				m.transformNormal(_mm_loadu_ps(&p_rest.nx[base + h]), _mm_loadu_ps(&p_rest.ny[base + h]), _mm_loadu_ps(&p_rest.nz[base + h]), ox, oy, oz);
+				_mm_store_ps(out[3] + h, ox);
+				_mm_store_ps(out[4] + h, oy);
+				_mm_store_ps(out[5] + h, oz);
+			}
+		}
+#endif
+
+		for (unsigned lane = 0; lane < lanes; ++lane)
+		{
+			float *dst = p_target.positions + (base + lane) * p_target.stride;
+			dst[0] = out[0][lane];
+			dst[1] = out[1][lane];
+			dst[2] = out[2][lane];
+			if (normals)
+			{
+				dst = p_target.normals + (base + lane) * p_target.stride;
+				dst[0] = out[3][lane];
+				dst[1] = out[4][lane];
+				dst[2] = out[5][lane];
+			}
+		}
+	}
+}
+
+// skins every vertex, blocks spread over the job system
+inline void skinVertices(JobSystem &p_jobs, const SkinningRest &p_rest, const SkinPalette &p_palette, const SkinTarget &p_target)
+{
+	const size_t blocksPerJob = 128;
+	p_jobs.parallelFor(p_rest.numBlocks, blocksPerJob, [&](size_t b0, size_t b1)
+	{
+		skinBlocks(p_rest, p_palette.data.data(), (unsigned)b0, (unsigned)b1, p_target);
+	});
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+// Sparse, vertex-major skinning weights.
+//
+// weights.dmat stores a dense [jointID][vertexID] matrix, but a vertex is
+// only influenced by a handful of joints. SkinWeights keeps at most
+// maxInfluences (4 or 8, never more than there are joints) (joint, weight)
+// pairs per vertex in one contiguous array, so the skinning loop reads each
+// vertex's influences from a single cache line instead of striding across
+// one heap array per joint.
+//
+// A pair is 4 bytes: the weight is stored in 16 bits, quantized so that the
+// weights of a vertex sum to exactly one. Weights are offered as floats and
+// only quantized by pruneAndNormalize().
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <eigen>
+#include "dmat.h"
+
+static const float SKIN_WEIGHT_ONE = 65535.0f;	// quantized weight of 1
+
+struct SkinInfluence
+{
+	uint16_t joint;
+	uint16_t quantized;		// weight * SKIN_WEIGHT_ONE
+
+	float weight() const { return quantized * (1.0f / SKIN_WEIGHT_ONE); }
+};
+
+class SkinWeights
+{
+public:
+	unsigned maxInfluences = 4;		// stride of the influence array
+	unsigned numVertices = 0;
+	unsigned numJoints = 0;
+	std::vector<SkinInfluence> influences;	// [vertexID * maxInfluences + k], sorted by weight
+	std::vector<uint8_t> counts;			// used influences per vertex
+
+	const SkinInfluence *vertexInfluences(unsigned p_vertex) const { return &influences[size_t(p_vertex) * maxInfluences]; }
+
+	float weight(unsigned p_vertex, unsigned p_joint) const
+	{
+		const SkinInfluence *inf = vertexInfluences(p_vertex);
+		for (unsigned k = 0; k < counts[p_vertex]; ++k)
+		{
+			if (inf[k].joint == p_joint) return inf[k].weight();
+		}
+		return 0.0f;
+	}
+
+	size_t memoryBytes() const { return influences.size() * sizeof(SkinInfluence) + counts.size(); }
+
+	// joint j becomes p_map[j], e.g. from .bf joint IDs to a compiled rig;
+	// the order by weight stays
+	void remapJoints(const std::vector<unsigned> &p_map)
+	{
+		for (SkinInfluence &inf : influences)
+		{
+			if (inf.joint < p_map.size()) inf.joint = (uint16_t)p_map[inf.joint];
+		}
+	}
+
+	void reset(unsigned p_numVertices, unsigned p_numJoints, unsigned p_maxInfluences)
+	{
+		numVertices = p_numVertices;
+		numJoints = p_numJoints;
+		maxInfluences = std::max(1u, std::min(p_maxInfluences, p_numJoints));
+		SkinInfluence empty = { 0, 0 };
+		influences.assign(size_t(numVertices) * maxInfluences, empty);
+		counts.assign(numVertices, 0);
+		offered.clear();
+	}
+
+	// Offers weight w of joint j to vertex v. Keeps the maxInfluences largest
+	// weights, so the dense matrix never has to be in memory at once.
+	void offer(unsigned v, unsigned j, float w)
+	{
+		if (w <= 0.0f) return;
+		if (offered.empty()) offered.assign(influences.size(), 0.0f);
+		SkinInfluence *inf = &influences[size_t(v) * maxInfluences];
+		float *weights = &offered[size_t(v) * maxInfluences];
+		unsigned n = counts[v];
+		if (n == maxInfluences)
+		{
+			if (w <= weights[n - 1]) return;
+			--n; // drop the smallest
+		}
+		// insertion into the descending list
+		unsigned k = n;
+		while (k > 0 && weights[k - 1] < w)
+		{
+			inf[k] = inf[k - 1];
+			weights[k] = weights[k - 1];
+			--k;
+		}
+		weights[k] = w;
+		inf[k].joint = (uint16_t)j;
+		counts[v] = (uint8_t)(n + 1);
+	}
+
+	// Drops influences below p_threshold, rescales the rest to sum to one and
+	// quantizes them. Vertices that would lose everything keep their largest
+	// influence.
+	void pruneAndNormalize(float p_threshold)
+	{
+		if (offered.empty()) offered.assign(influences.size(), 0.0f);
+		for (unsigned v = 0; v < numVertices; ++v)
+		{
+			SkinInfluence *inf = &influences[size_t(v) * maxInfluences];
+			const float *weights = &offered[size_t(v) * maxInfluences];
+			unsigned n = counts[v];
+			while (n > 1 && weights[n - 1] < p_threshold) --n;
+			float sum = 0.0f;
+			for (unsigned k = 0; k < n; ++k) sum += weights[k];
+			// rounding leftovers go to the largest weight, so the sum stays one
+			int total = 0;
+			for (unsigned k = 0; k < maxInfluences; ++k)
+			{
+				if (k < n && sum > 0.0f) inf[k].quantized = (uint16_t)std::lround(weights[k] / sum * SKIN_WEIGHT_ONE);
+				else inf[k] = SkinInfluence{ k < n ? inf[k].joint : (uint16_t)0, 0 };
+				total += inf[k].quantized;
+			}
+			if (n > 0 && sum > 0.0f) inf[0].quantized = (uint16_t)(inf[0].quantized + (int)SKIN_WEIGHT_ONE - total);
+			counts[v] = (uint8_t)n;
+		}
+		std::vector<float>().swap(offered);
+	}
+
+private:
+	std::vector<float> offered;		// [vertexID * maxInfluences + k] float weights until pruneAndNormalize()
+};
+
+// Turns a dense dmat-layout matrix (one column of p_rows vertex weights per
+// joint) into the sparse form.
+inline void buildSkinWeights(const float *p_dense, unsigned p_cols, unsigned p_rows, unsigned p_maxInfluences, float p_pruneThreshold, SkinWeights &p_weights)
+{
+	p_weights.reset(p_rows, p_cols, p_maxInfluences);
+	for (unsigned j = 0; j < p_cols; ++j)
+	{
+		const float *w = p_dense + size_t(j) * p_rows;
+		for (unsigned v = 0; v < p_rows; ++v) p_weights.offer(v, j, w[v]);
+	}
+	p_weights.pruneAndNormalize(p_pruneThreshold);
+
+	std::cout << "Skin weights: " << p_rows << " vertices, " << p_cols << " joints, up to " << p_weights.maxInfluences
+		<< " influences, " << (p_weights.memoryBytes() >> 10) << " KB (dense: "
+		<< ((size_t(p_rows) * p_cols * sizeof(float)) >> 10) << " KB)" << std::endl;
+}
+
+// Loads weights.dmat (see dmat.h) straight into the sparse form.
+inline bool loadSkinWeights(const std::string &p_fname, unsigned p_maxInfluences, float p_pruneThreshold, SkinWeights &p_weights)
+{
+	DMat dense;
+	if (!dense.load(p_fname)) return false;
+	buildSkinWeights(dense.data(), dense.cols, dense.rows, p_maxInfluences, p_pruneThreshold, p_weights);
+	return true;
+}
+
+// The bones used to bind vertices when there are no weights: every joint
+// owns the segments to its children, or just its position for a leaf.
+class JointBones
+{
+public:
+	JointBones(const std::vector<Eigen::Vector3f> &p_jointPositions, const std::vector<int> &p_jointParent)
+		: positions(p_jointPositions), children(p_jointPositions.size())
+	{
+		for (unsigned j = 0; j < positions.size(); ++j)
+		{
+			if (p_jointParent[j] >= 0) children[p_jointParent[j]].push_back(j);
+		}
+	}
+
+	unsigned numJoints() const { return (unsigned)positions.size(); }
+
+	// squared distance from p_x to the nearest bone of joint p_joint
+	float squaredDistance(const Eigen::Vector3f &p_x, unsigned p_joint) const
+	{
+		const Eigen::Vector3f &a = positions[p_joint];
+		float d2 = (p_x - a).squaredNorm();
+		for (unsigned c : children[p_joint])
+		{
+			const Eigen::Vector3f ab = positions[c] - a;
+			const float len2 = ab.squaredNorm();
+			const float t = len2 > 0.0f ? std::min(std::max((p_x - a).dot(ab) / len2, 0.0f), 1.0f) : 0.0f;
+			d2 = std::min(d2, (p_x - (a + t * ab)).squaredNorm());
+		}
+		return d2;
+	}
+
+private:
+	std::vector<Eigen::Vector3f> positions;
+	std::vector<std::vector<unsigned> > children;
+};
+
+// Quick fallback: a vertex is weighted by 1 / d^4 to the joints' nearest
+// bones. Crude next to real weights, but it deforms plausibly and keeps a
+// mesh usable.
+inline void computeProximityWeights(const std::vector<Eigen::Vector3f> &p_vertices, const JointBones &p_bones,
+	unsigned p_maxInfluences, float p_pruneThreshold, SkinWeights &p_weights)
+{
+	const unsigned numJoints = p_bones.numJoints();
+	p_weights.reset((unsigned)p_vertices.size(), numJoints, p_maxInfluences);
+	for (unsigned v = 0; v < p_vertices.size(); ++v)
+	{
+		for (unsigned j = 0; j < numJoints; ++j)
+		{
+			const float d2 = p_bones.squaredDistance(p_vertices[v], j);
+			p_weights.offer(v, j, 1.0f / (d2 * d2 + 1e-12f));
+		}
+	}
+	p_weights.pruneAndNormalize(p_pruneThreshold);
+
+	std::cout << "Skin weights: " << p_vertices.size() << " vertices, " << numJoints << " joints, proximity fallback, up to "
+		<< p_weights.maxInfluences << " influences, " << (p_weights.memoryBytes() >> 10) << " KB" << std::endl;
+}
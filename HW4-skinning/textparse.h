@@ -0,0 +1,87 @@
+#pragma once
+
+// Number parsing for the text loaders (OBJ, dmat).
+//
+// The files are parsed out of a memory mapping, so these work on
+// [p, end) ranges that are not 0-terminated and advance p past what they
+// read. No locale, no stream state.
+
+#include <cmath>
+#include <cstdint>
+
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) ++p;
+	return p;
+}
+
+static inline const char *skipLine(const char *p, const char *end)
+{
+	while (p < end && *p != '\n') ++p;
+	return p < end ? p + 1 : p;
+}
+
+static inline bool isDigit(char c) { return unsigned(c - '0') < 10; }
+
+// [+-]digits[.digits][(e|E)[+-]digits]; up to 19 significant digits are
+// kept and the result is rounded once, from double
+static inline float parseFloat(const char *&p, const char *end)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	p = skipBlanks(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	for (; p < end && isDigit(*p); ++p)
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + unsigned(*p - '0');
+			if (mantissa) ++digits;
+		}
+		else
+		{
+			++exponent;
+		}
+	}
+	if (p < end && *p == '.')
+	{
+		for (++p; p < end && isDigit(*p); ++p)
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + unsigned(*p - '0');
+				if (mantissa) ++digits;
+				--exponent;
+			}
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negativeExponent = false;
+		if (p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+		int e = 0;
+		for (; p < end && isDigit(*p); ++p)
+		{
+			if (e < 10000) e = e * 10 + (*p - '0');
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	double value = (double)mantissa;
+	if (exponent < 0) value = exponent >= -22 ? value / powers[-exponent] : value * std::pow(10.0, exponent);
+	else if (exponent > 0) value = exponent <= 22 ? value * powers[exponent] : value * std::pow(10.0, exponent);
+	return float(negative ? -value : value);
+}
+
+// spaces, tabs and line breaks
+static inline const char *skipWhitespace(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+	return p;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Pinhole camera. With yaw = pitch = 0 it is the original fixed camera at
+// origin looking down -z, so rays through (rayX, rayY, -1) are unchanged.
+
+#include <cmath>
+#include "float3.h"
+
+struct Camera
+{
+	float3 origin;
+	float yaw = 0.0f;		// radians, around +y
+	float pitch = 0.0f;		// radians, around the camera x axis
+	float fov = 30.0f;		// vertical, degrees
+
+	float3 right = float3(1, 0, 0);
+	float3 up = float3(0, 1, 0);
+	float3 forward = float3(0, 0, -1);
+
+	// recomputes the basis after yaw/pitch changed
+	void update()
+	{
+		const float cy = std::cos(yaw), sy = std::sin(yaw);
+		const float cp = std::cos(pitch), sp = std::sin(pitch);
+		forward = float3(-sy * cp, sp, -cy * cp);
+		right = float3(cy, 0, -sy);
+		up = cross(right, forward);
+	}
+
+	// direction through the image plane point (rayX, rayY) at distance 1
+	float3 direction(float rayX, float rayY) const
+	{
+		return normalize(rayX * right + rayY * up + forward);
+	}
+};
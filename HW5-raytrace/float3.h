@@ -0,0 +1,194 @@
+#pragma once
+
+// Compact SSE vector math for the tracer hot loops.
+// Eigen 3.2 only vectorizes 4-float types, so every Vector3f temporary in
+// intersect()/trace() is scalar code. float3 keeps xyz in one SSE register
+// (w is kept at zero) and float4 holds four independent lanes for the SoA
+// batch kernels. Setup code keeps using Eigen and converts once.
+
+#include <cmath>
+#include <vector>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#if defined(__AVX__) || defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#include <Eigen>
+
+#ifdef _MSC_VER
+#define RT_INLINE __forceinline
+#else
+#define RT_INLINE inline __attribute__((always_inline))
+#endif
+
+struct float3
+{
+	__m128 v;
+
+	RT_INLINE float3() : v(_mm_setzero_ps()) {}
+	RT_INLINE explicit float3(__m128 p_v) : v(p_v) {}
+	RT_INLINE float3(float x, float y, float z) : v(_mm_set_ps(0.0f, z, y, x)) {}
+	RT_INLINE explicit float3(float s) : v(_mm_set_ps(0.0f, s, s, s)) {}
+	RT_INLINE float3(const Eigen::Vector3f &e) : v(_mm_set_ps(0.0f, e(2), e(1), e(0))) {}
+
+	RT_INLINE float x() const { return _mm_cvtss_f32(v); }
+	RT_INLINE float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+	RT_INLINE float z() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+	RT_INLINE float operator[](int i) const { alignas(16) float f[4]; _mm_store_ps(f, v); return f[i]; }
+
+	RT_INLINE Eigen::Vector3f toEigen() const { alignas(16) float f[4]; _mm_store_ps(f, v); return Eigen::Vector3f(f[0], f[1], f[2]); }
+
+	RT_INLINE static float3 zero() { return float3(); }
+	RT_INLINE static float3 ones() { return float3(1.0f); }
+
+	RT_INLINE float3 &operator+=(const float3 &b) { v = _mm_add_ps(v, b.v); return *this; }
+	RT_INLINE float3 &operator-=(const float3 &b) { v = _mm_sub_ps(v, b.v); return *this; }
+	RT_INLINE float3 &operator*=(float s) { v = _mm_mul_ps(v, _mm_set1_ps(s)); return *this; }
+};
+
+RT_INLINE float3 operator+(const float3 &a, const float3 &b) { return float3(_mm_add_ps(a.v, b.v)); }
+RT_INLINE float3 operator-(const float3 &a, const float3 &b) { return float3(_mm_sub_ps(a.v, b.v)); }
+RT_INLINE float3 operator-(const float3 &a) { return float3(_mm_sub_ps(_mm_setzero_ps(), a.v)); }
+RT_INLINE float3 operator*(const float3 &a, const float3 &b) { return float3(_mm_mul_ps(a.v, b.v)); }
+RT_INLINE float3 operator*(const float3 &a, float s) { return float3(_mm_mul_ps(a.v, _mm_set1_ps(s))); }
+RT_INLINE float3 operator*(float s, const float3 &a) { return float3(_mm_mul_ps(a.v, _mm_set1_ps(s))); }
+
+RT_INLINE float dot(const float3 &a, const float3 &b)
+{
+#if defined(__AVX__) || defined(__SSE4_1__)
+	return _mm_cvtss_f32(_mm_dp_ps(a.v, b.v, 0x71));
+#else
+	__m128 m = _mm_mul_ps(a.v, b.v);
+	__m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+	return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+#endif
+}
+
+RT_INLINE float3 cross(const float3 &a, const float3 &b)
+{
+	__m128 a1 = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 b1 = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a.v, b1), _mm_mul_ps(a1, b.v));
+	return float3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+RT_INLINE float length(const float3 &a) { return std::sqrt(dot(a, a)); }
+
+RT_INLINE float3 normalize(const float3 &a)
+{
+	const float n2 = dot(a, a);
+	if (n2 <= 0.0f) return a;
+	return a * (1.0f / std::sqrt(n2));
+}
+
+RT_INLINE float3 min(const float3 &a, const float3 &b) { return float3(_mm_min_ps(a.v, b.v)); }
+RT_INLINE float3 max(const float3 &a, const float3 &b) { return float3(_mm_max_ps(a.v, b.v)); }
+
+// ----------------------------------------------------------------------------
+
+// four independent lanes, used by the SoA kernels
+struct float4
+{
+	__m128 v;
+
+	RT_INLINE float4() : v(_mm_setzero_ps()) {}
+	RT_INLINE float4(__m128 p_v) : v(p_v) {}
+	RT_INLINE explicit float4(float s) : v(_mm_set1_ps(s)) {}
+	RT_INLINE static float4 load(const float *p) { return float4(_mm_load_ps(p)); }
+	RT_INLINE void store(float *p) const { _mm_store_ps(p, v); }
+};
+
+RT_INLINE float4 operator+(const float4 &a, const float4 &b) { return _mm_add_ps(a.v, b.v); }
+RT_INLINE float4 operator-(const float4 &a, const float4 &b) { return _mm_sub_ps(a.v, b.v); }
+RT_INLINE float4 operator*(const float4 &a, const float4 &b) { return _mm_mul_ps(a.v, b.v); }
+RT_INLINE float4 operator<(const float4 &a, const float4 &b) { return _mm_cmplt_ps(a.v, b.v); }
+RT_INLINE float4 operator<=(const float4 &a, const float4 &b) { return _mm_cmple_ps(a.v, b.v); }
+RT_INLINE float4 operator&(const float4 &a, const float4 &b) { return _mm_and_ps(a.v, b.v); }
+RT_INLINE float4 sqrt(const float4 &a) { return _mm_sqrt_ps(a.v); }
+RT_INLINE int movemask(const float4 &a) { return _mm_movemask_ps(a.v); }
+
+// ----------------------------------------------------------------------------
+
+// Sphere centers and radii in SoA layout, padded to a multiple of 4 with
+// spheres that can never be hit (radius^2 = -1).
+struct SphereSoA
+{
+	std::vector<float, Eigen::aligned_allocator<float> > cx, cy, cz, r2;
+	int count = 0;
+
+	void clear() { cx.clear(); cy.clear(); cz.clear(); r2.clear(); count = 0; }
+
+	void push(const float3 &c, float r)
+	{
+		const int n = count++;
+		const size_t padded = (size_t(count) + 3) & ~size_t(3);
+		cx.resize(padded, 0.0f); cy.resize(padded, 0.0f); cz.resize(padded, 0.0f); r2.resize(padded, -1.0f);
+		cx[n] = c.x(); cy[n] = c.y(); cz[n] = c.z(); r2[n] = r * r;
+	}
+};
+
+// Line vs. sphere test for four spheres at once, same rules as
+// Sphere::intersect (tca >= 0, d2 <= r^2). Returns a lane mask and t0.
+RT_INLINE int intersect4(const SphereSoA &s, int i,
+	const float4 &ox, const float4 &oy, const float4 &oz,
+	const float4 &dx, const float4 &dy, const float4 &dz, float4 &t0)
+{
+	const float4 lx = float4::load(&s.cx[i]) - ox;
+	const float4 ly = float4::load(&s.cy[i]) - oy;
+	const float4 lz = float4::load(&s.cz[i]) - oz;
+	const float4 r2 = float4::load(&s.r2[i]);
+	const float4 tca = lx * dx + ly * dy + lz * dz;
+	const float4 d2 = lx * lx + ly * ly + lz * lz - tca * tca;
+	const float4 hit = (float4(0.0f) <= tca) & (d2 <= r2);
+	t0 = tca - sqrt(_mm_max_ps((r2 - d2).v, _mm_setzero_ps()));
+	return movemask(hit);
+}
+
+// nearest sphere along the line, -1 when nothing is hit.
+// Ties resolve to the lowest index, like the scalar loop in findSphere().
+inline int intersectNearest(const SphereSoA &s, const float3 &o, const float3 &d, float &tNear)
+{
+	const float4 ox(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(0, 0, 0, 0)));
+	const float4 oy(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(1, 1, 1, 1)));
+	const float4 oz(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(2, 2, 2, 2)));
+	const float4 dx(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(0, 0, 0, 0)));
+	const float4 dy(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(1, 1, 1, 1)));
+	const float4 dz(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(2, 2, 2, 2)));
+
+	int best = -1;
+	for (int i = 0; i < s.count; i += 4)
+	{
+		float4 t0;
+		int mask = intersect4(s, i, ox, oy, oz, dx, dy, dz, t0);
+		if (!mask) continue;
+		alignas(16) float t[4];
+		t0.store(t);
+		for (int k = 0; k < 4; ++k)
+		{
+			if ((mask >> k) & 1)
+			{
+				if (best < 0 || t[k] < tNear) { best = i + k; tNear = t[k]; }
+			}
+		}
+	}
+	return best;
+}
+
+// true if the line hits any sphere (shadow rays)
+inline bool intersectAny(const SphereSoA &s, const float3 &o, const float3 &d)
+{
+	const float4 ox(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(0, 0, 0, 0)));
+	const float4 oy(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(1, 1, 1, 1)));
+	const float4 oz(_mm_shuffle_ps(o.v, o.v, _MM_SHUFFLE(2, 2, 2, 2)));
+	const float4 dx(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(0, 0, 0, 0)));
+	const float4 dy(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(1, 1, 1, 1)));
+	const float4 dz(_mm_shuffle_ps(d.v, d.v, _MM_SHUFFLE(2, 2, 2, 2)));
+
+	for (int i = 0; i < s.count; i += 4)
+	{
+		float4 t0;
+		if (intersect4(s, i, ox, oy, oz, dx, dy, dz, t0)) return true;
+	}
+	return false;
+}
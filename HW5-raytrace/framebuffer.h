@@ -0,0 +1,185 @@
+#pragma once
+
+// Linear-light HDR framebuffer and the 8-bit resolve pass.
+//
+// trace() results are accumulated unclamped into float planes (one per
+// channel, rows padded to a multiple of 4). resolve() averages the
+// accumulated passes, applies exposure and a tone mapping operator, encodes
+// to sRGB and quantizes with a 4x4 ordered dither, four pixels per SSE
+// operation and rows spread over all cores.
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#include <Eigen>
+#include "float3.h"
+#include "parallel.h"
+
+enum class ToneMap
+{
+	Legacy,		// old output: clamp to 1 and truncate, no sRGB, no dither
+	Clamp,
+	Reinhard,
+	ACES		// Narkowicz's fit of the ACES filmic curve
+};
+
+struct ToneMapSettings
+{
+	ToneMap op = ToneMap::ACES;
+	float exposure = 1.0f;
+	bool dither = true;
+};
+
+inline bool parseToneMap(const std::string &p_name, ToneMap &p_op)
+{
+	if (p_name == "legacy") p_op = ToneMap::Legacy;
+	else if (p_name == "clamp") p_op = ToneMap::Clamp;
+	else if (p_name == "reinhard") p_op = ToneMap::Reinhard;
+	else if (p_name == "aces") p_op = ToneMap::ACES;
+	else return false;
+	return true;
+}
+
+class HDRFramebuffer
+{
+public:
+	HDRFramebuffer(unsigned p_width, unsigned p_height) { resize(p_width, p_height); }
+
+	void resize(unsigned p_width, unsigned p_height)
+	{
+		width = p_width;
+		height = p_height;
+		stride = (p_width + 3) & ~3u;
+		for (int c = 0; c < 3; ++c) planes[c].assign(size_t(stride) * height, 0.0f);
+		passes = 0;
+	}
+
+	void clear()
+	{
+		for (int c = 0; c < 3; ++c) std::fill(planes[c].begin(), planes[c].end(), 0.0f);
+		passes = 0;
+	}
+
+	// adds one sample to pixel (x, y); call endPass() once every pixel got one
+	RT_INLINE void accumulate(unsigned x, unsigned y, const float3 &c)
+	{
+		const size_t i = size_t(y) * stride + x;
+		planes[0][i] += c.x();
+		planes[1][i] += c.y();
+		planes[2][i] += c.z();
+	}
+
+	void endPass() { ++passes; }
+
+	unsigned getWidth() const { return width; }
+	unsigned getHeight() const { return height; }
+	unsigned getPasses() const { return passes; }
+
+	// tone maps the average of all passes into packed RGB8 (width * height * 3)
+	void resolve(const ToneMapSettings &p_settings, std::vector<uint8_t> &p_rgb) const
+	{
+		p_rgb.resize(size_t(width) * height * 3);
+		resolveRows(p_settings, p_rgb.data(), width * 3, 0, height, false);
+	}
+
+	// same, into rows of p_pitch bytes ordered bottom-up if p_flip (OpenGL)
+	void resolveRows(const ToneMapSettings &p_settings, uint8_t *p_dst, size_t p_pitch, unsigned p_y0, unsigned p_y1, bool p_flip) const
+	{
+		const float scale = p_settings.exposure / float(passes ? passes : 1);
+		parallelFor((int)p_y0, (int)p_y1, [&](int y)
+		{
+			uint8_t *row = p_dst + size_t(p_flip ? height - 1 - y : y) * p_pitch;
+			resolveRow(p_settings, scale, (unsigned)y, row);
+		}, 8);
+	}
+
+	bool savePPM(const std::string &p_path, const ToneMapSettings &p_settings) const
+	{
+		std::vector<uint8_t> rgb;
+		resolve(p_settings, rgb);
+		std::ofstream ofs(p_path.c_str(), std::ios::out | std::ios::binary);
+		if (!ofs.is_open()) return false;
+		ofs << "P6\n" << width << " " << height << "\n255\n";
+		ofs.write((const char *)rgb.data(), rgb.size());
+		return true;
+	}
+
+private:
+	static RT_INLINE __m128 toneMap(ToneMap p_op, __m128 x)
+	{
+		const __m128 one = _mm_set1_ps(1.0f);
+		switch (p_op)
+		{
+		case ToneMap::Reinhard:
+			return _mm_div_ps(x, _mm_add_ps(one, x));
+		case ToneMap::ACES:
+		{
+			// x(2.51x + 0.03) / (x(2.43x + 0.59) + 0.14)
+			const __m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+			const __m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+			return _mm_min_ps(_mm_div_ps(num, den), one);
+		}
+		default:
+			return _mm_min_ps(x, one);
+		}
+	}
+
+	// linear -> sRGB. The power segment uses a sqrt-chain approximation
+	// (max error well below one 8-bit step) instead of a scalar pow().
+	static RT_INLINE __m128 encodeSRGB(__m128 x)
+	{
+		const __m128 s1 = _mm_sqrt_ps(x);
+		const __m128 s2 = _mm_sqrt_ps(s1);
+		const __m128 s3 = _mm_sqrt_ps(s2);
+		const __m128 curve = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(s1, _mm_set1_ps(0.585122381f)), _mm_mul_ps(s2, _mm_set1_ps(0.783140355f))), _mm_mul_ps(s3, _mm_set1_ps(0.368262736f)));
+		const __m128 linear = _mm_mul_ps(x, _mm_set1_ps(12.92f));
+		const __m128 small = _mm_cmplt_ps(x, _mm_set1_ps(0.0031308f));
+		return _mm_or_ps(_mm_and_ps(small, linear), _mm_andnot_ps(small, curve));
+	}
+
+	void resolveRow(const ToneMapSettings &p_settings, float p_scale, unsigned y, uint8_t *p_out) const
+	{
+		// 4x4 Bayer matrix, centered on zero, in units of one 8-bit step
+		static const float bayer[4][4] = {
+			{ 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 } };
+		const bool legacy = p_settings.op == ToneMap::Legacy;
+		const __m128 ditherRow = (p_settings.dither && !legacy)
+			? _mm_set_ps((bayer[y & 3][3] + 0.5f) / 16.0f - 0.5f, (bayer[y & 3][2] + 0.5f) / 16.0f - 0.5f, (bayer[y & 3][1] + 0.5f) / 16.0f - 0.5f, (bayer[y & 3][0] + 0.5f) / 16.0f - 0.5f)
+			: _mm_setzero_ps();
+		// legacy truncates, the others round to nearest
+		const __m128 bias = legacy ? _mm_setzero_ps() : _mm_set1_ps(0.5f);
+		const __m128 scale = _mm_set1_ps(p_scale);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 full = _mm_set1_ps(255.0f);
+
+		const size_t base = size_t(y) * stride;
+		for (unsigned x = 0; x < width; x += 4)
+		{
+			alignas(16) int32_t q[3][4];
+			for (int c = 0; c < 3; ++c)
+			{
+				__m128 v = _mm_max_ps(_mm_mul_ps(_mm_load_ps(&planes[c][base + x]), scale), zero);
+				v = toneMap(p_settings.op, v);
+				if (!legacy) v = encodeSRGB(v);
+				v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v, full), ditherRow), bias);
+				v = _mm_min_ps(_mm_max_ps(v, zero), full);
+				_mm_store_si128((__m128i *)q[c], _mm_cvttps_epi32(v));
+			}
+			const unsigned n = std::min(4u, width - x);
+			for (unsigned k = 0; k < n; ++k)
+			{
+				p_out[3 * (x + k) + 0] = (uint8_t)q[0][k];
+				p_out[3 * (x + k) + 1] = (uint8_t)q[1][k];
+				p_out[3 * (x + k) + 2] = (uint8_t)q[2][k];
+			}
+		}
+	}
+
+	unsigned width = 0, height = 0, stride = 0;
+	unsigned passes = 0;
+	std::vector<float, Eigen::aligned_allocator<float> > planes[3];
+};
@@ -0,0 +1,475 @@
+#pragma once
+
+// Instanced geometry for the tracer.
+//
+// A Prototype holds the actual primitives (spheres and triangles) of one
+// object together with its own BVH (bottom level). An Instance only stores
+// the object-from-world transform and the prototype index, and a top level
+// BVH is built over the instance bounds. Rays are transformed into object
+// space per instance, so a forest of 10^6 copies of a 1k-primitive tree
+// costs memory for 10^6 transforms, not for 10^9 primitives.
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <Eigen>
+#include "float3.h"
+
+struct AABB
+{
+	float3 bmin, bmax;
+
+	AABB() : bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max()) {}
+	void grow(const float3 &p) { bmin = min(bmin, p); bmax = max(bmax, p); }
+	void grow(const AABB &b) { bmin = min(bmin, b.bmin); bmax = max(bmax, b.bmax); }
+	float3 center() const { return 0.5f * (bmin + bmax); }
+};
+
+// 32 bytes. Interior nodes have count == 0 and children first, first + 1;
+// leaves reference prims [first, first + count) of the index array.
+struct BVHNode
+{
+	float bmin[3];
+	uint32_t first;
+	float bmax[3];
+	uint32_t count;
+};
+
+// slab test, returns the entry distance in tNear
+RT_INLINE bool hitBox(const BVHNode &n, const float o[3], const float invD[3], float tmin, float tmax, float &tNear)
+{
+	for (int a = 0; a < 3; ++a)
+	{
+		float t0 = (n.bmin[a] - o[a]) * invD[a];
+		float t1 = (n.bmax[a] - o[a]) * invD[a];
+		if (t0 > t1) std::swap(t0, t1);
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+		if (tmax < tmin) return false;
+	}
+	tNear = tmin;
+	return true;
+}
+
+// median split on the largest centroid axis, shared by both levels
+class BVHBuilder
+{
+public:
+	BVHBuilder(const std::vector<AABB> &p_bounds, unsigned p_maxLeaf, std::vector<BVHNode> &p_nodes, std::vector<uint32_t> &p_order)
+		: bounds(p_bounds), maxLeaf(p_maxLeaf), nodes(p_nodes), order(p_order)
+	{
+		order.resize(bounds.size());
+		for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+		nodes.clear();
+		nodes.reserve(std::max<size_t>(1, 2 * bounds.size() / std::max(1u, maxLeaf) + 1));
+		nodes.push_back(BVHNode());
+		build(0, 0, (uint32_t)order.size());
+		nodes.shrink_to_fit();
+	}
+
+private:
+	void build(uint32_t p_node, uint32_t p_begin, uint32_t p_end)
+	{
+		AABB box, centroids;
+		for (uint32_t i = p_begin; i < p_end; ++i)
+		{
+			box.grow(bounds[order[i]]);
+			centroids.grow(bounds[order[i]].center());
+		}
+		BVHNode &node = nodes[p_node];
+		for (int a = 0; a < 3; ++a) { node.bmin[a] = box.bmin[a]; node.bmax[a] = box.bmax[a]; }
+
+		const float3 extent = centroids.bmax - centroids.bmin;
+		int axis = 0;
+		if (extent[1] > extent[axis]) axis = 1;
+		if (extent[2] > extent[axis]) axis = 2;
+
+		if (p_end - p_begin <= maxLeaf || extent[axis] <= 0.0f)
+		{
+			node.first = p_begin;
+			node.count = p_end - p_begin;
+			return;
+		}
+
+		const uint32_t mid = (p_begin + p_end) / 2;
+		std::nth_element(order.begin() + p_begin, order.begin() + mid, order.begin() + p_end,
+			[&](uint32_t a, uint32_t b) { return bounds[a].center()[axis] < bounds[b].center()[axis]; });
+
+		const uint32_t left = (uint32_t)nodes.size();
+		nodes.push_back(BVHNode());
+		nodes.push_back(BVHNode());
+		nodes[p_node].first = left;
+		nodes[p_node].count = 0;
+		build(left, p_begin, mid);
+		build(left + 1, mid, p_end);
+	}
+
+	const std::vector<AABB> &bounds;
+	unsigned maxLeaf;
+	std::vector<BVHNode> &nodes;
+	std::vector<uint32_t> &order;
+};
+
+// ----------------------------------------------------------------------------
+
+// shading data of the nearest hit, in world space
+struct SurfaceHit
+{
+	float t;
+	float3 N;
+	float3 color;
+	int texture;		// -1 for a flat color
+	float u, v;
+	float uvPerWorld;	// texture coordinate change per world unit, for mip selection
+};
+
+struct ProtoSphere
+{
+	float3 center;
+	float radius;
+	float3 color;
+	int texture;
+	float uvScale;
+};
+
+struct ProtoTriangle
+{
+	float3 v0, e1, e2;	// first vertex and edges
+	float3 normal;
+	float3 color;
+	float uv[6];
+	int texture;
+	float uvPerUnit;	// uv change per object-space unit
+};
+
+class Prototype
+{
+public:
+	void addSphere(const float3 &p_center, float p_radius, const float3 &p_color, int p_texture = -1, float p_uvScale = 1.0f)
+	{
+		ProtoSphere s;
+		s.center = p_center; s.radius = p_radius; s.color = p_color; s.texture = p_texture; s.uvScale = p_uvScale;
+		spheres.push_back(s);
+	}
+
+	void addTriangle(const float3 &p_a, const float3 &p_b, const float3 &p_c, const float3 &p_color,
+		const float p_uv[6] = nullptr, int p_texture = -1)
+	{
+		ProtoTriangle t;
+		t.v0 = p_a; t.e1 = p_b - p_a; t.e2 = p_c - p_a;
+		t.normal = normalize(cross(t.e1, t.e2));
+		t.color = p_color;
+		t.texture = p_texture;
+		static const float defaultUV[6] = { 0, 0, 1, 0, 0, 1 };
+		std::copy(p_uv ? p_uv : defaultUV, (p_uv ? p_uv : defaultUV) + 6, t.uv);
+		const float area = length(cross(t.e1, t.e2));
+		const float uvArea = std::fabs((t.uv[2] - t.uv[0]) * (t.uv[5] - t.uv[1]) - (t.uv[4] - t.uv[0]) * (t.uv[3] - t.uv[1]));
+		t.uvPerUnit = area > 0.0f ? std::sqrt(uvArea / area) : 0.0f;
+		triangles.push_back(t);
+	}
+
+	void build()
+	{
+		std::vector<AABB> primBounds;
+		for (auto &s : spheres)
+		{
+			AABB b;
+			b.grow(s.center - float3(s.radius));
+			b.grow(s.center + float3(s.radius));
+			primBounds.push_back(b);
+		}
+		for (auto &t : triangles)
+		{
+			AABB b;
+			b.grow(t.v0); b.grow(t.v0 + t.e1); b.grow(t.v0 + t.e2);
+			primBounds.push_back(b);
+		}
+		BVHBuilder(primBounds, 4, nodes, prims);
+		bounds = AABB();
+		for (auto &b : primBounds) bounds.grow(b);
+	}
+
+	size_t primitiveCount() const { return spheres.size() + triangles.size(); }
+
+	size_t memoryBytes() const
+	{
+		return spheres.size() * sizeof(ProtoSphere) + triangles.size() * sizeof(ProtoTriangle)
+			+ nodes.size() * sizeof(BVHNode) + prims.size() * sizeof(uint32_t);
+	}
+
+	// object-space ray (d need not be unit length); on a hit tmax is shortened
+	// and p_prim receives the primitive, p_b1/p_b2 the triangle barycentrics
+	bool intersect(const float3 &o, const float3 &d, float tmin, float &tmax, uint32_t &p_prim, float &p_b1, float &p_b2, bool p_any) const
+	{
+		if (prims.empty()) return false;
+		const float of[3] = { o.x(), o.y(), o.z() };
+		const float invD[3] = { 1.0f / d.x(), 1.0f / d.y(), 1.0f / d.z() };
+		uint32_t stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		bool found = false;
+		while (top > 0)
+		{
+			const BVHNode &node = nodes[stack[--top]];
+			float tNear;
+			if (!hitBox(node, of, invD, tmin, tmax, tNear)) continue;
+			if (node.count == 0)
+			{
+				stack[top++] = node.first;
+				stack[top++] = node.first + 1;
+				continue;
+			}
+			for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			{
+				const uint32_t prim = prims[i];
+				float b1 = 0.0f, b2 = 0.0f;
+				if (prim < spheres.size() ? intersectSphere(spheres[prim], o, d, tmin, tmax) : intersectTriangle(triangles[prim - spheres.size()], o, d, tmin, tmax, b1, b2))
+				{
+					found = true;
+					p_prim = prim; p_b1 = b1; p_b2 = b2;
+					if (p_any) return true;
+				}
+			}
+		}
+		return found;
+	}
+
+	// object-space normal, color and uv of a hit found by intersect()
+	void shade(uint32_t p_prim, const float3 &p_point, float p_b1, float p_b2, SurfaceHit &hit, float &p_uvPerUnit) const
+	{
+		if (p_prim < spheres.size())
+		{
+			const ProtoSphere &s = spheres[p_prim];
+			hit.N = (p_point - s.center) * (1.0f / s.radius);
+			hit.color = s.color;
+			hit.texture = s.texture;
+			hit.u = (0.5f + std::atan2(hit.N.z(), hit.N.x()) * float(0.5 / M_PI)) * s.uvScale;
+			hit.v = std::acos(std::min(std::max(hit.N.y(), -1.0f), 1.0f)) * float(1.0 / M_PI) * s.uvScale;
+			p_uvPerUnit = s.uvScale * float(1.0 / M_PI) / s.radius;
+		}
+		else
+		{
+			const ProtoTriangle &t = triangles[p_prim - spheres.size()];
+			const float b0 = 1.0f - p_b1 - p_b2;
+			hit.N = t.normal;
+			hit.color = t.color;
+			hit.texture = t.texture;
+			hit.u = b0 * t.uv[0] + p_b1 * t.uv[2] + p_b2 * t.uv[4];
+			hit.v = b0 * t.uv[1] + p_b1 * t.uv[3] + p_b2 * t.uv[5];
+			p_uvPerUnit = t.uvPerUnit;
+		}
+	}
+
+	AABB bounds;
+
+private:
+	static bool intersectSphere(const ProtoSphere &s, const float3 &o, const float3 &d, float tmin, float &tmax)
+	{
+		const float3 oc = o - s.center;
+		const float a = dot(d, d);
+		const float b = dot(oc, d);
+		const float c = dot(oc, oc) - s.radius * s.radius;
+		const float disc = b * b - a * c;
+		if (disc < 0.0f) return false;
+		const float sq = std::sqrt(disc);
+		float t = (-b - sq) / a;
+		if (t < tmin) t = (-b + sq) / a;
+		if (t < tmin || t > tmax) return false;
+		tmax = t;
+		return true;
+	}
+
+	// Moller-Trumbore, two sided
+	static bool intersectTriangle(const ProtoTriangle &tri, const float3 &o, const float3 &d, float tmin, float &tmax, float &b1, float &b2)
+	{
+		const float3 p = cross(d, tri.e2);
+		const float det = dot(tri.e1, p);
+		if (std::fabs(det) < 1e-12f) return false;
+		const float invDet = 1.0f / det;
+		const float3 s = o - tri.v0;
+		const float u = dot(s, p) * invDet;
+		if (u < 0.0f || u > 1.0f) return false;
+		const float3 q = cross(s, tri.e1);
+		const float v = dot(d, q) * invDet;
+		if (v < 0.0f || u + v > 1.0f) return false;
+		const float t = dot(tri.e2, q) * invDet;
+		if (t < tmin || t > tmax) return false;
+		tmax = t;
+		b1 = u;
+		b2 = v;
+		return true;
+	}
+
+	std::vector<ProtoSphere> spheres;
+	std::vector<ProtoTriangle> triangles;
+	std::vector<BVHNode> nodes;
+	std::vector<uint32_t> prims;
+};
+
+// ----------------------------------------------------------------------------
+
+// 52 bytes: row-major 3x4 object-from-world transform and the prototype
+struct Instance
+{
+	float inv[12];
+	uint32_t prototype;
+};
+
+class InstancedGeometry
+{
+public:
+	int addPrototype(const Prototype &p_prototype)
+	{
+		prototypes.push_back(p_prototype);
+		return (int)prototypes.size() - 1;
+	}
+
+	void addInstance(int p_prototype, const Eigen::Affine3f &p_worldFromObject)
+	{
+		const Eigen::Matrix4f inv = p_worldFromObject.inverse(Eigen::Affine).matrix();
+		Instance instance;
+		for (int r = 0; r < 3; ++r)
+			for (int c = 0; c < 4; ++c)
+				instance.inv[4 * r + c] = inv(r, c);
+		instance.prototype = (uint32_t)p_prototype;
+		instances.push_back(instance);
+
+		// world bounds of the transformed prototype box
+		const AABB &pb = prototypes[p_prototype].bounds;
+		AABB b;
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			const Eigen::Vector3f p((corner & 1) ? pb.bmax.x() : pb.bmin.x(), (corner & 2) ? pb.bmax.y() : pb.bmin.y(), (corner & 4) ? pb.bmax.z() : pb.bmin.z());
+			b.grow(float3(p_worldFromObject * p));
+		}
+		instanceBounds.push_back(b);
+	}
+
+	// builds the top level; instance bounds are only needed for the build
+	void build()
+	{
+		std::vector<uint32_t> order;
+		BVHBuilder(instanceBounds, 2, nodes, order);
+		std::vector<Instance> sorted(instances.size());
+		for (size_t i = 0; i < order.size(); ++i) sorted[i] = instances[order[i]];
+		instances.swap(sorted);
+		std::vector<AABB>().swap(instanceBounds);
+	}
+
+	bool empty() const { return instances.empty(); }
+
+	size_t prototypeBytes() const
+	{
+		size_t bytes = 0;
+		for (auto &p : prototypes) bytes += p.memoryBytes();
+		return bytes;
+	}
+	size_t instanceBytes() const { return instances.size() * sizeof(Instance) + nodes.size() * sizeof(BVHNode); }
+	size_t instanceCount() const { return instances.size(); }
+	size_t flattenedPrimitiveCount() const
+	{
+		size_t count = 0;
+		for (auto &i : instances) count += prototypes[i.prototype].primitiveCount();
+		return count;
+	}
+
+	// nearest hit along the world-space ray (d unit length) in (tmin, tmax)
+	bool intersect(const float3 &o, const float3 &d, float tmin, float tmax, SurfaceHit &hit) const
+	{
+		const Instance *best = nullptr;
+		uint32_t bestPrim = 0;
+		float b1 = 0, b2 = 0;
+		if (!traverse(o, d, tmin, tmax, false, best, bestPrim, b1, b2)) return false;
+
+		float3 lo, ld;
+		toObject(*best, o, d, lo, ld);
+		float uvPerUnit;
+		prototypes[best->prototype].shade(bestPrim, lo + tmax * ld, b1, b2, hit, uvPerUnit);
+
+		// normals transform with the inverse transpose
+		const float *m = best->inv;
+		const float3 n = hit.N;
+		hit.N = normalize(float3(m[0] * n.x() + m[4] * n.y() + m[8] * n.z(),
+			m[1] * n.x() + m[5] * n.y() + m[9] * n.z(),
+			m[2] * n.x() + m[6] * n.y() + m[10] * n.z()));
+		if (dot(hit.N, d) > 0.0f) hit.N = -hit.N;
+		hit.t = tmax;
+		hit.uvPerWorld = uvPerUnit * length(float3(m[0], m[4], m[8]));
+		return true;
+	}
+
+	bool occluded(const float3 &o, const float3 &d, float tmin, float tmax) const
+	{
+		const Instance *best = nullptr;
+		uint32_t prim;
+		float b1, b2;
+		return traverse(o, d, tmin, tmax, true, best, prim, b1, b2);
+	}
+
+private:
+	static RT_INLINE void toObject(const Instance &inst, const float3 &o, const float3 &d, float3 &lo, float3 &ld)
+	{
+		const float *m = inst.inv;
+		lo = float3(m[0] * o.x() + m[1] * o.y() + m[2] * o.z() + m[3],
+			m[4] * o.x() + m[5] * o.y() + m[6] * o.z() + m[7],
+			m[8] * o.x() + m[9] * o.y() + m[10] * o.z() + m[11]);
+		ld = float3(m[0] * d.x() + m[1] * d.y() + m[2] * d.z(),
+			m[4] * d.x() + m[5] * d.y() + m[6] * d.z(),
+			m[8] * d.x() + m[9] * d.y() + m[10] * d.z());
+	}
+
+	// The object-space direction is not renormalized, so t is the same in
+	// both spaces and tmax can be shared between instances.
+	bool traverse(const float3 &o, const float3 &d, float tmin, float &tmax, bool p_any,
+		const Instance *&p_best, uint32_t &p_prim, float &p_b1, float &p_b2) const
+	{
+		if (nodes.empty()) return false;
+		const float of[3] = { o.x(), o.y(), o.z() };
+		const float invD[3] = { 1.0f / d.x(), 1.0f / d.y(), 1.0f / d.z() };
+		uint32_t stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		bool found = false;
+		while (top > 0)
+		{
+			const BVHNode &node = nodes[stack[--top]];
+			float tNear;
+			if (!hitBox(node, of, invD, tmin, tmax, tNear)) continue;
+			if (node.count == 0)
+			{
+				// visit the nearer child first
+				float tl, tr;
+				const bool hl = hitBox(nodes[node.first], of, invD, tmin, tmax, tl);
+				const bool hr = hitBox(nodes[node.first + 1], of, invD, tmin, tmax, tr);
+				if (hl && hr)
+				{
+					stack[top++] = tl < tr ? node.first + 1 : node.first;
+					stack[top++] = tl < tr ? node.first : node.first + 1;
+				}
+				else if (hl) stack[top++] = node.first;
+				else if (hr) stack[top++] = node.first + 1;
+				continue;
+			}
+			for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			{
+				const Instance &inst = instances[i];
+				float3 lo, ld;
+				toObject(inst, o, d, lo, ld);
+				if (prototypes[inst.prototype].intersect(lo, ld, tmin, tmax, p_prim, p_b1, p_b2, p_any))
+				{
+					found = true;
+					p_best = &inst;
+					if (p_any) return true;
+				}
+			}
+		}
+		return found;
+	}
+
+	std::vector<Prototype> prototypes;
+	std::vector<Instance> instances;
+	std::vector<AABB> instanceBounds;
+	std::vector<BVHNode> nodes;
+};
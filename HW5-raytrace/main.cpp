@@ -7,7 +7,18 @@
 #include <cassert>
 #include <random>
 #include <algorithm>
+#include <limits>
+#include <chrono>
+#include <string>
 #include <Eigen>
+#include "float3.h"
+#include "texture.h"
+#include "instancing.h"
+#include "framebuffer.h"
+#include "camera.h"
+#ifndef RT_NO_VIEWER
+#include "viewer.h"
+#endif
 
 using namespace Eigen;
 
@@ -21,9 +32,11 @@ std::vector<Vector3f> lightPositions = { Vector3f(0.0, 140, 60)
 class Sphere
 {
 public:
-	Vector3f center;  // position of the sphere
+	float3 center;  // position of the sphere
 	float radius;  // sphere radius
-	Vector3f surfaceColor; // surface color
+	float3 surfaceColor; // surface color
+	int texture = -1;  // index into Scene::textures, -1 for a flat surfaceColor
+	float uvScale = 1.0f;  // texture repeats around the sphere
 	
   Sphere(
 		const Vector3f &c,
@@ -34,12 +47,12 @@ public:
 	}
 
     // line vs. sphere intersection (note: this is slightly different from ray vs. sphere intersection!)
-	bool intersect(const Vector3f &rayOrigin, const Vector3f &rayDirection, float &t0, float &t1) const
+	bool intersect(const float3 &rayOrigin, const float3 &rayDirection, float &t0, float &t1) const
 	{
-		Vector3f l = center - rayOrigin;
-		float tca = l.dot(rayDirection);
+		float3 l = center - rayOrigin;
+		float tca = dot(l, rayDirection);
 		if (tca < 0) return false;
-		float d2 = l.dot(l) - tca * tca;
+		float d2 = dot(l, l) - tca * tca;
 		if (d2 > (radius * radius)) return false;
         float thc = sqrt(radius * radius - d2);
 		t0 = tca - thc;
@@ -47,183 +60,348 @@ public:
 
 		return true;
 	}
+
+	// spherical uv of the surface point with unit normal N
+	void uv(const float3 &N, float &u, float &v) const
+	{
+		u = (0.5f + std::atan2(N.z(), N.x()) * float(0.5 / M_PI)) * uvScale;
+		v = (std::acos(std::min(std::max(N.y(), -1.0f), 1.0f)) * float(1.0 / M_PI)) * uvScale;
+	}
+};
+
+// everything trace() needs, converted from the Eigen setup data once per render
+struct Scene
+{
+	std::vector<Sphere> spheres;
+	SphereSoA soa;				// sphere centers/radii for the batch kernels
+	std::vector<float3> lights;
+	float3 background;
+	std::vector<const TiledTexture *> textures;
+	TextureCache *textureCache = nullptr;
+	const InstancedGeometry *instances = nullptr;	// optional instanced objects
+
+	Scene(const std::vector<Sphere> &p_spheres) : spheres(p_spheres), background(bgcolor)
+	{
+		for (auto &sphere : spheres) soa.push(sphere.center, sphere.radius);
+		for (auto &light : lightPositions) lights.push_back(float3(light));
+	}
 };
 
 // diffuse reflection model
-Vector3f diffuse(const Vector3f &L, // direction vector from the point on the surface towards a light source
-	const Vector3f &N, // normal at this point on the surface
-	const Vector3f &diffuseColor,
+float3 diffuse(const float3 &L, // direction vector from the point on the surface towards a light source
+	const float3 &N, // normal at this point on the surface
+	const float3 &diffuseColor,
 	const float kd // diffuse reflection constant
 	)
 {
-	Vector3f resColor = Vector3f::Zero();
-	resColor = 0.25 * kd * std::max(L.dot(N), 0.0f) * diffuseColor;
-	// TODO: implement diffuse shading model
-
-	return resColor;
+	return (0.25f * kd * std::max(dot(L, N), 0.0f)) * diffuseColor;
 }
 
 // Phong reflection model
-Vector3f phong(const Vector3f &L, // direction vector from the point on the surface towards a light source
-               const Vector3f &N, // normal at this point on the surface
-               const Vector3f &V, // direction pointing towards the viewer
-               const Vector3f &diffuseColor, 
-               const Vector3f &specularColor, 
+float3 phong(const float3 &L, // direction vector from the point on the surface towards a light source
+               const float3 &N, // normal at this point on the surface
+               const float3 &V, // direction pointing towards the viewer
+               const float3 &diffuseColor, 
+               const float3 &specularColor, 
                const float kd, // diffuse reflection constant
                const float ks, // specular reflection constant
                const float alpha) // shininess constant
 {
-	Vector3f Es;
-	Vector3f R;
-	Vector3f resColor = Vector3f::Zero();
-	Vector3f Ed = diffuse(L, N, diffuseColor, kd);
+	float3 Ed = diffuse(L, N, diffuseColor, kd);
 	//reflection ray
-	R = (2 * N) * (std::max(N.dot(L), 0.0f)) - L;
+	float3 R = (2.0f * std::max(dot(N, L), 0.0f)) * N - L;
 	//Specular lighting
-	Es = .25 * specularColor * ks * (pow (std::max(R.dot(V), 0.0f), alpha));
+	float3 Es = (0.25f * ks * std::pow(std::max(dot(R, V), 0.0f), alpha)) * specularColor;
 	return Ed + Es;
 }
 //
-Vector3f Lighting(Vector3f lightOrigin, Vector3f lightDirection, const std::vector<Sphere> &spheres, const Sphere &sphere, Vector3f invRayDirection) {
-	Vector3f reflection;
-	Vector3f rayIntersect;
-	Vector3f point;
-	Vector3f pixNormal;
-	float t0, t1;
-	//Loop through spheres to see if the light ray is blocked
-	for each(Sphere sphere in spheres) {
-		if (sphere.intersect(lightOrigin, lightDirection, t0, t1)) {
-			return 0 * sphere.surfaceColor;
-		}
+float3 Lighting(const float3 &lightOrigin, const float3 &lightDirection, const Scene &scene, const float3 &pixNormal, const float3 &albedo, const float3 &invRayDirection) {
+	//Check all spheres at once to see if the light ray is blocked
+	if (intersectAny(scene.soa, lightOrigin, lightDirection)) {
+		return float3::zero();
+	}
+	if (scene.instances && scene.instances->occluded(lightOrigin, lightDirection, 1e-3f, std::numeric_limits<float>::max())) {
+		return float3::zero();
 	}
-	//Normal of the pixIntersection
-	pixNormal = lightOrigin - sphere.center;
-	pixNormal.normalize();
 	//return .333 * sphere.surfaceColor; //Part 2
 	//return diffuse(lightDirection, pixNormal, sphere.surfaceColor, 1); //Part 3
-	return phong(lightDirection, pixNormal, invRayDirection, sphere.surfaceColor, Vector3f::Ones(), 1, 3, 100); //Part 3
-	
-	
+	return phong(lightDirection, pixNormal, invRayDirection, albedo, float3::ones(), 1, 3, 100); //Part 3
 }
-bool findSphere(const Vector3f &rayOrigin, const Vector3f &rayDirection, const std::vector<Sphere> &spheres, Sphere &sphere) {
-	float smol;
-	float t0, t1;
-	int sphereID = -1;
-	bool firstIntersect = true;
-	//find smallest t0 first thing the ray hits
-	for (int i = 0; i < spheres.size(); i++) {
-		if (spheres[i].intersect(rayOrigin, rayDirection, t0, t1)) {
-			if (firstIntersect) {
-				sphereID = i;
-				smol = t0;
-				firstIntersect = false;
-			}
-			else if (t0 < smol) {
-				sphereID = i;
-				smol = t0;
-			}
-		}
-	}
+//find smallest t0 first thing the ray hits. Returns the sphere index or -1.
+int findSphere(const float3 &rayOrigin, const float3 &rayDirection, const Scene &scene, float &t0) {
+	return intersectNearest(scene.soa, rayOrigin, rayDirection, t0);
+}
+//nearest surface among the scene spheres and the instanced objects
+bool findSurface(const float3 &rayOrigin, const float3 &rayDirection, const Scene &scene, SurfaceHit &hit) {
+	float t0;
+	float tmax = std::numeric_limits<float>::max();
+	const int sphereID = findSphere(rayOrigin, rayDirection, scene, t0);
 	if (sphereID >= 0) {
-		sphere = spheres[sphereID];
-		return true;
+		const Sphere &sphere = scene.spheres[sphereID];
+		hit.t = tmax = t0;
+		hit.N = normalize(rayOrigin + t0 * rayDirection - sphere.center);
+		hit.color = sphere.surfaceColor;
+		hit.texture = sphere.texture;
+		sphere.uv(hit.N, hit.u, hit.v);
+		hit.uvPerWorld = sphere.uvScale * float(1.0 / M_PI) / sphere.radius;
 	}
-	else {
-		return false;
+	if (scene.instances && scene.instances->intersect(rayOrigin, rayDirection, 1e-4f, tmax, hit)) {
+		return true;
 	}
+	return sphereID >= 0;
+}
+//surface color at a hit point. pixelWidth is the world-space width of the
+//pixel footprint there (ray differential), it selects the texture mip.
+float3 albedo(const Scene &scene, const SurfaceHit &hit, float pixelWidth) {
+	if (hit.texture < 0 || !scene.textureCache) return hit.color;
+	return hit.color * scene.textures[hit.texture]->sample(*scene.textureCache, hit.u, hit.v, pixelWidth * hit.uvPerWorld);
 }
-//This is a ray or line.
-Vector3f trace(
-	const Vector3f &rayOrigin,
-	const Vector3f &rayDirection,
-	const std::vector<Sphere> &spheres, int depth)
+//This is a ray or line. pixelSpread is the angle covered by one pixel,
+//0 samples the finest texture level.
+float3 trace(
+	const float3 &rayOrigin,
+	const float3 &rayDirection,
+	const Scene &scene, int depth, float pixelSpread = 0.0f)
 {
 	int maxDepth = 2;
-	bool isSpecular;
-	Sphere sphere(Vector3f::Zero(), 0, Vector3f::Zero());
-	Vector3f pixelColor = Vector3f::Zero();
-	Vector3f pixIntersection;
-	Vector3f lightDirection;
-	Vector3f pixNormal;
+	SurfaceHit hit;
+	float3 pixelColor = float3::zero();
 	//find smallest t0 first thing the ray hits
-	if (!findSphere(rayOrigin, rayDirection, spheres, sphere)) {
-		pixelColor = bgcolor;
+	if (!findSurface(rayOrigin, rayDirection, scene, hit)) {
+		pixelColor = scene.background;
 	}
 	//intersection found
 	else {
-		//t1 and t0. A formality
-		float t0, t1;
-		isSpecular = sphere.intersect(rayOrigin, rayDirection, t0, t1);
 		//find the pixel intersection
-		pixIntersection = rayOrigin + (t0 * rayDirection);
+		float3 pixIntersection = rayOrigin + (hit.t * rayDirection);
 		//Part 1
-		//return Vector3f(1, 0, 0);
+		//return float3(1, 0, 0);
 		//part 2
 		//return sphere.surfaceColor;
-		for each (Vector3f light in lightPositions) { //This for each must be commented to replicate part 1.
+		//footprint grows with distance and stretches at grazing angles
+		const float cosTheta = std::max(std::fabs(dot(hit.N, rayDirection)), 0.25f);
+		const float3 surfaceColor = albedo(scene, hit, hit.t * pixelSpread / cosTheta);
+		for (const float3 &light : scene.lights) { //This loop must be commented to replicate part 1.
 			//ray from the pixel intersection to the light source
-			lightDirection = (light - pixIntersection);
-			lightDirection.normalize();
+			float3 lightDirection = normalize(light - pixIntersection);
 			//phong + diffusion
-			pixelColor += Lighting(pixIntersection, lightDirection, spheres, sphere, -rayDirection);
+			pixelColor += Lighting(pixIntersection, lightDirection, scene, hit.N, surfaceColor, -rayDirection);
 		}
 		depth += 1;
 		if (depth < maxDepth) {
-			Vector3f N, L, R;
-			N = (pixIntersection - sphere.center);
-			N.normalize();
-			if (isSpecular) {
-				R = (2 * N) * (std::max(N.dot(lightDirection), 0.0f)) - lightDirection;
-				pixelColor += .333 * trace(rayOrigin, rayDirection, spheres, depth);
-			}
+			pixelColor += .333f * trace(rayOrigin, rayDirection, scene, depth, pixelSpread);
 		}
 	}
 	return pixelColor;
 }
 
-void render(const std::vector<Sphere> &spheres)
+// Traces one sample per pixel into image, at subpixel offset (jitterX, jitterY).
+// Rows run in parallel; a pass stops early once cancelled() returns true.
+template <class Cancel>
+void renderPass(const Scene &scene, const Camera &camera, HDRFramebuffer &image, float jitterX, float jitterY, const Cancel &cancelled)
 {
-  
 	int depth = 0; //Added for reflected rays
-  unsigned width = 640;
-  unsigned height = 480;
-  Vector3f *image = new Vector3f[width * height];
-  Vector3f *pixel = image;
+  unsigned width = image.getWidth();
+  unsigned height = image.getHeight();
   float invWidth  = 1 / float(width);
   float invHeight = 1 / float(height);
-  float fov = 30;
   float aspectratio = width / float(height);
-	float angle = tan(M_PI * 0.5f * fov / 180.f);
+	float angle = tan(M_PI * 0.5f * camera.fov / 180.f);
+	float pixelSpread = 2 * angle * invHeight; // ray differential of neighbouring pixels
 	
 	// Trace rays
-	for (unsigned y = 0; y < height; ++y) 
+	parallelFor(0, (int)height, [&](int y)
 	{
+		if (cancelled()) return;
 		for (unsigned x = 0; x < width; ++x) 
 		{
-			float rayX = (2 * ((x + 0.5f) * invWidth) - 1) * angle * aspectratio;
-			float rayY = (1 - 2 * ((y + 0.5f) * invHeight)) * angle;
-			Vector3f rayDirection(rayX, rayY, -1);
-			rayDirection.normalize();
-			*(pixel++) = trace(Vector3f::Zero(), rayDirection, spheres, depth);
+			float rayX = (2 * ((x + jitterX) * invWidth) - 1) * angle * aspectratio;
+			float rayY = (1 - 2 * ((y + jitterY) * invHeight)) * angle;
+			float3 rayDirection = camera.direction(rayX, rayY);
+			image.accumulate(x, y, trace(camera.origin, rayDirection, scene, depth, pixelSpread));
 		}
-	}
+	}, 4);
+}
+
+void render(const Scene &scene, const ToneMapSettings &toneMap)
+{
+  HDRFramebuffer image(640, 480);
+	Camera camera;
+	renderPass(scene, camera, image, 0.5f, 0.5f, [] { return false; });
+	image.endPass();
 	
-	// Save result to a PPM image
-	std::ofstream ofs("./render.ppm", std::ios::out | std::ios::binary);
-	ofs << "P6\n" << width << " " << height << "\n255\n";
-	for (unsigned i = 0; i < width * height; ++i) 
+	// Tone map and save result to a PPM image
+	image.savePPM("./render.ppm", toneMap);
+}
+
+// ----------------------------------------------------------------------------
+
+// reference line vs. sphere test on Eigen types, kept for the benchmark
+bool intersectEigen(const Vector3f &center, float radius, const Vector3f &rayOrigin, const Vector3f &rayDirection, float &t0)
+{
+	Vector3f l = center - rayOrigin;
+	float tca = l.dot(rayDirection);
+	if (tca < 0) return false;
+	float d2 = l.dot(l) - tca * tca;
+	if (d2 > (radius * radius)) return false;
+	t0 = tca - sqrt(radius * radius - d2);
+	return true;
+}
+
+// times the nearest-hit query for all primary rays with Eigen, scalar float3
+// and the SoA batch kernel, then a full render. Run with --bench.
+void benchmark(const Scene &scene, const ToneMapSettings &toneMap)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	const unsigned width = 640, height = 480, repeats = 20;
+	const float angle = tan(M_PI * 0.5f * 30 / 180.f);
+	const float aspectratio = width / float(height);
+	const std::vector<Sphere> &spheres = scene.spheres;
+
+	std::vector<Vector3f> eigenDirs;
+	std::vector<float3> dirs;
+	for (unsigned y = 0; y < height; ++y)
 	{
-		const float x = image[i](0);
-		const float y = image[i](1);
-		const float z = image[i](2);
+		for (unsigned x = 0; x < width; ++x)
+		{
+			float rayX = (2 * ((x + 0.5f) / width) - 1) * angle * aspectratio;
+			float rayY = (1 - 2 * ((y + 0.5f) / height)) * angle;
+			eigenDirs.push_back(Vector3f(rayX, rayY, -1).normalized());
+			dirs.push_back(float3(eigenDirs.back()));
+		}
+	}
+	std::vector<Vector3f> centers;
+	for (auto &sphere : spheres) centers.push_back(sphere.center.toEigen());
 
-		ofs << (unsigned char)(std::min(float(1), x) * 255) 
-			  << (unsigned char)(std::min(float(1), y) * 255) 
-			  << (unsigned char)(std::min(float(1), z) * 255);
+	const double rays = double(dirs.size()) * repeats;
+	int checksum = 0;
+
+	auto start = Clock::now();
+	for (unsigned r = 0; r < repeats; ++r)
+	{
+		for (auto &d : eigenDirs)
+		{
+			float smol = 0, t0;
+			int id = -1;
+			for (size_t i = 0; i < spheres.size(); i++)
+			{
+				if (intersectEigen(centers[i], spheres[i].radius, Vector3f::Zero(), d, t0) && (id < 0 || t0 < smol)) { id = int(i); smol = t0; }
+			}
+			checksum += id;
+		}
 	}
-	
-	ofs.close();
-	delete[] image;
+	double eigenMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	start = Clock::now();
+	for (unsigned r = 0; r < repeats; ++r)
+	{
+		for (auto &d : dirs)
+		{
+			float smol = 0, t0, t1;
+			int id = -1;
+			for (size_t i = 0; i < spheres.size(); i++)
+			{
+				if (spheres[i].intersect(float3::zero(), d, t0, t1) && (id < 0 || t0 < smol)) { id = int(i); smol = t0; }
+			}
+			checksum -= id;
+		}
+	}
+	double scalarMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	start = Clock::now();
+	for (unsigned r = 0; r < repeats; ++r)
+	{
+		for (auto &d : dirs)
+		{
+			float t0;
+			checksum += findSphere(float3::zero(), d, scene, t0);
+		}
+	}
+	double batchMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	start = Clock::now();
+	render(scene, toneMap);
+	double renderMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	HDRFramebuffer image(width, height);
+	for (unsigned y = 0; y < height; ++y)
+		for (unsigned x = 0; x < width; ++x)
+			image.accumulate(x, y, float3(x * 4.0f / width, y * 4.0f / height, 0.5f));
+	image.endPass();
+	std::vector<uint8_t> rgb;
+	start = Clock::now();
+	for (unsigned r = 0; r < repeats; ++r) image.resolve(toneMap, rgb);
+	double resolveMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / repeats;
+
+	std::cout << "nearest hit, " << spheres.size() << " spheres, " << dirs.size() << " rays x " << repeats << std::endl
+		<< "  Eigen Vector3f : " << eigenMs << " ms (" << rays / eigenMs / 1000.0 << " Mrays/s)" << std::endl
+		<< "  float3 scalar  : " << scalarMs << " ms (" << rays / scalarMs / 1000.0 << " Mrays/s)" << std::endl
+		<< "  SoA batch      : " << batchMs << " ms (" << rays / batchMs / 1000.0 << " Mrays/s)" << std::endl
+		<< "full render      : " << renderMs << " ms" << std::endl
+		<< "tone map resolve : " << resolveMs << " ms (" << workerCount() << " threads)" << std::endl
+		<< "(checksum " << checksum << ")" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+// a tree of ~1k primitives: a 16-sided trunk and a cone of leaf spheres
+Prototype makeTree()
+{
+	Prototype tree;
+	const int segments = 16;
+	const float trunkRadius = 0.15f, trunkHeight = 1.5f;
+	const float3 bark(0.45f, 0.30f, 0.18f);
+	for (int i = 0; i < segments; ++i)
+	{
+		const float a0 = float(2 * M_PI) * i / segments, a1 = float(2 * M_PI) * (i + 1) / segments;
+		const float3 p0(trunkRadius * std::cos(a0), 0, trunkRadius * std::sin(a0));
+		const float3 p1(trunkRadius * std::cos(a1), 0, trunkRadius * std::sin(a1));
+		const float3 up(0, trunkHeight, 0);
+		const float uvA[6] = { float(i) / segments, 0, float(i + 1) / segments, 0, float(i) / segments, 1 };
+		const float uvB[6] = { float(i + 1) / segments, 0, float(i + 1) / segments, 1, float(i) / segments, 1 };
+		tree.addTriangle(p0, p1, p0 + up, bark, uvA);
+		tree.addTriangle(p1, p1 + up, p0 + up, bark, uvB);
+	}
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (int i = 0; i < 1024 - 2 * segments; ++i)
+	{
+		const float h = unit(rng);
+		const float r = (1.0f - h) * 0.9f * std::sqrt(unit(rng));
+		const float a = float(2 * M_PI) * unit(rng);
+		const float3 green(0.15f + 0.1f * unit(rng), 0.45f + 0.25f * unit(rng), 0.15f);
+		tree.addSphere(float3(r * std::cos(a), trunkHeight + 2.5f * h, r * std::sin(a)), 0.12f, green);
+	}
+	tree.build();
+	return tree;
+}
+
+// p_count trees on a grid behind the spheres, standing on the floor sphere
+void buildForest(InstancedGeometry &p_forest, const Sphere &p_floor, size_t p_count)
+{
+	const int tree = p_forest.addPrototype(makeTree());
+	const int side = (int)std::ceil(std::sqrt(double(p_count)));
+	const float spacing = 1.5f;
+	const Vector3f floorCenter = p_floor.center.toEigen();
+	std::mt19937 rng(11);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (size_t i = 0; i < p_count; ++i)
+	{
+		const float x = (float(i % side) - 0.5f * side) * spacing + 0.5f * spacing * unit(rng);
+		const float z = -30.0f - float(i / side) * spacing + 0.5f * spacing * unit(rng);
+		const float dx = x - floorCenter(0), dz = z - floorCenter(2);
+		const float y = floorCenter(1) + std::sqrt(std::max(p_floor.radius * p_floor.radius - dx * dx - dz * dz, 0.0f));
+
+		Affine3f transform = Translation3f(x, y, z) * AngleAxisf(float(2 * M_PI) * unit(rng), Vector3f::UnitY()) * Scaling(0.7f + 0.6f * unit(rng));
+		p_forest.addInstance(tree, transform);
+	}
+	p_forest.build();
+
+	std::cout << "forest: " << p_forest.instanceCount() << " instances, " << p_forest.flattenedPrimitiveCount() << " primitives" << std::endl
+		<< "  prototype memory: " << (p_forest.prototypeBytes() >> 10) << " KB" << std::endl
+		<< "  instance + top level memory: " << (p_forest.instanceBytes() >> 20) << " MB ("
+		<< p_forest.instanceBytes() / std::max<size_t>(1, p_forest.instanceCount()) << " bytes per instance)" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -236,7 +414,97 @@ int main(int argc, char **argv)
 	spheres.push_back(Sphere(Vector3f(5.0, 0, -25), 3, Vector3f(.65, .77, 0.99)));
 	spheres.push_back(Sphere(Vector3f(-5.5, 0, -13), 3, Vector3f(.9, .9, .9)));
 
-	render(spheres);
+	bool bench = false;
+	std::string texturePath;
+	size_t cacheMB = 64;
+	size_t forestSize = 0;
+#ifndef RT_NO_VIEWER
+	bool view = false;
+#endif
+	ToneMapSettings toneMap;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--bench") bench = true;
+#ifndef RT_NO_VIEWER
+		else if (arg == "--view") view = true;
+#endif
+		else if (arg == "--texture" && i + 1 < argc) texturePath = argv[++i];
+		else if (arg == "--cache-mb" && i + 1 < argc) cacheMB = (size_t)std::atoi(argv[++i]);
+		else if (arg == "--forest" && i + 1 < argc) forestSize = (size_t)std::atoll(argv[++i]);
+		else if (arg == "--tonemap" && i + 1 < argc && parseToneMap(argv[i + 1], toneMap.op)) ++i;
+		else if (arg == "--exposure" && i + 1 < argc) toneMap.exposure = (float)std::atof(argv[++i]);
+		else if (arg == "--no-dither") toneMap.dither = false;
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--bench]";
+#ifndef RT_NO_VIEWER
+			std::cerr << " [--view]";
+#endif
+			std::cerr << " [--texture image.ppm] [--cache-mb N] [--forest N]"
+				<< " [--tonemap legacy|clamp|reinhard|aces] [--exposure E] [--no-dither]" << std::endl;
+			return 1;
+		}
+	}
+
+	// optional image texture on the three small spheres
+	TiledTexture texture;
+	TextureCache textureCache(cacheMB << 20);
+	if (!texturePath.empty())
+	{
+		if (!loadTiledTexture(texturePath, texture))
+		{
+			std::cerr << "Could not load texture " << texturePath << std::endl;
+			return 1;
+		}
+		for (size_t i = 2; i < spheres.size(); ++i)
+		{
+			spheres[i].texture = 0;
+			spheres[i].uvScale = 2.0f;
+		}
+	}
+
+	Scene scene(spheres);
+	if (!texturePath.empty())
+	{
+		scene.textures.push_back(&texture);
+		scene.textureCache = &textureCache;
+	}
+
+	// optional field of instanced trees
+	InstancedGeometry forest;
+	if (forestSize > 0)
+	{
+		buildForest(forest, spheres[0], forestSize);
+		scene.instances = &forest;
+	}
+
+	if (bench)
+	{
+		benchmark(scene, toneMap);
+		return 0;
+	}
+
+#ifndef RT_NO_VIEWER
+	if (view)
+	{
+		return runViewer(640, 480, Camera(), toneMap,
+			[&](const Camera &camera, float jitterX, float jitterY, HDRFramebuffer &image, const std::function<bool()> &cancelled)
+			{
+				renderPass(scene, camera, image, jitterX, jitterY, cancelled);
+			});
+	}
+#endif
+
+	render(scene, toneMap);
+
+	if (scene.textureCache)
+	{
+		std::cout << "texture cache: " << textureCache.hits() << " hits, " << textureCache.misses() << " tiles loaded, "
+			<< (textureCache.sizeBytes() >> 10) << " KB resident" << std::endl << "tile fetches per mip:";
+		for (unsigned l = 0; l < texture.numLevels(); ++l) std::cout << " " << textureCache.levelFetches(l);
+		std::cout << std::endl;
+	}
 
 	return 0;
 }
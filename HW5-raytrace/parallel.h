@@ -0,0 +1,46 @@
+#pragma once
+
+// Minimal fork/join helper: runs p_body(i) for i in [p_begin, p_end) on all
+// hardware threads. Work is handed out in chunks from an atomic counter so
+// rows of uneven cost balance out.
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+inline unsigned workerCount()
+{
+	const unsigned n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+template <class Body>
+void parallelFor(int p_begin, int p_end, const Body &p_body, int p_chunk = 1)
+{
+	const int count = p_end - p_begin;
+	if (count <= 0) return;
+	const unsigned threads = std::min<unsigned>(workerCount(), (unsigned)((count + p_chunk - 1) / p_chunk));
+	if (threads <= 1)
+	{
+		for (int i = p_begin; i < p_end; ++i) p_body(i);
+		return;
+	}
+
+	std::atomic<int> next(p_begin);
+	auto worker = [&]()
+	{
+		for (;;)
+		{
+			const int first = next.fetch_add(p_chunk);
+			if (first >= p_end) break;
+			const int last = std::min(first + p_chunk, p_end);
+			for (int i = first; i < last; ++i) p_body(i);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; ++t) pool.push_back(std::thread(worker));
+	worker();
+	for (auto &t : pool) t.join();
+}
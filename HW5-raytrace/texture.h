@@ -0,0 +1,631 @@
+#pragma once
+
+// Tiled, mip-mapped image textures with a bounded LRU tile cache.
+//
+// A texture is converted once from a PPM into a .rttex file that stores the
+// full mip pyramid as fixed-size tiles. At render time only the tiles that
+// are actually sampled are read from disk, so the texture itself can be much
+// larger than the cache (or than RAM).
+//
+// .rttex layout:
+//   TiledTextureHeader
+//   TiledLevelInfo[numLevels]
+//   tiles of level 0, 1, ... in row-major order, tileSize x tileSize RGB8
+//   (edge tiles are padded by repeating the last row/column)
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "float3.h"
+
+struct TiledTextureHeader
+{
+	char magic[4];		// "RTTX"
+	uint32_t width;
+	uint32_t height;
+	uint32_t tileSize;
+	uint32_t numLevels;
+};
+
+struct TiledLevelInfo
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t tilesX;
+	uint32_t tilesY;
+	uint64_t offset;	// file offset of the first tile of this level
+};
+
+// ----------------------------------------------------------------------------
+
+// last write time in unspecified units, comparable between files; 0 if the
+// file doesn't exist
+inline int64_t fileModifiedTime(const std::string &p_path)
+{
+#if defined(_WIN32)
+	struct _stat64 info;
+	if (_stat64(p_path.c_str(), &info) != 0) return 0;
+	return (int64_t)info.st_mtime;
+#else
+	struct stat info;
+	if (stat(p_path.c_str(), &info) != 0) return 0;
+#if defined(__APPLE__)
+	return int64_t(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+// Read-only file read at explicit offsets (pread, or ReadFile with an
+// OVERLAPPED offset) instead of through a shared file position, so threads
+// loading tiles of the same texture don't wait for each other.
+class PositionedFile
+{
+public:
+	PositionedFile() {}
+	~PositionedFile() { close(); }
+	PositionedFile(const PositionedFile &) = delete;
+	PositionedFile &operator=(const PositionedFile &) = delete;
+
+	bool open(const std::string &p_path)
+	{
+		close();
+#if defined(_WIN32)
+		handle = CreateFileA(p_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		return handle != INVALID_HANDLE_VALUE;
+#else
+		fd = ::open(p_path.c_str(), O_RDONLY);
+		return fd >= 0;
+#endif
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+#else
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+	}
+
+	uint64_t size() const
+	{
+#if defined(_WIN32)
+		LARGE_INTEGER bytes;
+		return GetFileSizeEx(handle, &bytes) ? (uint64_t)bytes.QuadPart : 0;
+#else
+		struct stat info;
+		return fstat(fd, &info) == 0 ? (uint64_t)info.st_size : 0;
+#endif
+	}
+
+	// bytes read; fewer than p_bytes past the end of the file or on an error
+	size_t readAt(uint64_t p_offset, void *p_data, size_t p_bytes) const
+	{
+		size_t done = 0;
+		while (done < p_bytes)
+		{
+#if defined(_WIN32)
+			OVERLAPPED at = {};
+			at.Offset = (DWORD)(p_offset + done);
+			at.OffsetHigh = (DWORD)((p_offset + done) >> 32);
+			DWORD n = 0;
+			const DWORD chunk = (DWORD)std::min<size_t>(p_bytes - done, 1u << 30);
+			if (!ReadFile(handle, (char *)p_data + done, chunk, &n, &at) || n == 0) break;
+#else
+			const ssize_t n = pread(fd, (char *)p_data + done, p_bytes - done, (off_t)(p_offset + done));
+			if (n <= 0) break;
+#endif
+			done += (size_t)n;
+		}
+		return done;
+	}
+
+private:
+#if defined(_WIN32)
+	HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+	int fd = -1;
+#endif
+};
+
+// reads the P6 header, leaves the stream at the first pixel
+inline bool readPPMHeader(std::ifstream &in, unsigned &width, unsigned &height)
+{
+	std::string magic;
+	in >> magic;
+	if (magic != "P6") return false;
+
+	unsigned values[3];
+	for (int i = 0; i < 3; )
+	{
+		in >> std::ws;
+		if (in.peek() == '#') { std::string comment; std::getline(in, comment); continue; }
+		if (!(in >> values[i])) return false;
+		++i;
+	}
+	in.get(); // single whitespace before the pixel data
+	width = values[0];
+	height = values[1];
+	return values[2] == 255 && width > 0 && height > 0;
+}
+
+// Streams a PPM into a tiled mip pyramid. Rows are pushed into level 0 one at
+// a time and every level box-filters row pairs into the next one, so memory
+// stays at a strip of tileSize rows per level no matter how large the image is.
+// A short read or write fails the build and removes the partial file.
+class TiledTextureWriter
+{
+public:
+	bool build(const std::string &p_ppmPath, const std::string &p_outPath, unsigned p_tileSize)
+	{
+		std::ifstream in(p_ppmPath.c_str(), std::ios::in | std::ios::binary);
+		unsigned width, height;
+		if (!in.is_open() || !readPPMHeader(in, width, height))
+		{
+			std::cerr << "Could not read PPM " << p_ppmPath << std::endl;
+			return false;
+		}
+
+		tileSize = p_tileSize;
+		levels.clear();
+		infos.clear();
+		uint64_t offset = sizeof(TiledTextureHeader);
+		for (unsigned w = width, h = height; ; w = std::max(1u, (w + 1) / 2), h = std::max(1u, (h + 1) / 2))
+		{
+			TiledLevelInfo info;
+			info.width = w;
+			info.height = h;
+			info.tilesX = (w + tileSize - 1) / tileSize;
+			info.tilesY = (h + tileSize - 1) / tileSize;
+			infos.push_back(info);
+			if (w == 1 && h == 1) break;
+		}
+		offset += infos.size() * sizeof(TiledLevelInfo);
+		for (auto &info : infos)
+		{
+			info.offset = offset;
+			offset += uint64_t(info.tilesX) * info.tilesY * tileSize * tileSize * 3;
+		}
+
+		out = std::fopen(p_outPath.c_str(), "wb");
+		if (!out) return false;
+		ok = true;
+
+		TiledTextureHeader header;
+		std::memcpy(header.magic, "RTTX", 4);
+		header.width = width;
+		header.height = height;
+		header.tileSize = tileSize;
+		header.numLevels = (uint32_t)infos.size();
+		ok = std::fwrite(&header, sizeof(header), 1, out) == 1
+			&& std::fwrite(infos.data(), sizeof(TiledLevelInfo), infos.size(), out) == infos.size();
+
+		levels.resize(infos.size());
+		for (size_t l = 0; l < infos.size(); ++l)
+		{
+			levels[l].strip.resize(size_t(tileSize) * infos[l].width * 3);
+			levels[l].pending.resize(size_t(infos[l].width) * 3);
+		}
+
+		std::vector<uint8_t> row(size_t(width) * 3);
+		for (unsigned y = 0; y < height && ok; ++y)
+		{
+			if (!in.read((char *)row.data(), row.size()))
+			{
+				std::cerr << "PPM " << p_ppmPath << " ends after " << y << " of " << height << " rows" << std::endl;
+				ok = false;
+				break;
+			}
+			pushRow(0, row.data());
+		}
+
+		// odd heights leave one unpaired row per level
+		for (size_t l = 0; l + 1 < levels.size() && ok; ++l)
+		{
+			if (levels[l].hasPending)
+			{
+				levels[l].hasPending = false;
+				pushDownsampled(l, levels[l].pending.data(), levels[l].pending.data());
+			}
+		}
+
+		ok = std::fclose(out) == 0 && ok;
+		out = nullptr;
+		if (!ok)
+		{
+			std::cerr << "Could not build tiled texture " << p_outPath << std::endl;
+			std::remove(p_outPath.c_str());
+		}
+		return ok;
+	}
+
+private:
+	struct Level
+	{
+		std::vector<uint8_t> strip;		// up to tileSize rows
+		std::vector<uint8_t> pending;	// first row of the next pair
+		unsigned rowsInStrip = 0;
+		unsigned rowsTotal = 0;
+		unsigned tileRow = 0;
+		bool hasPending = false;
+	};
+
+	void pushRow(size_t l, const uint8_t *row)
+	{
+		Level &level = levels[l];
+		const TiledLevelInfo &info = infos[l];
+		const size_t rowBytes = size_t(info.width) * 3;
+		std::memcpy(&level.strip[level.rowsInStrip * rowBytes], row, rowBytes);
+		++level.rowsInStrip;
+		++level.rowsTotal;
+		if (level.rowsInStrip == tileSize || level.rowsTotal == info.height) flushStrip(l);
+
+		if (l + 1 < levels.size())
+		{
+			if (!level.hasPending)
+			{
+				std::memcpy(level.pending.data(), row, rowBytes);
+				level.hasPending = true;
+			}
+			else
+			{
+				level.hasPending = false;
+				pushDownsampled(l, level.pending.data(), row);
+			}
+		}
+	}
+
+	void pushDownsampled(size_t l, const uint8_t *row0, const uint8_t *row1)
+	{
+		const unsigned w = infos[l].width;
+		const unsigned nw = infos[l + 1].width;
+		std::vector<uint8_t> next(size_t(nw) * 3);
+		for (unsigned x = 0; x < nw; ++x)
+		{
+			const unsigned x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+			for (int c = 0; c < 3; ++c)
+			{
+				const unsigned sum = row0[3 * x0 + c] + row0[3 * x1 + c] + row1[3 * x0 + c] + row1[3 * x1 + c];
+				next[3 * x + c] = (uint8_t)((sum + 2) / 4);
+			}
+		}
+		pushRow(l + 1, next.data());
+	}
+
+	void flushStrip(size_t l)
+	{
+		Level &level = levels[l];
+		const TiledLevelInfo &info = infos[l];
+		const size_t rowBytes = size_t(info.width) * 3;
+		std::vector<uint8_t> tile(size_t(tileSize) * tileSize * 3);
+		for (unsigned tx = 0; tx < info.tilesX; ++tx)
+		{
+			for (unsigned y = 0; y < tileSize; ++y)
+			{
+				const unsigned sy = std::min(y, level.rowsInStrip - 1);
+				for (unsigned x = 0; x < tileSize; ++x)
+				{
+					const unsigned sx = std::min(tx * tileSize + x, info.width - 1);
+					std::memcpy(&tile[3 * (y * tileSize + x)], &level.strip[sy * rowBytes + 3 * sx], 3);
+				}
+			}
+			const uint64_t index = uint64_t(level.tileRow) * info.tilesX + tx;
+			const uint64_t pos = info.offset + index * tile.size();
+#ifdef _WIN32
+			const bool seeked = _fseeki64(out, (long long)pos, SEEK_SET) == 0;
+#else
+			const bool seeked = fseeko(out, (off_t)pos, SEEK_SET) == 0;
+#endif
+			ok = ok && seeked && std::fwrite(tile.data(), 1, tile.size(), out) == tile.size();
+		}
+		++level.tileRow;
+		level.rowsInStrip = 0;
+	}
+
+	unsigned tileSize = 64;
+	std::vector<TiledLevelInfo> infos;
+	std::vector<Level> levels;
+	FILE *out = nullptr;
+	bool ok = false;		// no read or write has failed
+};
+
+// ----------------------------------------------------------------------------
+
+struct TextureTile
+{
+	std::vector<uint8_t> texels;	// tileSize * tileSize RGB8
+};
+
+class TiledTexture;
+
+// Bounded LRU cache of texture tiles shared by all textures. Tiles are handed
+// out as shared_ptr so an eviction never frees a tile another thread is
+// still filtering.
+//
+// Every render thread fetches tiles, so the cache is split into shards by
+// tile key, each with its own lock, LRU list and an even share of the byte
+// budget; threads sampling different tiles rarely wait for each other.
+class TextureCache
+{
+public:
+	static const unsigned SHARDS = 16;
+
+	explicit TextureCache(size_t p_maxBytes) : maxShardBytes(p_maxBytes / SHARDS) {}
+
+	std::shared_ptr<const TextureTile> fetch(const TiledTexture &p_texture, unsigned p_level, unsigned p_tx, unsigned p_ty);
+
+	// statistics, summed over the shards
+	size_t sizeBytes() const { return sum([](const Shard &s) { return uint64_t(s.bytes); }); }
+	uint64_t hits() const { return sum([](const Shard &s) { return s.hits; }); }
+	uint64_t misses() const { return sum([](const Shard &s) { return s.misses; }); }
+	uint64_t levelFetches(unsigned p_level) const { return sum([&](const Shard &s) { return s.levelFetches[std::min(p_level, 15u)]; }); }
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<const TextureTile> tile;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	struct Shard
+	{
+		size_t bytes = 0;
+		std::list<uint64_t> lru;	// most recently used first
+		std::unordered_map<uint64_t, Entry> entries;
+		uint64_t hits = 0, misses = 0;
+		uint64_t levelFetches[16] = {};
+		mutable std::mutex mutex;
+	};
+
+	Shard &shard(uint64_t p_key) { return shards[(p_key * 0x9E3779B97F4A7C15ull) >> 60]; }
+
+	template <typename Field>
+	uint64_t sum(Field p_field) const
+	{
+		uint64_t total = 0;
+		for (const Shard &s : shards)
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			total += p_field(s);
+		}
+		return total;
+	}
+
+	size_t maxShardBytes;
+	Shard shards[SHARDS];
+};
+
+class TiledTexture
+{
+public:
+	// false, with the file closed, unless every tile the header promises is
+	// in the file
+	bool open(const std::string &p_path)
+	{
+		if (!file.open(p_path)) return false;
+		if (!readLayout())
+		{
+			file.close();
+			return false;
+		}
+		static std::atomic<unsigned> nextID{ 0 };
+		id = nextID++;
+		return true;
+	}
+
+	unsigned width() const { return header.width; }
+	unsigned height() const { return header.height; }
+	unsigned numLevels() const { return header.numLevels; }
+	unsigned tileSize() const { return header.tileSize; }
+	unsigned cacheID() const { return id; }
+
+	// null if the tile can't be read (the file changed under us); the first
+	// failure is reported
+	std::shared_ptr<TextureTile> loadTile(unsigned p_level, unsigned p_tx, unsigned p_ty) const
+	{
+		const TiledLevelInfo &info = levels[p_level];
+		const size_t tileBytes = size_t(header.tileSize) * header.tileSize * 3;
+		std::shared_ptr<TextureTile> tile = std::make_shared<TextureTile>();
+		tile->texels.resize(tileBytes);
+
+		const uint64_t offset = info.offset + (uint64_t(p_ty) * info.tilesX + p_tx) * tileBytes;
+		if (file.readAt(offset, tile->texels.data(), tileBytes) != tileBytes)
+		{
+			if (!readFailed.exchange(true)) std::cerr << "Could not read texture tile " << p_tx << "," << p_ty << " of level " << p_level << std::endl;
+			return nullptr;
+		}
+		return tile;
+	}
+
+	// Trilinear lookup with repeat addressing. p_footprint is the size of the
+	// pixel footprint in uv units (from the ray differential); it picks the mip
+	// so distant or small surfaces only touch the coarse levels.
+	float3 sample(TextureCache &p_cache, float p_u, float p_v, float p_footprint) const
+	{
+		const float texels = p_footprint * float(std::max(header.width, header.height));
+		const float lod = std::min(std::max(texels > 1.0f ? std::log2(texels) : 0.0f, 0.0f), float(header.numLevels - 1));
+		const unsigned l0 = (unsigned)lod;
+		const float f = lod - float(l0);
+
+		TileLookup lookup(*this, p_cache);
+		const float3 c0 = bilinear(lookup, l0, p_u, p_v);
+		if (f < 1.0f / 256.0f || l0 + 1 >= header.numLevels) return c0;
+		const float3 c1 = bilinear(lookup, l0 + 1, p_u, p_v);
+		return (1.0f - f) * c0 + f * c1;
+	}
+
+private:
+	// remembers the last tile so the 4 taps of a bilinear lookup usually cost
+	// one cache access
+	struct TileLookup
+	{
+		const TiledTexture &texture;
+		TextureCache &cache;
+		std::shared_ptr<const TextureTile> tile;
+		unsigned level = ~0u, tx = ~0u, ty = ~0u;
+
+		TileLookup(const TiledTexture &p_texture, TextureCache &p_cache) : texture(p_texture), cache(p_cache) {}
+
+		float3 texel(unsigned p_level, unsigned x, unsigned y)
+		{
+			const unsigned ts = texture.header.tileSize;
+			const unsigned ntx = x / ts, nty = y / ts;
+			if (p_level != level || ntx != tx || nty != ty)
+			{
+				tile = cache.fetch(texture, p_level, ntx, nty);
+				level = p_level; tx = ntx; ty = nty;
+			}
+			if (!tile) return float3(1.0f, 0.0f, 1.0f);	// unreadable tile
+			const uint8_t *t = &tile->texels[3 * ((y % ts) * ts + (x % ts))];
+			return float3(t[0], t[1], t[2]) * (1.0f / 255.0f);
+		}
+	};
+
+	float3 bilinear(TileLookup &p_lookup, unsigned p_level, float p_u, float p_v) const
+	{
+		const TiledLevelInfo &info = levels[p_level];
+		const float x = (p_u - std::floor(p_u)) * info.width - 0.5f;
+		const float y = (p_v - std::floor(p_v)) * info.height - 0.5f;
+		const float fx = std::floor(x), fy = std::floor(y);
+		const float ax = x - fx, ay = y - fy;
+		const unsigned x0 = (unsigned)(((int)fx + (int)info.width) % (int)info.width);
+		const unsigned y0 = (unsigned)(((int)fy + (int)info.height) % (int)info.height);
+		const unsigned x1 = (x0 + 1) % info.width;
+		const unsigned y1 = (y0 + 1) % info.height;
+
+		const float3 c00 = p_lookup.texel(p_level, x0, y0);
+		const float3 c10 = p_lookup.texel(p_level, x1, y0);
+		const float3 c01 = p_lookup.texel(p_level, x0, y1);
+		const float3 c11 = p_lookup.texel(p_level, x1, y1);
+		return (1.0f - ay) * ((1.0f - ax) * c00 + ax * c10) + ay * ((1.0f - ax) * c01 + ax * c11);
+	}
+
+	// reads the header and level table and checks them against each other
+	// and the file size; a build killed partway leaves a header over
+	// missing tiles
+	bool readLayout()
+	{
+		if (file.readAt(0, &header, sizeof(header)) != sizeof(header) || std::memcmp(header.magic, "RTTX", 4) != 0
+			|| header.tileSize == 0 || header.numLevels == 0 || header.numLevels > 32) return false;
+		levels.resize(header.numLevels);
+		const size_t levelBytes = sizeof(TiledLevelInfo) * levels.size();
+		if (file.readAt(sizeof(header), levels.data(), levelBytes) != levelBytes) return false;
+		const uint64_t fileSize = file.size();
+		const uint64_t tileBytes = uint64_t(header.tileSize) * header.tileSize * 3;
+		uint64_t end = sizeof(header) + sizeof(TiledLevelInfo) * levels.size();
+		for (unsigned l = 0; l < header.numLevels; ++l)
+		{
+			const TiledLevelInfo &info = levels[l];
+			const unsigned w = l == 0 ? header.width : std::max(1u, (levels[l - 1].width + 1) / 2);
+			const unsigned h = l == 0 ? header.height : std::max(1u, (levels[l - 1].height + 1) / 2);
+			if (info.width != w || info.height != h || w == 0 || h == 0
+				|| info.tilesX != (w + header.tileSize - 1) / header.tileSize || info.tilesY != (h + header.tileSize - 1) / header.tileSize
+				|| info.offset < end) return false;
+			end = info.offset + uint64_t(info.tilesX) * info.tilesY * tileBytes;
+		}
+		return end <= fileSize;
+	}
+
+	TiledTextureHeader header;
+	std::vector<TiledLevelInfo> levels;
+	unsigned id = 0;
+	PositionedFile file;		// read by every thread that misses the cache
+	mutable std::atomic<bool> readFailed{ false };
+};
+
+inline std::shared_ptr<const TextureTile> TextureCache::fetch(const TiledTexture &p_texture, unsigned p_level, unsigned p_tx, unsigned p_ty)
+{
+	const uint64_t key = (uint64_t(p_texture.cacheID()) << 48) | (uint64_t(p_level) << 40) | (uint64_t(p_ty) << 20) | uint64_t(p_tx);
+	Shard &s = shard(key);
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.levelFetches[std::min(p_level, 15u)]++;
+		auto it = s.entries.find(key);
+		if (it != s.entries.end())
+		{
+			s.lru.splice(s.lru.begin(), s.lru, it->second.lru);
+			s.hits++;
+			return it->second.tile;
+		}
+	}
+
+	// load outside the shard lock so other threads keep sampling resident tiles
+	std::shared_ptr<const TextureTile> tile = p_texture.loadTile(p_level, p_tx, p_ty);
+
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.misses++;
+	if (!tile) return tile;	// not cached, so a later fetch tries again
+	auto it = s.entries.find(key);
+	if (it != s.entries.end()) return it->second.tile; // another thread won the race
+
+	s.lru.push_front(key);
+	Entry entry;
+	entry.tile = tile;
+	entry.lru = s.lru.begin();
+	s.entries[key] = entry;
+	s.bytes += tile->texels.size();
+
+	while (s.bytes > maxShardBytes && s.lru.size() > 1)
+	{
+		auto victim = s.entries.find(s.lru.back());
+		s.bytes -= victim->second.tile->texels.size();
+		s.entries.erase(victim);
+		s.lru.pop_back();
+	}
+	return tile;
+}
+
+// converts p_ppmPath to a .rttex next to it unless one at least as new as
+// the PPM already exists. The build goes to a .tmp that is renamed when it
+// is complete, so an interrupted build never leaves a .rttex behind.
+inline bool loadTiledTexture(const std::string &p_ppmPath, TiledTexture &p_texture, unsigned p_tileSize = 64)
+{
+	const std::string tiledPath = p_ppmPath + ".rttex";
+	const int64_t tiledTime = fileModifiedTime(tiledPath);
+	if (!tiledTime || tiledTime < fileModifiedTime(p_ppmPath) || !p_texture.open(tiledPath))
+	{
+		std::cout << "Building tiled texture " << tiledPath << std::endl;
+		const std::string buildPath = tiledPath + ".tmp";
+		TiledTextureWriter writer;
+		if (!writer.build(p_ppmPath, buildPath, p_tileSize)) return false;
+		std::remove(tiledPath.c_str());
+		if (std::rename(buildPath.c_str(), tiledPath.c_str()) != 0)
+		{
+			std::cerr << "Could not rename " << buildPath << " to " << tiledPath << std::endl;
+			std::remove(buildPath.c_str());
+			return false;
+		}
+		if (!p_texture.open(tiledPath)) return false;
+	}
+	std::cout << "Texture " << p_texture.width() << "x" << p_texture.height() << ", "
+		<< p_texture.numLevels() << " mip levels" << std::endl;
+	return true;
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+// Interactive progressive preview (main --view).
+//
+// A render thread keeps adding jittered passes to an HDRFramebuffer, one
+// sample per pixel per pass, and restarts from scratch whenever the camera
+// moves. The display thread owns the GL context and never waits for the
+// tracer. It keeps one of two pixel buffer objects mapped; when a pass is
+// done the render thread tone maps straight into that mapping, and the
+// display thread unmaps it and starts an asynchronous texture upload from it
+// while the other PBO is mapped for the next pass.
+//
+// Controls: W/S forward/back, A/D strafe, Q/E down/up, arrow keys look
+// around, T cycles the tone map operator, R resets the camera, Esc quits.
+
+#include "GL/glew.h"
+#include "GLFW/glfw3.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "camera.h"
+#include "framebuffer.h"
+
+typedef std::function<void(const Camera &, float, float, HDRFramebuffer &, const std::function<bool()> &)> RenderPassFunction;
+
+class ProgressiveViewer
+{
+public:
+	ProgressiveViewer(unsigned p_width, unsigned p_height, const Camera &p_camera, const ToneMapSettings &p_toneMap, const RenderPassFunction &p_renderPass)
+		: width(p_width), height(p_height), camera(p_camera), startCamera(p_camera), toneMap(p_toneMap), renderPass(p_renderPass)
+	{
+		camera.update();
+		startCamera.update();
+	}
+
+	int run()
+	{
+		glfwSetErrorCallback(glfwErrorCallback);
+		if (!glfwInit())
+		{
+			std::cerr << "GLFW Error: Could not initialize GLFW library" << std::endl;
+			return 1;
+		}
+		window = glfwCreateWindow(width, height, "HW5-Raytracing", NULL, NULL);
+		if (!window)
+		{
+			glfwTerminate();
+			std::cerr << "GLFW Error: Could not initialize window" << std::endl;
+			return 1;
+		}
+		glfwSetWindowUserPointer(window, this);
+		glfwSetKeyCallback(window, glfwKeyCallback);
+		glfwMakeContextCurrent(window);
+		glfwSwapInterval(1);
+
+		if (glewInit() != GLEW_OK || !GLEW_VERSION_2_1)
+		{
+			std::cerr << "GLEW Error: pixel buffer objects need OpenGL 2.1" << std::endl;
+			glfwTerminate();
+			return 1;
+		}
+
+		initGL();
+		std::thread renderThread(&ProgressiveViewer::renderLoop, this);
+		displayLoop();
+
+		quit = true;
+		renderThread.join();
+		if (mapped)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[writeIndex]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		glDeleteBuffers(2, pbo);
+		glDeleteTextures(1, &texture);
+		glfwTerminate();
+		return 0;
+	}
+
+private:
+	static const unsigned maxPasses = 1024;
+
+	static void glfwErrorCallback(int error, const char* description)
+	{
+		std::cerr << "GLFW Error " << error << ": " << description << std::endl;
+	}
+
+	static void glfwKeyCallback(GLFWwindow* p_window, int p_key, int p_scancode, int p_action, int p_mods)
+	{
+		ProgressiveViewer *viewer = (ProgressiveViewer *)glfwGetWindowUserPointer(p_window);
+		if (p_action != GLFW_PRESS) return;
+		if (p_key == GLFW_KEY_ESCAPE) glfwSetWindowShouldClose(p_window, GL_TRUE);
+		if (p_key == GLFW_KEY_R)
+		{
+			std::lock_guard<std::mutex> lock(viewer->cameraMutex);
+			viewer->camera = viewer->startCamera;
+			viewer->generation++;
+		}
+		if (p_key == GLFW_KEY_T)
+		{
+			// only the resolve changes, the accumulated passes stay valid
+			std::lock_guard<std::mutex> lock(viewer->cameraMutex);
+			viewer->toneMap.op = ToneMap(((int)viewer->toneMap.op + 1) % 4);
+			viewer->redeliver = true;
+		}
+	}
+
+	void initGL()
+	{
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+		glGenBuffers(2, pbo);
+		for (int i = 0; i < 2; ++i)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, frameBytes(), NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_LIGHTING);
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glOrtho(0, 1, 0, 1, -1, 1);
+		glMatrixMode(GL_MODELVIEW);
+		glLoadIdentity();
+	}
+
+	size_t frameBytes() const { return size_t(width) * height * 3; }
+
+	// ------------------------------------------------------------------------
+	// display thread
+
+	void displayLoop()
+	{
+		double lastTime = glfwGetTime();
+		while (!glfwWindowShouldClose(window))
+		{
+			glfwPollEvents();
+			const double now = glfwGetTime();
+			handleMovement(float(now - lastTime));
+			lastTime = now;
+
+			// hand a mapped PBO to the render thread
+			if (!mapped)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[writeIndex]);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, frameBytes(), NULL, GL_STREAM_DRAW); // orphan
+				uint8_t *ptr = (uint8_t *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				if (ptr)
+				{
+					std::lock_guard<std::mutex> lock(slotMutex);
+					slot = ptr;
+					slotFilled = false;
+					mapped = true;
+				}
+			}
+
+			// upload a finished frame without stalling on the copy
+			bool upload = false;
+			unsigned passes = 0;
+			{
+				std::lock_guard<std::mutex> lock(slotMutex);
+				if (slotFilled)
+				{
+					slot = nullptr;
+					slotFilled = false;
+					upload = true;
+					passes = slotPasses;
+				}
+			}
+			if (upload)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[writeIndex]);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glBindTexture(GL_TEXTURE_2D, texture);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				writeIndex ^= 1;
+				mapped = false;
+
+				std::ostringstream title;
+				title << "HW5-Raytracing - " << passes << " passes";
+				glfwSetWindowTitle(window, title.str().c_str());
+			}
+
+			glClear(GL_COLOR_BUFFER_BIT);
+			glEnable(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glColor3f(1.0f, 1.0f, 1.0f);
+			glBegin(GL_QUADS);
+			glTexCoord2f(0, 0); glVertex2f(0, 0);
+			glTexCoord2f(1, 0); glVertex2f(1, 0);
+			glTexCoord2f(1, 1); glVertex2f(1, 1);
+			glTexCoord2f(0, 1); glVertex2f(0, 1);
+			glEnd();
+			glDisable(GL_TEXTURE_2D);
+
+			glfwSwapBuffers(window);
+		}
+	}
+
+	void handleMovement(float dt)
+	{
+		const float move = 10.0f * dt, turn = 1.0f * dt;
+		float3 delta;
+		float yaw = 0.0f, pitch = 0.0f;
+		if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) delta += move * camera.forward;
+		if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) delta -= move * camera.forward;
+		if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) delta += move * camera.right;
+		if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) delta -= move * camera.right;
+		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) delta += float3(0, move, 0);
+		if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) delta -= float3(0, move, 0);
+		if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) yaw += turn;
+		if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) yaw -= turn;
+		if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) pitch += turn;
+		if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) pitch -= turn;
+		if (dot(delta, delta) == 0.0f && yaw == 0.0f && pitch == 0.0f) return;
+
+		std::lock_guard<std::mutex> lock(cameraMutex);
+		camera.origin += delta;
+		camera.yaw += yaw;
+		camera.pitch = std::min(std::max(camera.pitch + pitch, -1.5f), 1.5f);
+		camera.update();
+		generation++;
+	}
+
+	// ------------------------------------------------------------------------
+	// render thread
+
+	void renderLoop()
+	{
+		HDRFramebuffer image(width, height);
+		Camera passCamera;
+		ToneMapSettings passToneMap;
+		unsigned seen = ~0u;
+		bool undelivered = false;
+
+		while (!quit)
+		{
+			{
+				std::lock_guard<std::mutex> lock(cameraMutex);
+				if (generation != seen)
+				{
+					seen = generation;
+					passCamera = camera;
+					image.clear();
+					undelivered = false;
+				}
+				if (redeliver)
+				{
+					redeliver = false;
+					undelivered = image.getPasses() > 0;
+				}
+				passToneMap = toneMap;
+			}
+
+			if (undelivered) undelivered = !deliver(image, passToneMap);
+
+			if (image.getPasses() >= maxPasses)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				continue;
+			}
+
+			// the first pass samples pixel centers, later ones follow a Halton sequence
+			const unsigned pass = image.getPasses();
+			const float jitterX = pass ? halton(pass, 2) : 0.5f;
+			const float jitterY = pass ? halton(pass, 3) : 0.5f;
+			const unsigned passGeneration = seen;
+			renderPass(passCamera, jitterX, jitterY, image, [&] { return quit || generation != passGeneration; });
+			if (quit || generation != passGeneration) continue; // aborted, restart with the new camera
+
+			image.endPass();
+			undelivered = !deliver(image, passToneMap);
+		}
+	}
+
+	// tone maps into the mapped PBO if the display thread offered one
+	bool deliver(const HDRFramebuffer &p_image, const ToneMapSettings &p_toneMap)
+	{
+		uint8_t *target;
+		{
+			std::lock_guard<std::mutex> lock(slotMutex);
+			if (!slot || slotFilled) return false;
+			target = slot;
+		}
+		// the display thread only unmaps once slotFilled is set, so the
+		// mapping stays valid while we write
+		p_image.resolveRows(p_toneMap, target, size_t(width) * 3, 0, height, true);
+		std::lock_guard<std::mutex> lock(slotMutex);
+		slotFilled = true;
+		slotPasses = p_image.getPasses();
+		return true;
+	}
+
+	static float halton(unsigned i, unsigned base)
+	{
+		float f = 1.0f, r = 0.0f;
+		for (; i > 0; i /= base)
+		{
+			f /= base;
+			r += f * (i % base);
+		}
+		return r;
+	}
+
+	unsigned width, height;
+	GLFWwindow *window = nullptr;
+	GLuint texture = 0;
+	GLuint pbo[2] = { 0, 0 };
+	unsigned writeIndex = 0;
+	bool mapped = false;
+
+	// shared with the render thread
+	std::mutex cameraMutex;
+	Camera camera, startCamera;
+	ToneMapSettings toneMap;
+	bool redeliver = false;
+	std::atomic<unsigned> generation{ 0 };
+	std::atomic<bool> quit{ false };
+
+	std::mutex slotMutex;
+	uint8_t *slot = nullptr;	// mapped PBO offered by the display thread
+	bool slotFilled = false;
+	unsigned slotPasses = 0;
+
+	RenderPassFunction renderPass;
+};
+
+inline int runViewer(unsigned p_width, unsigned p_height, const Camera &p_camera, const ToneMapSettings &p_toneMap, const RenderPassFunction &p_renderPass)
+{
+	ProgressiveViewer viewer(p_width, p_height, p_camera, p_toneMap, p_renderPass);
+	return viewer.run();
+}